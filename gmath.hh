@@ -39,12 +39,18 @@
 
 #pragma once
 
-#include <algorithm> // for swap()
-#include <cassert>   // for assert()
-#include <cmath>     // for acos(), sqrt()
-#include <memory>    // for shared_ptr
-#include <iomanip>   // for setw
-#include <iostream>  // for cout
+#include <algorithm>   // for swap()
+#include <cassert>     // for assert()
+#include <cmath>       // for acos(), sqrt()
+#include <memory>      // for shared_ptr
+#include <iomanip>     // for setw
+#include <iostream>    // for cout
+#include <limits>      // for numeric_limits
+#include <type_traits> // for is_trivially_copyable
+
+#if defined(__SSE2__)
+#include <immintrin.h> // for SSE2 and AVX intrinsics
+#endif
 
 namespace gmath {
 
@@ -89,6 +95,473 @@ namespace gmath {
     return (delta <= APPROXIMATE_EQUAL_EPSILON);
   }
 
+  // Loops over the elements of a vector, unrolled at compile time:
+  // Unroll<0, N>::f() handles element 0 and then calls
+  // Unroll<1, N>::f(), and so on, until the empty Unroll<N, N>
+  // specialization ends the recursion. With optimization on, this
+  // leaves straight-line code with no loop counter.
+  template <int INDEX, int END>
+  struct Unroll {
+    // Set destination[i] = value for every i.
+    template <typename SCALAR>
+    static constexpr void fill(SCALAR* destination, SCALAR value) {
+      destination[INDEX] = value;
+      Unroll<INDEX + 1, END>::fill(destination, value);
+    }
+
+    // Set destination[i] = source[i] for every i.
+    template <typename SCALAR, typename SOURCE>
+    static constexpr void assign(SCALAR* destination, const SOURCE& source) {
+      destination[INDEX] = source[INDEX];
+      Unroll<INDEX + 1, END>::assign(destination, source);
+    }
+
+    // Return sum plus left[i] * right[i] for every i, added in order.
+    template <typename SCALAR, typename LEFT, typename RIGHT>
+    static constexpr SCALAR dot(const LEFT& left, const RIGHT& right, SCALAR sum) {
+      return Unroll<INDEX + 1, END>::dot(left, right, sum + left[INDEX] * right[INDEX]);
+    }
+  };
+
+  template <int END>
+  struct Unroll<END, END> {
+    template <typename SCALAR>
+    static constexpr void fill(SCALAR*, SCALAR) { }
+
+    template <typename SCALAR, typename SOURCE>
+    static constexpr void assign(SCALAR*, const SOURCE&) { }
+
+    template <typename SCALAR, typename LEFT, typename RIGHT>
+    static constexpr SCALAR dot(const LEFT&, const RIGHT&, SCALAR sum) { return sum; }
+  };
+
+  // SIMD kernels for the vector types that fit in vector registers,
+  // used by Vector below. The primary template covers every other
+  // vector, which is evaluated one element at a time. Loads and stores
+  // are unaligned, since std::vector and operator new only promise 16
+  // byte alignment in C++11; on current processors they are as fast
+  // as aligned ones when the data happens to be aligned.
+  //
+  // Every lane does exactly the arithmetic the scalar code would, and
+  // dot products add their lanes in index order, so results are
+  // bit-identical with or without SIMD. The exception is
+  // multiply_add(), which is fused into one rounding when the target
+  // has FMA instructions; it is only used by the fast math functions
+  // below.
+  template <typename SCALAR, const int DIMENSION>
+  struct Simd {
+    static const bool enabled = false;
+    static const int alignment = alignof(SCALAR);
+    typedef void packet_type;
+  };
+
+#if defined(__SSE2__)
+  // Four floats: one SSE register.
+  template <>
+  struct Simd<float, 4> {
+    static const bool enabled = true;
+    static const int alignment = 16;
+    typedef __m128 packet_type;
+
+    static packet_type load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, packet_type a) { _mm_storeu_ps(p, a); }
+    static packet_type broadcast(float s) { return _mm_set1_ps(s); }
+    static packet_type add(packet_type a, packet_type b) { return _mm_add_ps(a, b); }
+    static packet_type subtract(packet_type a, packet_type b) { return _mm_sub_ps(a, b); }
+    static packet_type multiply(packet_type a, packet_type b) { return _mm_mul_ps(a, b); }
+    static packet_type divide(packet_type a, packet_type b) { return _mm_div_ps(a, b); }
+    // flip the sign bits, so that -0 and NaN come out as they would
+    // from scalar negation
+    static packet_type negate(packet_type a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+#if defined(__FMA__)
+    static packet_type multiply_add(packet_type a, packet_type b, packet_type c) { return _mm_fmadd_ps(a, b, c); }
+#else
+    static packet_type multiply_add(packet_type a, packet_type b, packet_type c) { return add(multiply(a, b), c); }
+#endif
+
+    static float dot(packet_type a, packet_type b) {
+      float p[4];
+      _mm_storeu_ps(p, _mm_mul_ps(a, b));
+      return (((0.0f + p[0]) + p[1]) + p[2]) + p[3];
+    }
+
+    // (a1 b2 - a2 b1, a2 b0 - a0 b2, a0 b1 - a1 b0, 0)
+    static packet_type cross(packet_type a, packet_type b) {
+      packet_type a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)),
+        a_zxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2)),
+        b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1)),
+        b_zxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2)),
+        xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+      return _mm_and_ps(_mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx)), xyz);
+    }
+  };
+
+  // Four doubles: one AVX register, or a pair of SSE2 registers.
+  template <>
+  struct Simd<double, 4> {
+    static const bool enabled = true;
+    static const int alignment = 16;
+#if defined(__AVX__)
+    typedef __m256d packet_type;
+
+    static packet_type load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, packet_type a) { _mm256_storeu_pd(p, a); }
+    static packet_type broadcast(double s) { return _mm256_set1_pd(s); }
+    static packet_type add(packet_type a, packet_type b) { return _mm256_add_pd(a, b); }
+    static packet_type subtract(packet_type a, packet_type b) { return _mm256_sub_pd(a, b); }
+    static packet_type multiply(packet_type a, packet_type b) { return _mm256_mul_pd(a, b); }
+    static packet_type divide(packet_type a, packet_type b) { return _mm256_div_pd(a, b); }
+    static packet_type negate(packet_type a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+#if defined(__FMA__)
+    static packet_type multiply_add(packet_type a, packet_type b, packet_type c) { return _mm256_fmadd_pd(a, b, c); }
+#else
+    static packet_type multiply_add(packet_type a, packet_type b, packet_type c) { return add(multiply(a, b), c); }
+#endif
+
+    // AVX (without AVX2) can't shuffle across its two halves, so
+    // work on the halves separately.
+    static packet_type cross(packet_type a, packet_type b) {
+      __m128d lo, hi;
+      cross_halves(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1),
+                   _mm256_castpd256_pd128(b), _mm256_extractf128_pd(b, 1), lo, hi);
+      return _mm256_insertf128_pd(_mm256_castpd128_pd256(lo), hi, 1);
+    }
+#else
+    struct packet_type {
+      __m128d lo, hi;
+    };
+
+    static packet_type load(const double* p) { return make(_mm_loadu_pd(p), _mm_loadu_pd(p + 2)); }
+    static void store(double* p, packet_type a) { _mm_storeu_pd(p, a.lo); _mm_storeu_pd(p + 2, a.hi); }
+    static packet_type broadcast(double s) { return make(_mm_set1_pd(s), _mm_set1_pd(s)); }
+    static packet_type add(packet_type a, packet_type b) { return make(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)); }
+    static packet_type subtract(packet_type a, packet_type b) { return make(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)); }
+    static packet_type multiply(packet_type a, packet_type b) { return make(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)); }
+    static packet_type divide(packet_type a, packet_type b) { return make(_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)); }
+    static packet_type negate(packet_type a) {
+      __m128d sign = _mm_set1_pd(-0.0);
+      return make(_mm_xor_pd(a.lo, sign), _mm_xor_pd(a.hi, sign));
+    }
+    // FMA implies AVX, so this path never has it
+    static packet_type multiply_add(packet_type a, packet_type b, packet_type c) { return add(multiply(a, b), c); }
+
+    static packet_type cross(packet_type a, packet_type b) {
+      packet_type c;
+      cross_halves(a.lo, a.hi, b.lo, b.hi, c.lo, c.hi);
+      return c;
+    }
+
+    static packet_type make(__m128d lo, __m128d hi) {
+      packet_type a;
+      a.lo = lo;
+      a.hi = hi;
+      return a;
+    }
+#endif
+
+    static double dot(packet_type a, packet_type b) {
+      double p[4];
+      store(p, multiply(a, b));
+      return (((0.0 + p[0]) + p[1]) + p[2]) + p[3];
+    }
+
+    // The cross product of (a_lo, a_hi) and (b_lo, b_hi), with each
+    // vector as its (x, y) and (z, w) halves.
+    static void cross_halves(__m128d a_lo, __m128d a_hi, __m128d b_lo, __m128d b_hi,
+                             __m128d& lo, __m128d& hi) {
+      // (y, z) and (x, x) of each operand, then (z, x) and (y, y)
+      __m128d a_yz = _mm_shuffle_pd(a_lo, a_hi, 1), a_xx = _mm_unpacklo_pd(a_lo, a_lo),
+        b_yz = _mm_shuffle_pd(b_lo, b_hi, 1), b_xx = _mm_unpacklo_pd(b_lo, b_lo),
+        a_zx = _mm_unpacklo_pd(a_hi, a_lo), a_yy = _mm_unpackhi_pd(a_lo, a_lo),
+        b_zx = _mm_unpacklo_pd(b_hi, b_lo), b_yy = _mm_unpackhi_pd(b_lo, b_lo);
+      // (a_y b_z - a_z b_y, a_z b_x - a_x b_z)
+      lo = _mm_sub_pd(_mm_mul_pd(a_yz, b_zx), _mm_mul_pd(a_zx, b_yz));
+      // (a_x b_y - a_y b_x, 0)
+      hi = _mm_sub_pd(_mm_mul_pd(a_xx, b_yy), _mm_mul_pd(a_yy, b_xx));
+      hi = _mm_move_sd(_mm_setzero_pd(), hi);
+    }
+  };
+#endif
+
+  // Evaluation of whole expressions, with the SIMD kernels above when
+  // Simd<SCALAR, DIMENSION>::enabled, and one element at a time
+  // otherwise.
+  template <typename SCALAR, const int DIMENSION, bool SIMD = Simd<SCALAR, DIMENSION>::enabled>
+  struct Evaluate {
+    template <typename EXPRESSION>
+    static void assign(SCALAR* destination, const EXPRESSION& expression) {
+      Unroll<0, DIMENSION>::assign(destination, expression);
+    }
+
+    template <typename LEFT, typename RIGHT>
+    static SCALAR dot(const LEFT& left, const RIGHT& right) {
+      return Unroll<0, DIMENSION>::dot(left, right, SCALAR(0));
+    }
+
+    template <typename LEFT, typename ADDEND>
+    static void multiply_add(SCALAR* destination, const LEFT& left, SCALAR s, const ADDEND& addend) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        destination[i] = left[i] * s + addend[i];
+      }
+    }
+
+    static void cross(SCALAR* destination, const SCALAR* left, const SCALAR* right) {
+      // See Marschner page 25 (Sect. 2.4)
+      // Cthulhu wrote this.
+      destination[0] = left[1] * right[2] - left[2] * right[1];
+      destination[1] = left[2] * right[0] - left[0] * right[2];
+      destination[2] = left[0] * right[1] - left[1] * right[0];
+    }
+  };
+
+  template <typename SCALAR, const int DIMENSION>
+  struct Evaluate<SCALAR, DIMENSION, true> {
+    typedef Simd<SCALAR, DIMENSION> simd;
+
+    template <typename EXPRESSION>
+    static void assign(SCALAR* destination, const EXPRESSION& expression) {
+      simd::store(destination, expression.packet());
+    }
+
+    template <typename LEFT, typename RIGHT>
+    static SCALAR dot(const LEFT& left, const RIGHT& right) {
+      return simd::dot(left.packet(), right.packet());
+    }
+
+    template <typename LEFT, typename ADDEND>
+    static void multiply_add(SCALAR* destination, const LEFT& left, SCALAR s, const ADDEND& addend) {
+      simd::store(destination, simd::multiply_add(left.packet(), simd::broadcast(s), addend.packet()));
+    }
+
+    static void cross(SCALAR* destination, const SCALAR* left, const SCALAR* right) {
+      simd::store(destination, simd::cross(simd::load(left), simd::load(right)));
+    }
+  };
+
+  // Fast approximate math, for when speed matters more than the last
+  // few bits: fast_rsqrt() here, and Vector::fast_normalized() and
+  // multiply_add() below. These do not give the same results as the
+  // exact functions, so callers choose them explicitly. multiply_add()
+  // is only fused when built with FMA instructions enabled (-mfma, or
+  // -march=native on a processor that has them). Whether any of this
+  // is faster depends on the processor: where square roots and divides
+  // are fast, as on current x86-64 ones, it isn't for single vectors;
+  // mrraytracer's --gmath-bench times both.
+
+  // Return approximately 1 / sqrt(x), for x > 0: the hardware's 12 bit
+  // estimate refined by one Newton-Raphson step, which leaves a
+  // relative error of about 1e-7 (float precision even for doubles),
+  // without a square root or a divide. The estimate is only made for
+  // normal floats, as it treats denormals as 0 and doubles are narrowed
+  // to float for it; anything else, including 0, infinity and NaN,
+  // takes the exact path.
+  inline bool in_fast_rsqrt_range(double x) {
+    return (x >= std::numeric_limits<float>::min()) && (x <= std::numeric_limits<float>::max());
+  }
+
+  inline float fast_rsqrt(float x) {
+#if defined(__SSE2__)
+    if (in_fast_rsqrt_range(x)) {
+      float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+      return y * (1.5f - 0.5f * x * y * y);
+    }
+#endif
+    return 1.0f / std::sqrt(x);
+  }
+
+  inline double fast_rsqrt(double x) {
+#if defined(__SSE2__)
+    if (in_fast_rsqrt_range(x)) {
+      double y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(float(x))));
+      return y * (1.5 - 0.5 * x * y * y);
+    }
+#endif
+    return 1.0 / std::sqrt(x);
+  }
+
+  // Vector expression templates. Vector arithmetic does not compute
+  // anything right away; instead each operator returns a small
+  // expression object that records its operands. When an expression
+  // is assigned to a Vector, or used in a dot product, each element is
+  // computed in one unrolled pass, with no intermediate vectors. So
+  //
+  //   Vector4 d = w * -dist + u * x + v * y;
+  //
+  // compiles to four independent sums of products.
+  //
+  // Expressions refer to the Vectors they were built from, so assign
+  // an expression to a Vector before those go away; in particular,
+  // don't keep one in an auto variable.
+  //
+  // VectorExpression is the common base of every expression, where
+  // DERIVED is the expression's own type and provides
+  // SCALAR operator[] (int) const.
+  template <typename SCALAR, const int DIMENSION, typename DERIVED>
+  class VectorExpression {
+  public:
+    constexpr SCALAR operator[] (int index) const {
+      return static_cast<const DERIVED&>(*this)[index];
+    }
+
+    constexpr const DERIVED& derived() const {
+      return static_cast<const DERIVED&>(*this);
+    }
+  };
+
+  template <typename SCALAR, const int DIMENSION>
+  class Vector;
+
+  // How an expression holds one of its operands: Vectors by
+  // reference, so they are not copied, and other expressions, which
+  // are only a few references and scalars, by value.
+  template <typename EXPRESSION>
+  struct ExpressionOperand {
+    typedef const EXPRESSION type;
+  };
+
+  template <typename SCALAR, const int DIMENSION>
+  struct ExpressionOperand<Vector<SCALAR, DIMENSION> > {
+    typedef const Vector<SCALAR, DIMENSION>& type;
+  };
+
+  // Makes a scalar argument a non-deduced context, so that v * 2
+  // converts the int to v's SCALAR instead of failing to deduce.
+  template <typename T>
+  struct Identity {
+    typedef T type;
+  };
+
+  // left + right
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename RIGHT>
+  class VectorSum : public VectorExpression<SCALAR, DIMENSION, VectorSum<SCALAR, DIMENSION, LEFT, RIGHT> > {
+  private:
+    typename ExpressionOperand<LEFT>::type _left;
+    typename ExpressionOperand<RIGHT>::type _right;
+
+  public:
+    constexpr VectorSum(const LEFT& left, const RIGHT& right) : _left(left), _right(right) { }
+
+    constexpr SCALAR operator[] (int index) const { return _left[index] + _right[index]; }
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      typedef Simd<SCALAR, DIMENSION> simd;
+      return simd::add(_left.packet(), _right.packet());
+    }
+  };
+
+  // left - right
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename RIGHT>
+  class VectorDifference : public VectorExpression<SCALAR, DIMENSION, VectorDifference<SCALAR, DIMENSION, LEFT, RIGHT> > {
+  private:
+    typename ExpressionOperand<LEFT>::type _left;
+    typename ExpressionOperand<RIGHT>::type _right;
+
+  public:
+    constexpr VectorDifference(const LEFT& left, const RIGHT& right) : _left(left), _right(right) { }
+
+    constexpr SCALAR operator[] (int index) const { return _left[index] - _right[index]; }
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      typedef Simd<SCALAR, DIMENSION> simd;
+      return simd::subtract(_left.packet(), _right.packet());
+    }
+  };
+
+  // -operand
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  class VectorNegation : public VectorExpression<SCALAR, DIMENSION, VectorNegation<SCALAR, DIMENSION, OPERAND> > {
+  private:
+    typename ExpressionOperand<OPERAND>::type _operand;
+
+  public:
+    explicit constexpr VectorNegation(const OPERAND& operand) : _operand(operand) { }
+
+    constexpr SCALAR operator[] (int index) const { return -_operand[index]; }
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      typedef Simd<SCALAR, DIMENSION> simd;
+      return simd::negate(_operand.packet());
+    }
+  };
+
+  // operand * s
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  class VectorScaled : public VectorExpression<SCALAR, DIMENSION, VectorScaled<SCALAR, DIMENSION, OPERAND> > {
+  private:
+    typename ExpressionOperand<OPERAND>::type _operand;
+    SCALAR _s;
+
+  public:
+    constexpr VectorScaled(const OPERAND& operand, SCALAR s) : _operand(operand), _s(s) { }
+
+    constexpr SCALAR operator[] (int index) const { return _operand[index] * _s; }
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      typedef Simd<SCALAR, DIMENSION> simd;
+      return simd::multiply(_operand.packet(), simd::broadcast(_s));
+    }
+  };
+
+  // operand / s
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  class VectorQuotient : public VectorExpression<SCALAR, DIMENSION, VectorQuotient<SCALAR, DIMENSION, OPERAND> > {
+  private:
+    typename ExpressionOperand<OPERAND>::type _operand;
+    SCALAR _s;
+
+  public:
+    constexpr VectorQuotient(const OPERAND& operand, SCALAR s) : _operand(operand), _s(s) { }
+
+    constexpr SCALAR operator[] (int index) const { return _operand[index] / _s; }
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      typedef Simd<SCALAR, DIMENSION> simd;
+      return simd::divide(_operand.packet(), simd::broadcast(_s));
+    }
+  };
+
+  // Addition of two vector expressions.
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename RIGHT>
+  constexpr VectorSum<SCALAR, DIMENSION, LEFT, RIGHT>
+  operator+ (const VectorExpression<SCALAR, DIMENSION, LEFT>& left,
+             const VectorExpression<SCALAR, DIMENSION, RIGHT>& right) {
+    return VectorSum<SCALAR, DIMENSION, LEFT, RIGHT>(left.derived(), right.derived());
+  }
+
+  // Subtraction of two vector expressions.
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename RIGHT>
+  constexpr VectorDifference<SCALAR, DIMENSION, LEFT, RIGHT>
+  operator- (const VectorExpression<SCALAR, DIMENSION, LEFT>& left,
+             const VectorExpression<SCALAR, DIMENSION, RIGHT>& right) {
+    return VectorDifference<SCALAR, DIMENSION, LEFT, RIGHT>(left.derived(), right.derived());
+  }
+
+  // Negation operator. Negates (toggles sign of) each element.
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  constexpr VectorNegation<SCALAR, DIMENSION, OPERAND>
+  operator- (const VectorExpression<SCALAR, DIMENSION, OPERAND>& operand) {
+    return VectorNegation<SCALAR, DIMENSION, OPERAND>(operand.derived());
+  }
+
+  // Multiply by a scalar.
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  constexpr VectorScaled<SCALAR, DIMENSION, OPERAND>
+  operator* (const VectorExpression<SCALAR, DIMENSION, OPERAND>& operand,
+             typename Identity<SCALAR>::type s) {
+    return VectorScaled<SCALAR, DIMENSION, OPERAND>(operand.derived(), s);
+  }
+
+  // Division by a scalar.
+  template <typename SCALAR, const int DIMENSION, typename OPERAND>
+  constexpr VectorQuotient<SCALAR, DIMENSION, OPERAND>
+  operator/ (const VectorExpression<SCALAR, DIMENSION, OPERAND>& operand,
+             typename Identity<SCALAR>::type s) {
+    return VectorQuotient<SCALAR, DIMENSION, OPERAND>(operand.derived(), s);
+  }
+
+  // Multiply two vector expressions (dot product). This evaluates
+  // right away, so (a - b) * (a - b) never stores a - b.
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename RIGHT>
+  SCALAR operator* (const VectorExpression<SCALAR, DIMENSION, LEFT>& left,
+                    const VectorExpression<SCALAR, DIMENSION, RIGHT>& right) {
+    return Evaluate<SCALAR, DIMENSION>::dot(left.derived(), right.derived());
+  }
+
   // Vector<SCALAR, DIMENSION> represents a mathematical vector of
   // DIMENSION length, where each base element is of type
   // SCALAR. These vectors' dimension (length) is fixed; they are not
@@ -96,8 +569,14 @@ namespace gmath {
   // DIMENSION a const template parameter means that the compiler can
   // type-check for incorrect vector or matrix dimensions at
   // compile-time.
+  //
+  // Arithmetic operators build expressions, above, that are only
+  // evaluated when assigned to a Vector, so expressions compile to
+  // plain register arithmetic with no heap allocation or temporary
+  // vectors. Overloads that take a ptr_type operand remain for code
+  // that holds vectors by shared_ptr.
   template <typename SCALAR, const int DIMENSION>
-  class Vector {
+  class Vector : public VectorExpression<SCALAR, DIMENSION, Vector<SCALAR, DIMENSION> > {
   public:
 
     // Alias for this very type.
@@ -107,17 +586,40 @@ namespace gmath {
     typedef std::shared_ptr<same_type> ptr_type;
 
   private:
-    SCALAR _elements[DIMENSION];
+    alignas(Simd<SCALAR, DIMENSION>::alignment) SCALAR _elements[DIMENSION];
 
   public:
     // Initialize all elements to initializer, 0 by default.
-    Vector(SCALAR initializer = 0) {
-      (*this) = initializer;
+    constexpr Vector(SCALAR initializer = 0) : _elements() {
+      Unroll<0, DIMENSION>::fill(_elements, initializer);
+    }
+
+    // Initialize the elements to the given values, one per element,
+    // e.g. Vector<double, 3>(r, g, b).
+    template <typename... REST>
+    constexpr Vector(SCALAR first, SCALAR second, REST... rest)
+      : _elements{first, second, static_cast<SCALAR>(rest)...} {
+      static_assert(sizeof...(REST) + 2 == DIMENSION, "need exactly one value per element");
+    }
+
+    // Copying is left to the compiler, so that vectors are trivially
+    // copyable; see the static_asserts at the end of this file.
+
+    // Convert a vector of another scalar type, element by element.
+    template <typename OTHER>
+    explicit constexpr Vector(const Vector<OTHER, DIMENSION>& other) : _elements() {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _elements[i] = static_cast<SCALAR>(other[i]);
+      }
     }
 
-    // Copy constructor.
-    Vector(const same_type& other) {
-      (*this) = other;
+    // Evaluate an expression. This is always done one element at a
+    // time, since intrinsics can't be evaluated at compile time; the
+    // optimizer vectorizes it anyway. Assignment, below, uses the SIMD
+    // kernels.
+    template <typename EXPRESSION>
+    constexpr Vector(const VectorExpression<SCALAR, DIMENSION, EXPRESSION>& expression) : _elements() {
+      Unroll<0, DIMENSION>::assign(_elements, expression.derived());
     }
 
     // Equality comparison operator; uses approximate_equal to compare
@@ -150,35 +652,30 @@ namespace gmath {
 
     // Dereference operator, to obtain a const reference to an
     // element.
-    const SCALAR& operator[] (int index) const {
+    constexpr const SCALAR& operator[] (int index) const {
       assert(is_index(index));
       return _elements[index];
     }
 
     // Dereference operator, to obtain a non-const reference to an
     // element.
-    SCALAR& operator[] (int index) {
+    constexpr SCALAR& operator[] (int index) {
       assert(is_index(index));
       return _elements[index];
     }
 
     // Assignment from a scalar. Overwrites each element with s.
-    same_type& operator= (SCALAR s) {
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        _elements[i] = s;
-      }
+    constexpr same_type& operator= (SCALAR s) {
+      Unroll<0, DIMENSION>::fill(_elements, s);
       return (*this);
     }
 
-    // Assignment from another vector (copy).
-    same_type& operator= (const same_type& right) {
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        _elements[i] = right._elements[i];
-      }
+    // Assignment from an expression. Each element of an expression
+    // depends only on the same element of its operands, so the
+    // expression may refer to this vector.
+    template <typename EXPRESSION>
+    same_type& operator= (const VectorExpression<SCALAR, DIMENSION, EXPRESSION>& expression) {
+      Evaluate<SCALAR, DIMENSION>::assign(_elements, expression.derived());
       return (*this);
     }
 
@@ -187,84 +684,43 @@ namespace gmath {
       return (*this) = (*right);
     }
 
-    // Addition with a vector.
-    ptr_type operator+ (const same_type& right) const {
-      ptr_type new_vec(new same_type(*this));
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        new_vec->_elements[i] += right._elements[i];
-      }
-      return new_vec;
+    // This vector in SIMD registers, for expression evaluation.
+    typename Simd<SCALAR, DIMENSION>::packet_type packet() const {
+      return Simd<SCALAR, DIMENSION>::load(_elements);
     }
 
     // Addition with a pointer to a vector.
-    ptr_type operator+ (const ptr_type right) const {
+    same_type operator+ (const ptr_type right) const {
       return (*this) + (*right);
     }
 
-    // Subtraction with a vector.
-    ptr_type operator- (const same_type& right) const {
-      return (*this) + (-right);
-    }
-
     // Subtraction with a pointer to a vector.
-    ptr_type operator- (const ptr_type right) const {
+    same_type operator- (const ptr_type right) const {
       return (*this) - (*right);
     }
 
-    // Negation operator. Negates (toggles sign of) each element of
-    // the vector.
-    ptr_type operator- () const {
-      ptr_type new_vec(new same_type());
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        new_vec->_elements[i] = -_elements[i];
-      }
-      return new_vec;
-    }
-
-    // Multiply by a scalar.
-    ptr_type operator* (SCALAR s) const {
-      ptr_type new_vec(new same_type(*this));
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        new_vec->_elements[i] *= s;
-      }
-      return new_vec;
-    }
-
-    // Multiply by another vector (dot product).
-    SCALAR operator* (const same_type& right) const {
-      SCALAR result = 0;
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        result += (_elements[i] * right._elements[i]);
-      }
-      return result;
-    }
-
     // Multiply by a pointer to another vector (dot product).
     SCALAR operator* (const ptr_type right) const {
       return (*this) * (*right);
     }
 
-    // Division by a scalar.
-    ptr_type operator/ (SCALAR s) const {
-      ptr_type new_vec(new same_type(*this));
-      int i;
+    // In-place addition, subtraction, and scaling.
+    template <typename EXPRESSION>
+    same_type& operator+= (const VectorExpression<SCALAR, DIMENSION, EXPRESSION>& right) {
+      return (*this) = (*this) + right;
+    }
 
-      for (i = 0; i < DIMENSION; ++i) {
-        new_vec->_elements[i] /= s;
-      }
-      return new_vec;
+    template <typename EXPRESSION>
+    same_type& operator-= (const VectorExpression<SCALAR, DIMENSION, EXPRESSION>& right) {
+      return (*this) = (*this) - right;
+    }
+
+    same_type& operator*= (SCALAR s) {
+      return (*this) = (*this) * s;
     }
 
     // Return true iff i is a valid element index.
-    bool is_index(int i) const {
+    constexpr bool is_index(int i) const {
       return ((i >= 0) && (i < DIMENSION));
     }
 
@@ -305,17 +761,10 @@ namespace gmath {
     // Compute the cross product between this and another vector. The
     // cross product is only defined for certain dimensions; this
     // function asserts that DIMENSION is 3 (or 4 for homogeneous vectors).
-    ptr_type cross(const same_type& right) const {
+    same_type cross(const same_type& right) const {
       assert(DIMENSION == 3 || DIMENSION == 4);
-      ptr_type new_vec(new same_type());
-      // See Marschner page 25 (Sect. 2.4)
-      // Cthulhu wrote this.
-      new_vec->_elements[0] = this->_elements[1] * right._elements[2] -
-                              this->_elements[2] * right._elements[1];
-      new_vec->_elements[1] = this->_elements[2] * right._elements[0] -
-                              this->_elements[0] * right._elements[2];
-      new_vec->_elements[2] = this->_elements[0] * right._elements[1] -
-                              this->_elements[1] * right._elements[0];
+      same_type new_vec;
+      Evaluate<SCALAR, DIMENSION>::cross(new_vec._elements, _elements, right._elements);
       return new_vec;
     }
 
@@ -328,31 +777,29 @@ namespace gmath {
     // vector. This function assumes that each vector represents a
     // point. The returned value is always a non-negative scalar.
     SCALAR distance(const same_type& p) const {
-      same_type diff;
-      diff = (*this) - p;
+      same_type diff((*this) - p);
       return diff.magnitude();
     }
 
     // Return the magnitude of this vector, i.e. for vector v, the
     // quantity denoted ||v|| .
     SCALAR magnitude() const {
-      SCALAR sum = 0;
-      int i;
-
-      for (i = 0; i < DIMENSION; ++i) {
-        sum += _elements[i] * _elements[i];
-      }
+      SCALAR sum = Evaluate<SCALAR, DIMENSION>::dot(*this, *this);
       return (SCALAR) sqrt((double) sum);
     }
 
-    // Return a pointer to a normalized version of this vector,
-    // i.e. another vector with identical distance, and magnitude
-    // exactly 1.
-    ptr_type normalized() const {
+    // Return a normalized version of this vector, i.e. another
+    // vector with identical distance, and magnitude exactly 1.
+    same_type normalized() const {
       assert(!is_zero());
-      ptr_type new_vec(new same_type(*this));
-      new_vec = *new_vec / new_vec->magnitude();
-      return new_vec;
+      return (*this) / magnitude();
+    }
+
+    // Return approximately normalized(), using fast_rsqrt() instead
+    // of a square root and a divide per element.
+    same_type fast_normalized() const {
+      assert(!is_zero());
+      return (*this) * fast_rsqrt(Evaluate<SCALAR, DIMENSION>::dot(*this, *this));
     }
 
     // Utility function to print a representation of this vector to
@@ -375,9 +822,469 @@ namespace gmath {
     }
   };
 
+  // Return left * s + addend, evaluated like the expression of the
+  // same shape, except that the multiply and add are fused into one
+  // instruction, with one rounding, when the target has FMA. Chain
+  // calls for sums of several products.
+  template <typename SCALAR, const int DIMENSION, typename LEFT, typename ADDEND>
+  Vector<SCALAR, DIMENSION> multiply_add(const VectorExpression<SCALAR, DIMENSION, LEFT>& left,
+                                         typename Identity<SCALAR>::type s,
+                                         const VectorExpression<SCALAR, DIMENSION, ADDEND>& addend) {
+    Vector<SCALAR, DIMENSION> result;
+    Evaluate<SCALAR, DIMENSION>::multiply_add(&result[0], left.derived(), s, addend.derived());
+    return result;
+  }
+
+  // Lane-wise, or "structure of arrays", types, for applying the same
+  // arithmetic to LANES independent values at once: LANES rays
+  // against one sphere, or one ray against LANES spheres. Each
+  // operation is a single loop over the lanes, with a constant trip
+  // count and no branches, which the compiler turns into SIMD
+  // instructions as wide as the target has. Branches become masks:
+  // compute both sides for every lane, then select().
+
+  // LaneMask<LANES> holds one bool per lane, as produced by comparing
+  // ScalarPacks.
+  template <const int LANES>
+  class LaneMask {
+  public:
+    typedef LaneMask<LANES> same_type;
+
+  private:
+    bool _lanes[LANES];
+
+  public:
+    // Initialize every lane to initializer, false by default.
+    constexpr LaneMask(bool initializer = false) : _lanes() {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] = initializer;
+      }
+    }
+
+    constexpr bool operator[] (int lane) const {
+      assert((lane >= 0) && (lane < LANES));
+      return _lanes[lane];
+    }
+
+    constexpr bool& operator[] (int lane) {
+      assert((lane >= 0) && (lane < LANES));
+      return _lanes[lane];
+    }
+
+    same_type operator& (const same_type& right) const {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = _lanes[i] && right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type operator| (const same_type& right) const {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = _lanes[i] || right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type operator~ () const {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = !_lanes[i];
+      }
+      return result;
+    }
+
+    // Return true when at least one lane is set.
+    bool any() const {
+      bool result = false;
+      for (int i = 0; i < LANES; ++i) {
+        result |= _lanes[i];
+      }
+      return result;
+    }
+
+    // Return true when every lane is set.
+    bool all() const {
+      return !(~(*this)).any();
+    }
+
+    // Return the number of lanes that are set.
+    int count() const {
+      int result = 0;
+      for (int i = 0; i < LANES; ++i) {
+        result += _lanes[i];
+      }
+      return result;
+    }
+  };
+
+  // ScalarPack<SCALAR, LANES> holds one SCALAR per lane. Arithmetic
+  // is lane by lane, and a plain SCALAR operand is broadcast to every
+  // lane.
+  template <typename SCALAR, const int LANES>
+  class ScalarPack {
+  public:
+    typedef ScalarPack<SCALAR, LANES> same_type;
+    typedef LaneMask<LANES> mask_type;
+
+  private:
+    alignas(Simd<SCALAR, 4>::alignment) SCALAR _lanes[LANES];
+
+  public:
+    // Initialize every lane to initializer, 0 by default.
+    constexpr ScalarPack(SCALAR initializer = 0) : _lanes() {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] = initializer;
+      }
+    }
+
+    constexpr SCALAR operator[] (int lane) const {
+      assert((lane >= 0) && (lane < LANES));
+      return _lanes[lane];
+    }
+
+    constexpr SCALAR& operator[] (int lane) {
+      assert((lane >= 0) && (lane < LANES));
+      return _lanes[lane];
+    }
+
+    same_type& operator+= (const same_type& right) {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] += right._lanes[i];
+      }
+      return *this;
+    }
+
+    friend same_type operator+ (const same_type& left, const same_type& right) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = left._lanes[i] + right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type& operator-= (const same_type& right) {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] -= right._lanes[i];
+      }
+      return *this;
+    }
+
+    friend same_type operator- (const same_type& left, const same_type& right) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = left._lanes[i] - right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type& operator*= (const same_type& right) {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] *= right._lanes[i];
+      }
+      return *this;
+    }
+
+    friend same_type operator* (const same_type& left, const same_type& right) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = left._lanes[i] * right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type& operator/= (const same_type& right) {
+      for (int i = 0; i < LANES; ++i) {
+        _lanes[i] /= right._lanes[i];
+      }
+      return *this;
+    }
+
+    friend same_type operator/ (const same_type& left, const same_type& right) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = left._lanes[i] / right._lanes[i];
+      }
+      return result;
+    }
+
+    same_type operator- () const {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = -_lanes[i];
+      }
+      return result;
+    }
+
+    friend mask_type operator< (const same_type& left, const same_type& right) {
+      mask_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result[i] = left._lanes[i] < right._lanes[i];
+      }
+      return result;
+    }
+
+    friend mask_type operator> (const same_type& left, const same_type& right) {
+      return right < left;
+    }
+
+    friend mask_type operator<= (const same_type& left, const same_type& right) {
+      return ~(right < left);
+    }
+
+    friend mask_type operator>= (const same_type& left, const same_type& right) {
+      return ~(left < right);
+    }
+
+    // Lane-wise square root.
+    friend same_type sqrt(const same_type& operand) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = std::sqrt(operand._lanes[i]);
+      }
+      return result;
+    }
+
+    // Lane-wise mask ? if_true : if_false.
+    friend same_type select(const mask_type& mask, const same_type& if_true, const same_type& if_false) {
+      same_type result;
+      for (int i = 0; i < LANES; ++i) {
+        result._lanes[i] = mask[i] ? if_true._lanes[i] : if_false._lanes[i];
+      }
+      return result;
+    }
+  };
+
+  // VectorPack<SCALAR, DIMENSION, LANES> holds LANES vectors, stored
+  // as one ScalarPack per component, so that the x components of
+  // every lane are contiguous, then the y components, and so on. Lane
+  // i holds a Vector<SCALAR, DIMENSION>, which can be read and
+  // written with lane() and set_lane(). As with Vector, * between two
+  // VectorPacks is the dot product, here one per lane.
+  template <typename SCALAR, const int DIMENSION, const int LANES>
+  class VectorPack {
+  public:
+    typedef VectorPack<SCALAR, DIMENSION, LANES> same_type;
+    typedef Vector<SCALAR, DIMENSION> vector_type;
+    typedef ScalarPack<SCALAR, LANES> scalar_pack;
+    typedef LaneMask<LANES> mask_type;
+
+  private:
+    scalar_pack _components[DIMENSION];
+
+    // Results are written lane by lane into place. Assigning a whole
+    // ScalarPack temporary instead makes the compiler copy it with
+    // one wide load straight after the narrower stores that wrote it,
+    // which stalls store forwarding and costs more than the
+    // arithmetic.
+
+  public:
+    // Initialize every element to initializer, 0 by default.
+    constexpr VectorPack(SCALAR initializer = 0) : _components() {
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          _components[i][lane] = initializer;
+        }
+      }
+    }
+
+    // Initialize every lane to a copy of v.
+    explicit VectorPack(const vector_type& v) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          _components[i][lane] = v[i];
+        }
+      }
+    }
+
+    // Dereference operator, to obtain component i of every lane.
+    constexpr const scalar_pack& operator[] (int component) const {
+      assert((component >= 0) && (component < DIMENSION));
+      return _components[component];
+    }
+
+    constexpr scalar_pack& operator[] (int component) {
+      assert((component >= 0) && (component < DIMENSION));
+      return _components[component];
+    }
+
+    // Return the vector in one lane.
+    vector_type lane(int lane) const {
+      vector_type v;
+      for (int i = 0; i < DIMENSION; ++i) {
+        v[i] = _components[i][lane];
+      }
+      return v;
+    }
+
+    // Overwrite the vector in one lane.
+    void set_lane(int lane, const vector_type& v) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _components[i][lane] = v[i];
+      }
+    }
+
+    same_type& operator+= (const same_type& right) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _components[i] += right._components[i];
+      }
+      return *this;
+    }
+
+    same_type& operator-= (const same_type& right) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _components[i] -= right._components[i];
+      }
+      return *this;
+    }
+
+    // Scale each lane by the matching lane of s.
+    same_type& operator*= (const scalar_pack& s) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _components[i] *= s;
+      }
+      return *this;
+    }
+
+    same_type& operator/= (const scalar_pack& s) {
+      for (int i = 0; i < DIMENSION; ++i) {
+        _components[i] /= s;
+      }
+      return *this;
+    }
+
+    same_type operator+ (const same_type& right) const {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = _components[i][lane] + right._components[i][lane];
+        }
+      }
+      return result;
+    }
+
+    same_type operator- (const same_type& right) const {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = _components[i][lane] - right._components[i][lane];
+        }
+      }
+      return result;
+    }
+
+    same_type operator- () const {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = -_components[i][lane];
+        }
+      }
+      return result;
+    }
+
+    same_type operator* (const scalar_pack& s) const {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = _components[i][lane] * s[lane];
+        }
+      }
+      return result;
+    }
+
+    same_type operator/ (const scalar_pack& s) const {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = _components[i][lane] / s[lane];
+        }
+      }
+      return result;
+    }
+
+    // Dot product of each lane with the matching lane of right.
+    scalar_pack operator* (const same_type& right) const {
+      scalar_pack sum(0);
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          sum[lane] += _components[i][lane] * right._components[i][lane];
+        }
+      }
+      return sum;
+    }
+
+    // Cross product of each lane with the matching lane of right. As
+    // with Vector::cross, DIMENSION must be 3, or 4 for homogeneous
+    // vectors, whose w comes out 0.
+    same_type cross(const same_type& right) const {
+      assert(DIMENSION == 3 || DIMENSION == 4);
+      same_type result;
+      const scalar_pack* l = _components;
+      const scalar_pack* r = right._components;
+      for (int lane = 0; lane < LANES; ++lane) {
+        result._components[0][lane] = l[1][lane] * r[2][lane] - l[2][lane] * r[1][lane];
+        result._components[1][lane] = l[2][lane] * r[0][lane] - l[0][lane] * r[2][lane];
+        result._components[2][lane] = l[0][lane] * r[1][lane] - l[1][lane] * r[0][lane];
+      }
+      return result;
+    }
+
+    scalar_pack magnitude() const {
+      return sqrt((*this) * (*this));
+    }
+
+    // Normalize every lane. Lanes holding the zero vector come out
+    // as NaNs rather than asserting, since other lanes may be valid;
+    // mask them out with select().
+    same_type normalized() const {
+      return (*this) / magnitude();
+    }
+
+    // Lane-wise mask ? if_true : if_false.
+    friend same_type select(const mask_type& mask, const same_type& if_true, const same_type& if_false) {
+      same_type result;
+      for (int i = 0; i < DIMENSION; ++i) {
+        for (int lane = 0; lane < LANES; ++lane) {
+          result._components[i][lane] = mask[lane] ? if_true._components[i][lane] : if_false._components[i][lane];
+        }
+      }
+      return result;
+    }
+  };
+
+  template <typename SCALAR, const int HEIGHT, const int WIDTH>
+  class Matrix;
+
+  // matrix * operand. Element i is the dot product of row i with the
+  // operand, which reads every element of the operand, so the operand
+  // is copied up front; then v = m * v works.
+  template <typename SCALAR, const int HEIGHT, const int WIDTH>
+  class MatrixVectorProduct
+    : public VectorExpression<SCALAR, HEIGHT, MatrixVectorProduct<SCALAR, HEIGHT, WIDTH> > {
+  private:
+    const Matrix<SCALAR, HEIGHT, WIDTH>& _matrix;
+    Vector<SCALAR, WIDTH> _operand;
+
+  public:
+    MatrixVectorProduct(const Matrix<SCALAR, HEIGHT, WIDTH>& matrix, const Vector<SCALAR, WIDTH>& operand)
+      : _matrix(matrix), _operand(operand) { }
+
+    SCALAR operator[] (int index) const { return _matrix[index] * _operand; }
+
+    typename Simd<SCALAR, HEIGHT>::packet_type packet() const {
+      SCALAR elements[HEIGHT];
+      for (int i = 0; i < HEIGHT; ++i) {
+        elements[i] = (*this)[i];
+      }
+      return Simd<SCALAR, HEIGHT>::load(elements);
+    }
+  };
+
   // Matrix<SCALAR, HEIGHT, WIDTH> represents a mathematical vector of
   // HEIGHT x WIDTH dimension, where each base element is of type
-  // SCALAR.
+  // SCALAR. As with Vector, arithmetic returns results by value.
   template <typename SCALAR, const int HEIGHT, const int WIDTH>
   class Matrix {
   public:
@@ -400,15 +1307,19 @@ namespace gmath {
   public:
 
     // Initialize all elements to initializer, 0 by default.
-    Matrix(SCALAR initializer = 0) {
+    constexpr Matrix(SCALAR initializer = 0) : _rows() {
       (*this) = initializer;
     }
 
-    // Copy constructor.
-    Matrix(const same_type& other) {
-      (*this) = other;
+    // Initialize the rows to the given vectors, one per row.
+    template <typename... REST>
+    constexpr Matrix(const row_type& first, const row_type& second, const REST&... rest)
+      : _rows{first, second, rest...} {
+      static_assert(sizeof...(REST) + 2 == HEIGHT, "need exactly one vector per row");
     }
 
+    // Copying is left to the compiler, as for Vector.
+
     // Equality comparison operator; uses approximate_equal to compare
     // individual elements.
     bool operator== (const same_type& right) const {
@@ -439,20 +1350,20 @@ namespace gmath {
     }
 
     // Dereference operator, to obtain a const reference to a row.
-    const row_type& operator[] (int row) const {
+    constexpr const row_type& operator[] (int row) const {
       assert(is_row(row));
       return _rows[row];
     }
 
     // Dereference operator, to obtain a non-const reference to row.
-    row_type& operator[] (int row) {
+    constexpr row_type& operator[] (int row) {
       assert(is_row(row));
       return _rows[row];
     }
 
     // Assignment from a scalar. Overwrites each element with s.
-    same_type& operator= (SCALAR s) {
-      int i;
+    constexpr same_type& operator= (SCALAR s) {
+      int i = 0;
 
       for (i = 0; i < HEIGHT; ++i) {
         _rows[i] = s;
@@ -460,79 +1371,70 @@ namespace gmath {
       return (*this);
     }
 
-    // Assignment from another vector (copy).
-    same_type& operator= (const same_type& right) {
-      int i;
-
-      for (i = 0; i < HEIGHT; ++i) {
-        _rows[i] = right._rows[i];
-      }
-      return (*this);
-    }
-
     // Addition with a matrix.
-    ptr_type operator+ (const same_type& right) const {
-      ptr_type new_mat(new same_type(*this));
+    same_type operator+ (const same_type& right) const {
+      same_type new_mat(*this);
       int i;
 
       for (i = 0; i < HEIGHT; ++i) {
-        new_mat->_rows[i] = _rows[i] + right._rows[i];
+        new_mat._rows[i] += right._rows[i];
       }
       return new_mat;
     }
 
     // Addition with a pointer to a matrix.
-    ptr_type operator+ (ptr_type right) const {
+    same_type operator+ (ptr_type right) const {
       return (*this) + (*right);
     }
 
     // Subtraction with a vector.
-    ptr_type operator- (const same_type& right) const {
-      return (*this) + (-right);
+    same_type operator- (const same_type& right) const {
+      same_type new_mat(*this);
+      int i;
+
+      for (i = 0; i < HEIGHT; ++i) {
+        new_mat._rows[i] -= right._rows[i];
+      }
+      return new_mat;
     }
 
     // Subtraction with a pointer to a vector.
-    ptr_type operator- (ptr_type right) const {
+    same_type operator- (ptr_type right) const {
       return (*this) - (*right);
     }
 
     // Negation operator.
-    ptr_type operator- () const {
-      ptr_type new_mat(new same_type(*this));
+    same_type operator- () const {
+      same_type new_mat;
       int i;
 
       for (i = 0; i < HEIGHT; ++i) {
-        new_mat->_rows[i] = -new_mat->_rows[i];
+        new_mat._rows[i] = -_rows[i];
       }
       return new_mat;
     }
 
     // Multiplication by a scalar.
-    ptr_type operator* (SCALAR s) const {
-      ptr_type new_mat(new same_type(*this));
+    same_type operator* (SCALAR s) const {
+      same_type new_mat(*this);
       int i;
 
       for (i = 0; i < HEIGHT; ++i) {
-        new_mat->_rows[i] = new_mat->_rows[i] * s;
+        new_mat._rows[i] *= s;
       }
       return new_mat;
     }
 
     // Multiplication by a vector. Note the dimensions of the input
-    // and output vectors.
-    std::shared_ptr<column_type> operator* (const row_type& v) const {
-      std::shared_ptr<column_type> new_vec(new column_type);
-      int i;
-
-      for (i = 0; i < HEIGHT; ++i) {
-        (*new_vec)[i] = _rows[i] * v;
-      }
-      return new_vec;
+    // and output vectors. Like vector arithmetic, this is evaluated
+    // when the result is assigned to a column_type.
+    MatrixVectorProduct<SCALAR, HEIGHT, WIDTH> operator* (const row_type& v) const {
+      return MatrixVectorProduct<SCALAR, HEIGHT, WIDTH>(*this, v);
     }
 
     // Multiplication by a pointer to a vector. Note the dimensions of
     // the input and output vectors.
-    std::shared_ptr<column_type> operator* (std::shared_ptr<row_type> v) const {
+    MatrixVectorProduct<SCALAR, HEIGHT, WIDTH> operator* (std::shared_ptr<row_type> v) const {
       return (*this) * (*v);
     }
 
@@ -544,14 +1446,14 @@ namespace gmath {
     // will only ever multiply square matrices, and making this
     // assumption makes this function significantly easier to declare
     // and implement.
-    ptr_type operator* (const same_type& right) const {
+    same_type operator* (const same_type& right) const {
       assert(is_square());
-      ptr_type new_mat(new same_type(0));
+      same_type new_mat(0);
       int i, j, k;
       for (i = 0; i < HEIGHT; ++i) {
         for (j = 0; j < WIDTH; ++j) {
           for (k = 0; k < HEIGHT; ++k) {
-            (*new_mat)[i][j] += (*this)[i][k] * right[k][j];
+            new_mat[i][j] += (*this)[i][k] * right[k][j];
           }
         }
       }
@@ -559,7 +1461,7 @@ namespace gmath {
     }
 
     // Multiplication by a pointer to a matrix.
-    ptr_type operator* (ptr_type right) const {
+    same_type operator* (ptr_type right) const {
       return (*this) * (*right);
     }
 
@@ -569,7 +1471,7 @@ namespace gmath {
     }
 
     // Return true iff i is a valid row index.
-    bool is_row(int i) const {
+    constexpr bool is_row(int i) const {
       return ((i >= 0) && (i < HEIGHT));
     }
 
@@ -579,14 +1481,12 @@ namespace gmath {
     }
 
     // Return the transpose of this matrix.
-    std::shared_ptr<Matrix<SCALAR, WIDTH, HEIGHT> > transpose() const {
-      std::shared_ptr<Matrix<SCALAR, WIDTH, HEIGHT> >
-          new_mat(new Matrix<SCALAR, WIDTH, HEIGHT>());
-      int i, j;
+    constexpr Matrix<SCALAR, WIDTH, HEIGHT> transpose() const {
+      Matrix<SCALAR, WIDTH, HEIGHT> new_mat;
 
-      for (i = 0; i < HEIGHT; ++i) {
-        for (j = 0; j < WIDTH; ++j) {
-          new_mat->_rows[j][i] = this->_rows[i][j];
+      for (int i = 0; i < HEIGHT; ++i) {
+        for (int j = 0; j < WIDTH; ++j) {
+          new_mat[j][i] = this->_rows[i][j];
         }
       }
       return new_mat;
@@ -635,7 +1535,7 @@ namespace gmath {
   };
 
   // Compute the determinant of a matrix. We only define this function
-  // for 2x2 and 3x3 square matrices.
+  // for 2x2, 3x3 and 4x4 square matrices.
 
   template <typename SCALAR>
   SCALAR determinant(const Matrix<SCALAR, 2, 2>& m) {
@@ -649,41 +1549,340 @@ namespace gmath {
            m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
   }
 
+  // The 4x4 determinant and inverse share the twelve 2x2
+  // subdeterminants of the top two rows (s) and the bottom two rows
+  // (c), rather than expanding sixteen 3x3 cofactors.
+  template <typename SCALAR>
+  struct Subdeterminants4x4 {
+    SCALAR s[6], c[6];
+
+    explicit constexpr Subdeterminants4x4(const Matrix<SCALAR, 4, 4>& m) : s(), c() {
+      s[0] = m[0][0] * m[1][1] - m[1][0] * m[0][1];
+      s[1] = m[0][0] * m[1][2] - m[1][0] * m[0][2];
+      s[2] = m[0][0] * m[1][3] - m[1][0] * m[0][3];
+      s[3] = m[0][1] * m[1][2] - m[1][1] * m[0][2];
+      s[4] = m[0][1] * m[1][3] - m[1][1] * m[0][3];
+      s[5] = m[0][2] * m[1][3] - m[1][2] * m[0][3];
+
+      c[0] = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+      c[1] = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+      c[2] = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+      c[3] = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+      c[4] = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+      c[5] = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+    }
+
+    constexpr SCALAR determinant() const {
+      return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] +
+             s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+    }
+  };
+
+  template <typename SCALAR>
+  constexpr SCALAR determinant(const Matrix<SCALAR, 4, 4>& m) {
+    return Subdeterminants4x4<SCALAR>(m).determinant();
+  }
+
   // Compute the inverse of a matrix. We only define this function for
-  // 2x2 and 3x3 square matrices.
+  // 2x2, 3x3 and 4x4 square matrices.
 
   template <typename SCALAR>
-  std::shared_ptr<Matrix<SCALAR, 2, 2> > inverse(const Matrix<SCALAR, 2, 2>& m) {
+  Matrix<SCALAR, 2, 2> inverse(const Matrix<SCALAR, 2, 2>& m) {
     SCALAR det = determinant(m);
     assert(det != 0);
-    std::shared_ptr<Matrix<SCALAR, 2, 2> > new_mat(new Matrix<SCALAR, 2, 2>(0));
+    Matrix<SCALAR, 2, 2> new_mat(0);
 
-    (*new_mat)[0][0] = m[1][1];
-    (*new_mat)[0][1] = -m[0][1];
-    (*new_mat)[1][0] = -m[1][0];
-    (*new_mat)[1][1] = m[0][0];
-    *new_mat = *(*new_mat * (1.0 / det));
-    return new_mat;
+    new_mat[0][0] = m[1][1];
+    new_mat[0][1] = -m[0][1];
+    new_mat[1][0] = -m[1][0];
+    new_mat[1][1] = m[0][0];
+    return new_mat * (1.0 / det);
   }
 
   template <typename SCALAR>
-  std::shared_ptr<Matrix<SCALAR, 3, 3> > inverse(const Matrix<SCALAR, 3, 3>& m) {
+  Matrix<SCALAR, 3, 3> inverse(const Matrix<SCALAR, 3, 3>& m) {
     SCALAR det = determinant(m);
     assert(det != 0);
-    std::shared_ptr<Matrix<SCALAR, 3, 3> > new_mat(new Matrix<SCALAR, 3, 3>(m));
-    (*new_mat)[0][0] = m[1][1] * m[2][2] - m[2][1] * m[1][2];
-    (*new_mat)[1][0] = -(m[1][0] * m[2][2] - m[2][0] * m[1][2]);
-    (*new_mat)[2][0] = m[1][0] * m[2][1] - m[2][0] * m[1][1];
-    (*new_mat)[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]);
-    (*new_mat)[1][1] = m[0][0] * m[2][2] - m[2][0] * m[0][2];
-    (*new_mat)[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]);
-    (*new_mat)[0][2] = m[0][1] * m[1][2] - m[1][1] * m[0][2];
-    (*new_mat)[1][2] = -(m[0][0] * m[1][2] - m[1][0] * m[0][2]);
-    (*new_mat)[2][2] = m[0][0] * m[1][1] - m[1][0] * m[0][1];
-    *new_mat = *(*new_mat * (1.0 / det));
+    Matrix<SCALAR, 3, 3> new_mat(m);
+    new_mat[0][0] = m[1][1] * m[2][2] - m[2][1] * m[1][2];
+    new_mat[1][0] = -(m[1][0] * m[2][2] - m[2][0] * m[1][2]);
+    new_mat[2][0] = m[1][0] * m[2][1] - m[2][0] * m[1][1];
+    new_mat[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]);
+    new_mat[1][1] = m[0][0] * m[2][2] - m[2][0] * m[0][2];
+    new_mat[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]);
+    new_mat[0][2] = m[0][1] * m[1][2] - m[1][1] * m[0][2];
+    new_mat[1][2] = -(m[0][0] * m[1][2] - m[1][0] * m[0][2]);
+    new_mat[2][2] = m[0][0] * m[1][1] - m[1][0] * m[0][1];
+    return new_mat * (1.0 / det);
+  }
+
+  // The 4x4 inverse is scaled one element at a time, rather than with
+  // the SIMD matrix-scalar product, so that it can be computed at
+  // compile time; the products are the same.
+  template <typename SCALAR>
+  constexpr Matrix<SCALAR, 4, 4> inverse(const Matrix<SCALAR, 4, 4>& m) {
+    Subdeterminants4x4<SCALAR> sub(m);
+    const SCALAR* s = sub.s;
+    const SCALAR* c = sub.c;
+    SCALAR det = sub.determinant();
+    assert(det != 0);
+    Matrix<SCALAR, 4, 4> new_mat(0);
+
+    new_mat[0][0] =  m[1][1] * c[5] - m[1][2] * c[4] + m[1][3] * c[3];
+    new_mat[0][1] = -m[0][1] * c[5] + m[0][2] * c[4] - m[0][3] * c[3];
+    new_mat[0][2] =  m[3][1] * s[5] - m[3][2] * s[4] + m[3][3] * s[3];
+    new_mat[0][3] = -m[2][1] * s[5] + m[2][2] * s[4] - m[2][3] * s[3];
+
+    new_mat[1][0] = -m[1][0] * c[5] + m[1][2] * c[2] - m[1][3] * c[1];
+    new_mat[1][1] =  m[0][0] * c[5] - m[0][2] * c[2] + m[0][3] * c[1];
+    new_mat[1][2] = -m[3][0] * s[5] + m[3][2] * s[2] - m[3][3] * s[1];
+    new_mat[1][3] =  m[2][0] * s[5] - m[2][2] * s[2] + m[2][3] * s[1];
+
+    new_mat[2][0] =  m[1][0] * c[4] - m[1][1] * c[2] + m[1][3] * c[0];
+    new_mat[2][1] = -m[0][0] * c[4] + m[0][1] * c[2] - m[0][3] * c[0];
+    new_mat[2][2] =  m[3][0] * s[4] - m[3][1] * s[2] + m[3][3] * s[0];
+    new_mat[2][3] = -m[2][0] * s[4] + m[2][1] * s[2] - m[2][3] * s[0];
+
+    new_mat[3][0] = -m[1][0] * c[3] + m[1][1] * c[1] - m[1][2] * c[0];
+    new_mat[3][1] =  m[0][0] * c[3] - m[0][1] * c[1] + m[0][2] * c[0];
+    new_mat[3][2] = -m[3][0] * s[3] + m[3][1] * s[1] - m[3][2] * s[0];
+    new_mat[3][3] =  m[2][0] * s[3] - m[2][1] * s[1] + m[2][2] * s[0];
+
+    SCALAR scale = 1.0 / det;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        new_mat[i][j] *= scale;
+      }
+    }
     return new_mat;
   }
 
+  // AffineTransform<SCALAR> is the affine map x -> A x + t, stored as
+  // the top three rows [A t] of its 4x4 matrix; the bottom row is
+  // always (0, 0, 0, 1) and is not stored. Points (w = 1) are
+  // translated and directions (w = 0) are not. Each output element is
+  // one dot product of a row with the input, which uses the SIMD
+  // kernels when they are enabled, and the results are the same as
+  // multiplying by the equivalent Matrix<SCALAR, 4, 4>.
+  template <typename SCALAR>
+  class AffineTransform {
+  public:
+
+    // Alias for this very type.
+    typedef AffineTransform<SCALAR> same_type;
+
+    // Data type of points and directions, and of one stored row.
+    typedef Vector<SCALAR, 4> vector_type;
+
+    // Data type of the linear part A.
+    typedef Matrix<SCALAR, 3, 3> linear_type;
+
+  private:
+    vector_type _rows[3];
+
+  public:
+
+    // Initialize to the identity transform.
+    constexpr AffineTransform()
+      : _rows{vector_type(1, 0, 0, 0), vector_type(0, 1, 0, 0), vector_type(0, 0, 1, 0)} { }
+
+    // Initialize from a 4x4 matrix, which must be affine, i.e. have a
+    // bottom row of (0, 0, 0, 1).
+    explicit constexpr AffineTransform(const Matrix<SCALAR, 4, 4>& m)
+      : _rows{m[0], m[1], m[2]} {
+      assert((m[3][0] == 0) && (m[3][1] == 0) && (m[3][2] == 0) && (m[3][3] == 1));
+    }
+
+    // Dereference operator, to obtain row 0, 1 or 2, i.e. (A_i, t_i).
+    constexpr const vector_type& operator[] (int row) const {
+      assert((row >= 0) && (row < 3));
+      return _rows[row];
+    }
+
+    constexpr vector_type& operator[] (int row) {
+      assert((row >= 0) && (row < 3));
+      return _rows[row];
+    }
+
+    // The linear part A, without the translation.
+    constexpr linear_type linear() const {
+      linear_type a;
+      for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+          a[i][j] = _rows[i][j];
+        }
+      }
+      return a;
+    }
+
+    // The equivalent 4x4 matrix.
+    Matrix<SCALAR, 4, 4> matrix() const {
+      Matrix<SCALAR, 4, 4> m(0);
+      for (int i = 0; i < 3; ++i) {
+        m[i] = _rows[i];
+      }
+      m[3][3] = 1;
+      return m;
+    }
+
+    // Transform a homogeneous vector. w is left unchanged, so this
+    // works for both points and directions.
+    vector_type operator* (const vector_type& v) const {
+      return vector_type(_rows[0] * v, _rows[1] * v, _rows[2] * v, v[3]);
+    }
+
+    // Transform a point, which must have w = 1.
+    vector_type transform_point(const vector_type& p) const {
+      assert(p[3] == 1);
+      return (*this) * p;
+    }
+
+    // Transform a direction, which must have w = 0.
+    vector_type transform_direction(const vector_type& d) const {
+      assert(d[3] == 0);
+      return (*this) * d;
+    }
+
+    // The inverse of [A t] is [A^-1  -A^-1 t].
+    same_type inverse() const {
+      return from_inverse_linear(gmath::inverse(linear()));
+    }
+
+    // The inverse of a rigid transform, i.e. one whose A is a
+    // rotation, is [A^T  -A^T t], with no 3x3 inverse. This is only
+    // correct when the rows of A are orthonormal.
+    constexpr same_type rigid_inverse() const {
+      return from_inverse_linear(linear().transpose());
+    }
+
+    // The transform for surface normals: the inverse transpose of A,
+    // with no translation.
+    same_type normal_transform() const {
+      linear_type linear_inverse(gmath::inverse(linear()));
+      same_type result;
+      for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+          result._rows[j][i] = linear_inverse[i][j];
+        }
+      }
+      return result;
+    }
+
+  private:
+    constexpr same_type from_inverse_linear(const linear_type& linear_inverse) const {
+      same_type result;
+      for (int i = 0; i < 3; ++i) {
+        result._rows[i][3] = 0;
+        for (int j = 0; j < 3; ++j) {
+          result._rows[i][j] = linear_inverse[i][j];
+          result._rows[i][3] -= linear_inverse[i][j] * _rows[j][3];
+        }
+      }
+      return result;
+    }
+  };
+
+  // Batch transforms: one matrix applied to a contiguous array of
+  // count vectors, output[i] = m * input[i]. The SIMD kernel keeps the
+  // matrix's columns in registers for the whole batch, and each vector
+  // costs four broadcasts, multiplies and adds, with no horizontal
+  // sums, so long batches run at close to memory speed. Sums are
+  // formed in the same order as the dot products of m * input[i], so
+  // the results are the same. output may be input, for transforming in
+  // place, but must not otherwise overlap it.
+  template <typename SCALAR, bool SIMD = Simd<SCALAR, 4>::enabled>
+  struct BatchTransform {
+    static void apply(const Matrix<SCALAR, 4, 4>& m, const Vector<SCALAR, 4>* input,
+                      Vector<SCALAR, 4>* output, size_t count) {
+      for (size_t i = 0; i < count; ++i) {
+        output[i] = m * input[i];
+      }
+    }
+  };
+
+  template <typename SCALAR>
+  struct BatchTransform<SCALAR, true> {
+    typedef Simd<SCALAR, 4> simd;
+    typedef typename simd::packet_type packet_type;
+
+    static void apply(const Matrix<SCALAR, 4, 4>& m, const Vector<SCALAR, 4>* input,
+                      Vector<SCALAR, 4>* output, size_t count) {
+      Matrix<SCALAR, 4, 4> columns(m.transpose());
+      packet_type c0(columns[0].packet()), c1(columns[1].packet()),
+        c2(columns[2].packet()), c3(columns[3].packet()),
+        zero(simd::broadcast(0));
+      for (size_t i = 0; i < count; ++i) {
+        const Vector<SCALAR, 4>& v(input[i]);
+        // starting from 0, like the dot product, so that -0 products
+        // sum to +0 here too
+        packet_type sum(simd::add(zero, simd::multiply(c0, simd::broadcast(v[0]))));
+        sum = simd::add(sum, simd::multiply(c1, simd::broadcast(v[1])));
+        sum = simd::add(sum, simd::multiply(c2, simd::broadcast(v[2])));
+        sum = simd::add(sum, simd::multiply(c3, simd::broadcast(v[3])));
+        simd::store(&output[i][0], sum);
+      }
+    }
+  };
+
+  template <typename SCALAR>
+  void transform_batch(const Matrix<SCALAR, 4, 4>& m, const Vector<SCALAR, 4>* input,
+                       Vector<SCALAR, 4>* output, size_t count) {
+    BatchTransform<SCALAR>::apply(m, input, output, count);
+  }
+
+  // As above, for an affine transform; the same as t * input[i] for
+  // finite inputs.
+  template <typename SCALAR>
+  void transform_batch(const AffineTransform<SCALAR>& t, const Vector<SCALAR, 4>* input,
+                       Vector<SCALAR, 4>* output, size_t count) {
+    BatchTransform<SCALAR>::apply(t.matrix(), input, output, count);
+  }
+
+  // Vectors and matrices are plain arrays of scalars, so arrays of
+  // them can be copied with memcpy(), mapped from files, and written
+  // out byte for byte.
+  static_assert(std::is_trivially_copyable<Vector<double, 3> >::value, "Vector must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Vector<double, 4> >::value, "Vector must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Vector<float, 4> >::value, "Vector must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Matrix<double, 4, 4> >::value, "Matrix must be trivially copyable");
+  static_assert(sizeof(Vector<double, 4>) == 4 * sizeof(double), "Vector must have no padding");
+  static_assert(sizeof(Matrix<double, 4, 4>) == 16 * sizeof(double), "Matrix must have no padding");
+  static_assert(std::is_trivially_copyable<AffineTransform<double> >::value, "AffineTransform must be trivially copyable");
+  static_assert(sizeof(AffineTransform<double>) == 12 * sizeof(double), "AffineTransform must have no padding");
+  static_assert(std::is_trivially_copyable<VectorPack<double, 4, 8> >::value, "VectorPack must be trivially copyable");
+  static_assert(sizeof(VectorPack<double, 4, 8>) == 32 * sizeof(double), "VectorPack must have no padding");
+
+  // ...and can be computed at compile time.
+  static_assert(Vector<double, 3>(1, 2, 3)[2] == 3, "Vector must be constexpr");
+  static_assert((Vector<double, 3>(1, 2, 3) * 2.0 - Vector<double, 3>(1.0))[1] == 3, "Vector must be constexpr");
+  static_assert(Matrix<double, 4, 4>(1.0)[3][3] == 1, "Matrix must be constexpr");
+
+  // The checks below need test matrices, which are kept out of the
+  // public gmath names.
+  namespace detail {
+    // The 4x4 inverse, checked on a matrix of determinant 1, whose
+    // inverse is exact, at one element per row of each half of the
+    // cofactor expansion.
+    constexpr Matrix<double, 4, 4> unimodular(Vector<double, 4>(-1, 2, -2, 2), Vector<double, 4>(1, -1, 1, -1),
+                                              Vector<double, 4>(0, -2, 3, -1), Vector<double, 4>(2, 1, 0, 1));
+    static_assert(determinant(unimodular) == 1, "4x4 determinant is wrong");
+    static_assert((inverse(unimodular)[0][1] == 2) && (inverse(unimodular)[0][3] == 0), "4x4 inverse is wrong");
+    static_assert((inverse(unimodular)[1][0] == -7) && (inverse(unimodular)[1][3] == 2), "4x4 inverse is wrong");
+    static_assert((inverse(unimodular)[2][1] == -5) && (inverse(unimodular)[2][3] == 1), "4x4 inverse is wrong");
+    static_assert((inverse(unimodular)[3][0] == 5) && (inverse(unimodular)[3][2] == 1), "4x4 inverse is wrong");
+
+    // The rigid inverse, checked on a quarter turn about z followed by
+    // a translation of (1, 2, 3).
+    constexpr AffineTransform<double> quarter_turn(Matrix<double, 4, 4>(
+      Vector<double, 4>(0, -1, 0, 1), Vector<double, 4>(1, 0, 0, 2),
+      Vector<double, 4>(0, 0, 1, 3), Vector<double, 4>(0, 0, 0, 1)));
+    static_assert((quarter_turn.rigid_inverse()[0][1] == 1) && (quarter_turn.rigid_inverse()[0][3] == -2),
+                  "rigid inverse is wrong");
+    static_assert((quarter_turn.rigid_inverse()[1][0] == -1) && (quarter_turn.rigid_inverse()[1][3] == 1),
+                  "rigid inverse is wrong");
+    static_assert((quarter_turn.rigid_inverse()[2][2] == 1) && (quarter_turn.rigid_inverse()[2][3] == -3),
+                  "rigid inverse is wrong");
+  }
 }
 
 // vim: et ts=2 sw=2 :
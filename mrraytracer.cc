@@ -37,18 +37,67 @@
 // SOFTWARE.
 //
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <new>
 #include <string>
 #include <vector>
 
 #include "raytrace.hh"
 
+// Number of heap allocations made so far. The global operator new is
+// replaced so that --stats can report how many allocations happen
+// while tracing, which should be none per pixel.
+std::atomic<uint64_t> heap_allocations(0);
+
+void* operator new(std::size_t size) {
+  heap_allocations++;
+  void* p = malloc(size > 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  free(p);
+}
+
 // Default image dimensions.
 const int DEFAULT_WIDTH(640), DEFAULT_HEIGHT(640);
 
+// Default number of balls in the ballpit scene.
+const int DEFAULT_BALLS(8000);
+
+// Default width and height of the pixel tiles traced as packets.
+const int DEFAULT_TILE_SIZE(raytrace::Scene::DEFAULT_TILE_SIZE);
+
+// Colors to choose from, see
+// http://www.w3schools.com/colors/colors_names.asp
+// for more. These are computed at compile time.
+constexpr raytrace::Color WHITE(raytrace::web_color(0xFFFFFF)),
+  NEAR_BLACK(raytrace::web_color(0x202020)),
+  PURE_RED(raytrace::web_color(0xFF0000)),
+  PURE_GREEN(raytrace::web_color(0x00FF00)),
+  PURE_BLUE(raytrace::web_color(0x0000FF)),
+  PURPLE(raytrace::web_color(0x800080)),
+  ORANGE(raytrace::web_color(0xFFA500)),
+  LIGHT_YELLOW(raytrace::web_color(0xFFFFE0)),
+  LIGHT_BLUE(raytrace::web_color(0xADD8E6)),
+  SKY_BLUE(raytrace::web_color(0x87CEEB)),
+  PLUM(raytrace::web_color(0xDDA0DD)),
+  PAPAYA_WHIP(raytrace::web_color(0xFFEFD5));
+
 // Hardcoded random number generator seed, for perfect consistency
 // between runs.
 const int SEED(0xF00DFACE);
@@ -61,16 +110,95 @@ const int SEED(0xF00DFACE);
 // ballpit: More involved scene with thousands of small balls and
 // several point lights.
 //
-// deluxe: Reserved for expansion; create your own scene!
+// deluxe: A field of identical clusters of balls, each a rotated
+// instance of one shared group of objects.
 
 enum SceneName { SCENE_NAME_SPHERES, SCENE_NAME_BALLPIT, SCENE_NAME_DELUXE };
 
+// The acceleration structure used to find ray/object intersections:
+//
+// linear: Test every object against every ray.
+//
+// bvh: Bounding volume hierarchy (default).
+//
+// grid: Uniform grid.
+//
+// bvh4, bvh8: 4- or 8-wide bounding volume hierarchy.
+//
+// lbvh: Bounding volume hierarchy built in parallel from Morton codes.
+//
+// kdtree: Kd-tree with stackless traversal.
+//
+// qbvh: 4-wide bounding volume hierarchy with compressed nodes.
+//
+// dynamic: Bounding volume hierarchy that supports incremental edits.
+//
+// octree: Loose octree.
+
+enum AccelName { ACCEL_NAME_LINEAR, ACCEL_NAME_BVH, ACCEL_NAME_GRID,
+                 ACCEL_NAME_BVH4, ACCEL_NAME_BVH8, ACCEL_NAME_LBVH,
+                 ACCEL_NAME_KDTREE, ACCEL_NAME_QBVH, ACCEL_NAME_DYNAMIC,
+                 ACCEL_NAME_OCTREE };
+
+// Every AccelName, in the order --accel-stats compares them, with its
+// command-line spelling.
+const struct {
+  AccelName accel_name;
+  const char* spelling;
+} ACCEL_NAMES[] = {
+  { ACCEL_NAME_LINEAR, "linear" },
+  { ACCEL_NAME_BVH, "bvh" },
+  { ACCEL_NAME_BVH4, "bvh4" },
+  { ACCEL_NAME_BVH8, "bvh8" },
+  { ACCEL_NAME_LBVH, "lbvh" },
+  { ACCEL_NAME_QBVH, "qbvh" },
+  { ACCEL_NAME_DYNAMIC, "dynamic" },
+  { ACCEL_NAME_KDTREE, "kdtree" },
+  { ACCEL_NAME_OCTREE, "octree" },
+  { ACCEL_NAME_GRID, "grid" },
+};
+
+// Every BVH node layout, in the order --layout-report compares them,
+// with its command-line spelling.
+const struct {
+  raytrace::BVHAccelerator::Layout layout;
+  const char* spelling;
+} LAYOUT_NAMES[] = {
+  { raytrace::BVHAccelerator::AS_BUILT, "built" },
+  { raytrace::BVHAccelerator::DEPTH_FIRST, "dfs" },
+  { raytrace::BVHAccelerator::VAN_EMDE_BOAS, "veb" },
+  { raytrace::BVHAccelerator::TREELETS, "treelet" },
+};
+
+// Data caches modeled by --layout-report, sized like those of a
+// current x86 core.
+const int CACHE_LINE_BYTES(64);
+const int L1_CACHE_BYTES(32 * 1024), L1_CACHE_WAYS(8);
+const int L2_CACHE_BYTES(1024 * 1024), L2_CACHE_WAYS(16);
+
 // Configuration, from command-line arguments.
 struct Config {
   SceneName scene_name;
   std::string output_path;
   int width, height;
   bool perspective;
+  AccelName accel_name;
+  int balls;
+  bool stats;
+  int frames;
+  std::string accel_cache_path;
+  int edits;
+  bool accel_stats;
+  raytrace::BVHAccelerator::Layout layout;
+  bool layout_report;
+  int tile_size;
+  bool gmath_bench;
+  bool float_precision;
+  bool precision_report;
+  bool fast_math;
+  bool fast_math_report;
+  bool shadows;
+  bool check_allocations;
 };
 
 // Print command-line usage in the event of user error.
@@ -85,6 +213,57 @@ void print_usage() {
             << "    --height H        H must be a positive integer; default is " << DEFAULT_HEIGHT << std::endl
             << "    --orthographic    use orthographic projection (default)" << std::endl
             << "    --perspective     use perspective projection instead of orthographic" << std::endl
+            << "    --accel ACCEL     ACCEL must be one of: linear bvh bvh4 bvh8 lbvh grid kdtree qbvh" << std::endl
+            << "                      dynamic octree; default is bvh" << std::endl
+            << "    --balls N         number of balls in the ballpit scene; default is " << DEFAULT_BALLS << std::endl
+            << "    --stats           print timing and traversal statistics to stderr" << std::endl
+            << "    --frames N        render N frames of animation, with every object bobbing" << std::endl
+            << "                      up and down; frame numbers are added to OUTPUT_PATH" << std::endl
+            << "    --edits N         with --frames, instead of moving every object, remove N" << std::endl
+            << "                      objects per frame and add them back elsewhere" << std::endl
+            << "    --layout LAYOUT   order of the node array of bvh and lbvh; LAYOUT must be one" << std::endl
+            << "                      of: built dfs veb treelet; default is built" << std::endl
+            << "    --layout-report   render the first frame with bvh, or lbvh if that is ACCEL," << std::endl
+            << "                      in every LAYOUT in turn, replay the nodes each ray visits" << std::endl
+            << "                      through a model of a " << L1_CACHE_BYTES / 1024 << " KB L1 and "
+            << L2_CACHE_BYTES / 1024 << " KB L2 data" << std::endl
+            << "                      cache, and print a CSV table of misses per ray to standard" << std::endl
+            << "                      output" << std::endl
+            << "    --tile N          trace the viewing rays of N by N pixel tiles as packets;" << std::endl
+            << "                      1 traces every ray alone; default is " << DEFAULT_TILE_SIZE << std::endl
+            << "    --precision P     trace viewing rays and shade in P precision; P must be one" << std::endl
+            << "                      of: float double; default is double" << std::endl
+            << "    --precision-report" << std::endl
+            << "                      render the first frame in both precisions, print a CSV" << std::endl
+            << "                      table of the float image's error to standard output, and" << std::endl
+            << "                      write the float image" << std::endl
+            << "    --fast-math-kernels" << std::endl
+            << "                      normalize and shade with approximate reciprocal square" << std::endl
+            << "                      roots and fused multiply-adds; the multiply-adds are" << std::endl
+            << "                      only fused when built with -mfma or -march=native, and" << std::endl
+            << "                      --gmath-bench shows whether the kernels are faster here" << std::endl
+            << "    --fast-math-report" << std::endl
+            << "                      render the first frame with exact and with fast math" << std::endl
+            << "                      kernels, print a CSV table of the fast image's error to" << std::endl
+            << "                      standard output, and write the fast image" << std::endl
+            << "    --shadows         cast a shadow ray towards every point light, so that" << std::endl
+            << "                      objects in the way leave hard shadows" << std::endl
+            << "    --check-allocations" << std::endl
+            << "                      render the first frame, and exit with an error if that" << std::endl
+            << "                      makes more heap allocations than rendering one pixel," << std::endl
+            << "                      i.e. if tracing allocates per ray" << std::endl
+            << "    --accel-stats     render the first frame with every ACCEL in turn, tracing" << std::endl
+            << "                      every ray alone, and print a CSV table comparing them to" << std::endl
+            << "                      standard output" << std::endl
+            << "    --gmath-bench     time fused and unfused vector expressions, fast and exact" << std::endl
+            << "                      math kernels, and one ray against packed and unpacked" << std::endl
+            << "                      spheres, print CSV tables" << std::endl
+            << "                      to standard output, and exit; needs no SCENE or" << std::endl
+            << "                      OUTPUT_PATH" << std::endl
+            << "    --accel-cache FILE" << std::endl
+            << "                      load the acceleration structure from FILE if it was saved" << std::endl
+            << "                      there for the same scene, or else build it and save it" << std::endl
+            << "                      there; supported by bvh and lbvh" << std::endl
             << std::endl
             << "Exactly one SCENE and exactly one OUTPUT_PATH must be specified." << std::endl
             << std::endl;
@@ -101,6 +280,30 @@ bool parse_positive_int(int& result, const std::string& s) {
   }
 }
 
+// Convert the spelling of an accelerator name to an AccelName.
+// Return true on success and false on failure.
+bool parse_accel_name(AccelName& result, const std::string& s) {
+  for (const auto& entry : ACCEL_NAMES) {
+    if (s == entry.spelling) {
+      result = entry.accel_name;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Convert the spelling of a node layout to a Layout. Return true on
+// success and false on failure.
+bool parse_layout(raytrace::BVHAccelerator::Layout& result, const std::string& s) {
+  for (const auto& entry : LAYOUT_NAMES) {
+    if (s == entry.spelling) {
+      result = entry.layout;
+      return true;
+    }
+  }
+  return false;
+}
+
 // Parse the command-line arguments to produce an initialized Config
 // object.
 std::unique_ptr<Config> parse_config(int argc, char** argv) {
@@ -119,10 +322,27 @@ std::unique_ptr<Config> parse_config(int argc, char** argv) {
   config->width = DEFAULT_WIDTH;
   config->height = DEFAULT_HEIGHT;
   config->perspective = false;
+  config->accel_name = ACCEL_NAME_BVH;
+  config->balls = DEFAULT_BALLS;
+  config->stats = false;
+  config->frames = 1;
+  config->edits = 0;
+  config->accel_stats = false;
+  config->layout = raytrace::BVHAccelerator::AS_BUILT;
+  config->layout_report = false;
+  config->tile_size = DEFAULT_TILE_SIZE;
+  config->gmath_bench = false;
+  config->float_precision = false;
+  config->precision_report = false;
+  config->fast_math = false;
+  config->fast_math_report = false;
+  config->shadows = false;
+  config->check_allocations = false;
 
   bool error(false),
     got_scene(false),
-    got_output_path(false);
+    got_output_path(false),
+    got_accel(false);
 
   for (int i = 0; (i < args.size()) && !error; ++i) {
     
@@ -170,18 +390,739 @@ std::unique_ptr<Config> parse_config(int argc, char** argv) {
       config->perspective = false;
     } else if (args[i] == "--perspective") {
       config->perspective = true;
+    } else if (args[i] == "--accel") {
+      if (last || got_accel) {
+        error = true;
+      } else if (!parse_accel_name(config->accel_name, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+        got_accel = true;
+      }
+    } else if (args[i] == "--balls") {
+      if (last || !parse_positive_int(config->balls, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+      }
+    } else if (args[i] == "--frames") {
+      if (last || !parse_positive_int(config->frames, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+      }
+    } else if (args[i] == "--edits") {
+      if (last || !parse_positive_int(config->edits, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+      }
+    } else if (args[i] == "--stats") {
+      config->stats = true;
+    } else if (args[i] == "--layout") {
+      if (last || !parse_layout(config->layout, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+      }
+    } else if (args[i] == "--layout-report") {
+      config->layout_report = true;
+    } else if (args[i] == "--precision") {
+      if (last) {
+        error = true;
+      } else if (args[i+1] == "float") {
+        config->float_precision = true;
+        i++;
+      } else if (args[i+1] == "double") {
+        config->float_precision = false;
+        i++;
+      } else {
+        error = true;
+      }
+    } else if (args[i] == "--precision-report") {
+      config->precision_report = true;
+    } else if (args[i] == "--fast-math-kernels") {
+      config->fast_math = true;
+    } else if (args[i] == "--fast-math-report") {
+      config->fast_math_report = true;
+    } else if (args[i] == "--shadows") {
+      config->shadows = true;
+    } else if (args[i] == "--check-allocations") {
+      config->check_allocations = true;
+    } else if (args[i] == "--tile") {
+      if (last || !parse_positive_int(config->tile_size, args[i+1])) {
+        error = true;
+      } else {
+        i++;
+      }
+    } else if (args[i] == "--accel-stats") {
+      config->accel_stats = true;
+    } else if (args[i] == "--gmath-bench") {
+      config->gmath_bench = true;
+    } else if (args[i] == "--accel-cache") {
+      if (last || !config->accel_cache_path.empty() || args[i+1].empty()) {
+        error = true;
+      } else {
+        config->accel_cache_path = args[i+1];
+        i++;
+      }
     } else {
       error = true;
     }
   }
 
-  if (error || !got_scene || !got_output_path) {
+  if (error || (!config->gmath_bench && (!got_scene || !got_output_path))) {
     return nullptr;
   } else {
     return config;
   }    
 }
 
+// Print the work done by an accelerator over the given number of
+// primitives during one render, given the seconds spent building it
+// and tracing rays through it, and the heap allocations made while
+// tracing. Rays are viewing rays; shadow rays are counted apart.
+void print_statistics(const raytrace::Accelerator& accelerator, size_t primitives,
+                      double build_seconds, double trace_seconds,
+                      uint64_t trace_allocations) {
+  const raytrace::Accelerator::Statistics& stats(accelerator.statistics());
+  double rays(stats.rays > 0 ? stats.rays : 1),
+    shadow_rays(stats.occlusion_rays > 0 ? stats.occlusion_rays : 1);
+  size_t memory(accelerator.memory_bytes());
+  raytrace::Accelerator::Structure structure(accelerator.structure());
+  std::cerr << "memory:                    " << memory << " bytes" << std::endl
+            << "bytes per primitive:       " << memory / double(primitives > 0 ? primitives : 1) << std::endl
+            << "nodes:                     " << structure.nodes << std::endl
+            << "depth:                     " << structure.depth << std::endl
+            << "SAH cost:                  " << structure.sah_cost << std::endl
+            << "build time:                " << build_seconds << " s" << std::endl
+            << "trace time:                " << trace_seconds << " s" << std::endl
+            << "rays:                      " << stats.rays << std::endl
+            << "rays per second:           " << stats.rays / trace_seconds << std::endl
+            << "nodes visited per ray:     " << stats.nodes_visited / rays << std::endl
+            << "primitives tested per ray: " << stats.primitives_tested / rays << std::endl
+            << "shadow rays:               " << stats.occlusion_rays << std::endl
+            << "nodes per shadow ray:      " << stats.occlusion_nodes_visited / shadow_rays << std::endl
+            << "primitives per shadow ray: " << stats.occlusion_primitives_tested / shadow_rays << std::endl
+            << "heap allocations:          " << trace_allocations << std::endl
+            << "heap allocations per ray:  " << trace_allocations / rays << std::endl;
+}
+
+// Return the path to write one frame of an animation to: path itself
+// for a still image, or path with a frame number inserted before its
+// extension.
+std::string frame_path(const std::string& path, int frame, int frames) {
+  if (frames == 1) {
+    return path;
+  }
+  std::string number(std::to_string(frame));
+  number.insert(0, std::string(number.size() < 4 ? 4 - number.size() : 0, '0'));
+  size_t dot(path.rfind('.'));
+  if ((dot == std::string::npos) || (path.find('/', dot) != std::string::npos)) {
+    return path + "_" + number;
+  }
+  return path.substr(0, dot) + "_" + number + path.substr(dot);
+}
+
+// Animate the scene from frame - 1 to frame: each object bobs up and
+// down along a sine wave with its own phase.
+void animate(raytrace::Scene& scene, int frame) {
+  const double AMPLITUDE(0.05), RADIANS_PER_FRAME(0.3);
+  for (size_t i = 0; i < scene.object_count(); ++i) {
+    double before(AMPLITUDE * sin(i + RADIANS_PER_FRAME * (frame - 1))),
+      after(AMPLITUDE * sin(i + RADIANS_PER_FRAME * frame));
+    scene.translate_object(i, *raytrace::vector4_translation(0, after - before, 0));
+  }
+}
+
+// Edit the scene between frames: remove edits objects, chosen
+// pseudo-randomly, and add each one back shifted sideways.
+void edit(raytrace::Scene& scene, int edits) {
+  const double SHIFT(0.2);
+  for (int k = 0; (k < edits) && (scene.object_count() > 0); ++k) {
+    size_t index(rand() % scene.object_count());
+    auto object(scene.object(index));
+    scene.remove_object(index);
+    object->translate(*raytrace::vector4_translation(SHIFT, 0, 0));
+    scene.add_object(object);
+  }
+}
+
+// Create the acceleration structure named by the configuration,
+// with the given node layout if it is a BVHAccelerator.
+std::shared_ptr<raytrace::Accelerator> make_accelerator(AccelName accel_name,
+                                                        raytrace::BVHAccelerator::Layout layout) {
+  std::shared_ptr<raytrace::BVHAccelerator> bvh;
+  switch (accel_name) {
+  case ACCEL_NAME_LINEAR:
+    return std::make_shared<raytrace::LinearAccelerator>();
+  case ACCEL_NAME_GRID:
+    return std::make_shared<raytrace::GridAccelerator>();
+  case ACCEL_NAME_BVH4:
+    return std::make_shared<raytrace::WideBVHAccelerator<4> >();
+  case ACCEL_NAME_BVH8:
+    return std::make_shared<raytrace::WideBVHAccelerator<8> >();
+  case ACCEL_NAME_LBVH:
+    bvh = std::make_shared<raytrace::LBVHAccelerator>();
+    bvh->set_layout(layout);
+    return bvh;
+  case ACCEL_NAME_KDTREE:
+    return std::make_shared<raytrace::KDTreeAccelerator>();
+  case ACCEL_NAME_QBVH:
+    return std::make_shared<raytrace::QuantizedBVHAccelerator>();
+  case ACCEL_NAME_DYNAMIC:
+    return std::make_shared<raytrace::DynamicBVHAccelerator>();
+  case ACCEL_NAME_OCTREE:
+    return std::make_shared<raytrace::OctreeAccelerator>();
+  case ACCEL_NAME_BVH:
+  default:
+    bvh = std::make_shared<raytrace::BVHAccelerator>();
+    bvh->set_layout(layout);
+    return bvh;
+  }
+}
+
+// Render the scene once with each accelerator, printing a CSV table
+// of their statistics to standard output, and return the last image.
+// Only some accelerators trace packets, and they count a node visited
+// once per packet rather than once per ray, so every ray is traced
+// alone here to keep the counts comparable.
+std::shared_ptr<raytrace::Image> compare_accelerators(raytrace::Scene& scene,
+                                                      const Config& config) {
+  scene.set_tile_size(1);
+  std::cout << "accel,objects,build_seconds,memory_bytes,bytes_per_object,nodes,depth,"
+            << "sah_cost,rays,nodes_per_ray,primitives_per_ray,rays_per_second,"
+            << "shadow_rays,nodes_per_shadow_ray,primitives_per_shadow_ray" << std::endl;
+  std::shared_ptr<raytrace::Image> image;
+  for (const auto& entry : ACCEL_NAMES) {
+    auto accelerator(make_accelerator(entry.accel_name, config.layout));
+    scene.set_accelerator(accelerator);
+
+    auto start(std::chrono::steady_clock::now());
+    scene.build_accelerator();
+    auto built(std::chrono::steady_clock::now());
+    image = scene.render(config.width, config.height);
+    auto traced(std::chrono::steady_clock::now());
+    if (!image) {
+      return nullptr;
+    }
+
+    std::chrono::duration<double> build_time(built - start), trace_time(traced - built);
+    const raytrace::Accelerator::Statistics& stats(accelerator->statistics());
+    raytrace::Accelerator::Structure structure(accelerator->structure());
+    double objects(scene.object_count() > 0 ? scene.object_count() : 1),
+      rays(stats.rays > 0 ? stats.rays : 1),
+      shadow_rays(stats.occlusion_rays > 0 ? stats.occlusion_rays : 1);
+    std::cout << entry.spelling << ","
+              << scene.object_count() << ","
+              << build_time.count() << ","
+              << accelerator->memory_bytes() << ","
+              << accelerator->memory_bytes() / objects << ","
+              << structure.nodes << ","
+              << structure.depth << ","
+              << structure.sah_cost << ","
+              << stats.rays << ","
+              << stats.nodes_visited / rays << ","
+              << stats.primitives_tested / rays << ","
+              << stats.rays / trace_time.count() << ","
+              << stats.occlusion_rays << ","
+              << stats.occlusion_nodes_visited / shadow_rays << ","
+              << stats.occlusion_primitives_tested / shadow_rays << std::endl;
+  }
+  scene.set_tile_size(config.tile_size);
+  return image;
+}
+
+// A set-associative cache with least recently used replacement, for
+// counting the misses that a sequence of reads would cause.
+class CacheModel {
+private:
+  int _ways;
+  size_t _sets;
+  // The lines held by each set, most recently used first.
+  std::vector<uintptr_t> _lines;
+
+public:
+  CacheModel(int bytes, int ways)
+    : _ways(ways), _sets(bytes / (CACHE_LINE_BYTES * ways)),
+      _lines(_sets * ways, std::numeric_limits<uintptr_t>::max()) {
+    assert(_sets > 0);
+  }
+
+  // Read the line with the given number, i.e. address divided by
+  // CACHE_LINE_BYTES. Return true iff the cache did not hold it.
+  bool read(uintptr_t line) {
+    uintptr_t* set = &_lines[(line % _sets) * _ways];
+    int way = 0;
+    while ((way < _ways) && (set[way] != line)) {
+      ++way;
+    }
+    bool miss = (way == _ways);
+    for (way = miss ? _ways - 1 : way; way > 0; --way) {
+      set[way] = set[way - 1];
+    }
+    set[0] = line;
+    return miss;
+  }
+};
+
+// Render the scene once with each node layout of a BVH, an
+// LBVHAccelerator if that is the configured accelerator and a
+// BVHAccelerator otherwise, and print a CSV table to standard output
+// of the L1 and L2 misses per ray that reading the nodes would cause
+// in a CacheModel of each. Each visit to a node reads it, and its
+// children too if it is interior. Nothing else the traversal reads
+// depends on the layout, so nothing else is modeled. Return the last
+// image.
+std::shared_ptr<raytrace::Image> compare_layouts(raytrace::Scene& scene,
+                                                 const Config& config) {
+  std::shared_ptr<raytrace::BVHAccelerator> bvh;
+  if (config.accel_name == ACCEL_NAME_LBVH) {
+    bvh = std::make_shared<raytrace::LBVHAccelerator>();
+  } else {
+    bvh = std::make_shared<raytrace::BVHAccelerator>();
+  }
+  scene.set_accelerator(bvh);
+  scene.build_accelerator();
+
+  std::cout << "layout,rays,nodes_per_ray,l1_misses_per_ray,l2_misses_per_ray,"
+            << "rays_per_second" << std::endl;
+  std::shared_ptr<raytrace::Image> image;
+  std::vector<uint32_t> trace;
+  for (const auto& entry : LAYOUT_NAMES) {
+    // every layout holds the same tree, so reorder it rather than
+    // build it again
+    bvh->reorder(entry.layout);
+    bvh->reset_statistics();
+    auto start(std::chrono::steady_clock::now());
+    image = scene.render(config.width, config.height);
+    auto traced(std::chrono::steady_clock::now());
+    if (!image) {
+      return nullptr;
+    }
+    std::chrono::duration<double> trace_time(traced - start);
+    raytrace::Accelerator::Statistics stats(bvh->statistics());
+    double rays(stats.rays > 0 ? stats.rays : 1);
+
+    // render again to record the nodes visited, which would slow
+    // down the timed render
+    trace.clear();
+    bvh->set_node_trace(&trace);
+    scene.render(config.width, config.height);
+    bvh->set_node_trace(nullptr);
+
+    CacheModel l1(L1_CACHE_BYTES, L1_CACHE_WAYS), l2(L2_CACHE_BYTES, L2_CACHE_WAYS);
+    uint64_t l1_misses(0), l2_misses(0);
+    auto read = [&](const raytrace::BVHAccelerator::Node* begin, size_t count) {
+      uintptr_t first(reinterpret_cast<uintptr_t>(begin) / CACHE_LINE_BYTES),
+        last((reinterpret_cast<uintptr_t>(begin + count) - 1) / CACHE_LINE_BYTES);
+      for (uintptr_t line = first; line <= last; ++line) {
+        if (l1.read(line)) {
+          l1_misses++;
+          if (l2.read(line)) {
+            l2_misses++;
+          }
+        }
+      }
+    };
+    const raytrace::BVHAccelerator::Node* nodes(bvh->node_data());
+    for (uint32_t index : trace) {
+      read(nodes + index, 1);
+      if (!nodes[index].is_leaf()) {
+        read(nodes + nodes[index].first, 2);
+      }
+    }
+
+    std::cout << entry.spelling << ","
+              << stats.rays << ","
+              << stats.nodes_visited / rays << ","
+              << l1_misses / rays << ","
+              << l2_misses / rays << ","
+              << stats.rays / trace_time.count() << std::endl;
+  }
+  return image;
+}
+
+// Render the scene at one pixel and then at the configured size, in
+// the configured precision, after one render to warm up, and return
+// the number of heap allocations each one made.
+template <typename SCALAR>
+std::shared_ptr<raytrace::BasicImage<SCALAR> > count_render_allocations(raytrace::Scene& scene,
+                                                                        const Config& config,
+                                                                        uint64_t& pixel_allocations,
+                                                                        uint64_t& image_allocations) {
+  scene.build_accelerator();
+  scene.render<SCALAR>(config.width, config.height);
+  uint64_t start(heap_allocations);
+  scene.render<SCALAR>(1, 1);
+  uint64_t pixel_rendered(heap_allocations);
+  auto image(scene.render<SCALAR>(config.width, config.height));
+  pixel_allocations = pixel_rendered - start;
+  image_allocations = heap_allocations - pixel_rendered;
+  return image;
+}
+
+// Check that rendering the first frame makes no heap allocations per
+// ray: that it makes as many as rendering one pixel, which are those
+// for the image and the per-render scratch space. Print both counts
+// to stderr, write the image, and return true iff they are equal.
+bool check_allocations(raytrace::Scene& scene, const Config& config) {
+  uint64_t pixel_allocations, image_allocations;
+  bool written;
+  if (config.float_precision) {
+    auto image(count_render_allocations<float>(scene, config, pixel_allocations, image_allocations));
+    written = image && image->write_ppm(config.output_path);
+  } else {
+    auto image(count_render_allocations<double>(scene, config, pixel_allocations, image_allocations));
+    written = image && image->write_ppm(config.output_path);
+  }
+  std::cerr << "heap allocations for 1x1:  " << pixel_allocations << std::endl
+            << "heap allocations for " << config.width << "x" << config.height << ": "
+            << image_allocations << std::endl;
+  if (!written) {
+    std::cerr << "ERROR: could not write " << config.output_path << std::endl;
+    return false;
+  }
+  if (image_allocations != pixel_allocations) {
+    std::cerr << "ERROR: tracing made " << image_allocations - pixel_allocations
+              << " heap allocations that depend on the number of rays" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Columns of the rows printed by print_image_error().
+const char* const IMAGE_ERROR_COLUMNS =
+  "trace_seconds,max_intensity_error,max_byte_error,differing_pixels,differing_percent";
+
+// Print one CSV row for an image that took trace_seconds to render:
+// how far it is from the exact image, as the largest difference in any
+// channel, before and after discretizing to bytes, and the number of
+// pixels whose bytes differ.
+template <typename SCALAR>
+void print_image_error(const char* name, double trace_seconds,
+                       const raytrace::Image& exact, const raytrace::BasicImage<SCALAR>& image) {
+  double max_intensity_error(0.0);
+  int max_byte_error(0);
+  long differing_pixels(0);
+  for (int y = 0; y < exact.height(); ++y) {
+    for (int x = 0; x < exact.width(); ++x) {
+      bool differs(false);
+      for (int c = 0; c < 3; ++c) {
+        double e(exact.pixel(x, y)[c]), a(image.pixel(x, y)[c]);
+        max_intensity_error = std::max(max_intensity_error, std::abs(a - e));
+        int byte_error(std::abs(raytrace::Image::discretize(a) - raytrace::Image::discretize(e)));
+        max_byte_error = std::max(max_byte_error, byte_error);
+        differs = differs || (byte_error > 0);
+      }
+      if (differs) {
+        differing_pixels++;
+      }
+    }
+  }
+  std::cout << name << ","
+            << trace_seconds << ","
+            << max_intensity_error << ","
+            << max_byte_error << ","
+            << differing_pixels << ","
+            << 100.0 * differing_pixels / (double(exact.width()) * exact.height()) << std::endl;
+}
+
+// Render the scene in double and then in float precision, and print a
+// CSV table to standard output of each one's trace time and of how far
+// the float image is from the double one. Return the float image.
+// Each precision is rendered once untimed first, so that one-time
+// work, such as the float copy of a BVH's nodes, is not timed.
+std::shared_ptr<raytrace::BasicImage<float> > compare_precisions(raytrace::Scene& scene,
+                                                                 const Config& config) {
+  scene.build_accelerator();
+  scene.render<double>(config.width, config.height);
+  scene.render<float>(config.width, config.height);
+  auto start(std::chrono::steady_clock::now());
+  auto double_image(scene.render<double>(config.width, config.height));
+  auto double_traced(std::chrono::steady_clock::now());
+  auto float_image(scene.render<float>(config.width, config.height));
+  auto float_traced(std::chrono::steady_clock::now());
+  if (!double_image || !float_image) {
+    return nullptr;
+  }
+
+  std::chrono::duration<double> double_time(double_traced - start), float_time(float_traced - double_traced);
+  std::cout << "precision," << IMAGE_ERROR_COLUMNS << std::endl;
+  print_image_error("double", double_time.count(), *double_image, *double_image);
+  print_image_error("float", float_time.count(), *double_image, *float_image);
+  return float_image;
+}
+
+// Render the scene with exact and then with fast math kernels, and
+// print a CSV table to standard output of each one's trace time and of
+// how far the fast image is from the exact one. Return the fast image.
+// As in compare_precisions(), each is rendered once untimed first.
+std::shared_ptr<raytrace::Image> compare_fast_math(raytrace::Scene& scene,
+                                                   const Config& config) {
+  scene.build_accelerator();
+  scene.set_fast_math(false);
+  scene.render(config.width, config.height);
+  scene.set_fast_math(true);
+  scene.render(config.width, config.height);
+  scene.set_fast_math(false);
+  auto start(std::chrono::steady_clock::now());
+  auto exact_image(scene.render(config.width, config.height));
+  auto exact_traced(std::chrono::steady_clock::now());
+  scene.set_fast_math(true);
+  auto fast_image(scene.render(config.width, config.height));
+  auto fast_traced(std::chrono::steady_clock::now());
+  if (!exact_image || !fast_image) {
+    return nullptr;
+  }
+
+  std::chrono::duration<double> exact_time(exact_traced - start), fast_time(fast_traced - exact_traced);
+  std::cout << "kernels," << IMAGE_ERROR_COLUMNS << std::endl;
+  print_image_error("exact", exact_time.count(), *exact_image, *exact_image);
+  print_image_error("fast", fast_time.count(), *exact_image, *fast_image);
+  return fast_image;
+}
+
+// Return the seconds taken by iterations calls to f(i), adding their
+// results to checksum so that the work can't be optimized away.
+template <typename F>
+double time_iterations(F f, int iterations, double& checksum) {
+  auto start(std::chrono::steady_clock::now());
+  for (int i = 0; i < iterations; ++i) {
+    checksum += f(i);
+  }
+  std::chrono::duration<double> seconds(std::chrono::steady_clock::now() - start);
+  return seconds.count();
+}
+
+// Time the ray generation and shading expressions of Scene::render
+// written as single fused expressions, and again with each step
+// stored in a vector of its own, and print a table of nanoseconds per
+// evaluation to standard output. Matching checksums show that both
+// ways compute the same values. Then time the same expressions with
+// the fast math kernels against the exact ones; their checksums differ
+// in the last few digits. Then do the same for one ray against
+// several spheres, packed and one at a time, and for transforming a
+// long array of vectors, as a batch and one at a time.
+void benchmark_gmath() {
+  const int ITERATIONS(20000000);
+  const raytrace::Vector4 w(*raytrace::vector4_translation(0, 0.6, -0.8)),
+    u(*raytrace::vector4_translation(1, 0, 0)),
+    v(*raytrace::vector4_translation(0, 0.8, 0.6)),
+    location(*raytrace::vector4_point(5, 10, -10)),
+    light_location(*raytrace::vector4_point(-2, 1, 0)),
+    center(*raytrace::vector4_point(12, 19, -20));
+  const raytrace::Color diffuse(PLUM), light_color(LIGHT_YELLOW);
+  const double d(2), intensity(0.8);
+
+  std::cout << "expression,fused_ns,unfused_ns,fused_checksum,unfused_checksum" << std::endl;
+  double fused_sum, unfused_sum, fused_s, unfused_s;
+  auto report = [&](const char* name) {
+    std::cout << name << ","
+              << fused_s * 1e9 / ITERATIONS << ","
+              << unfused_s * 1e9 / ITERATIONS << ","
+              << fused_sum << ","
+              << unfused_sum << std::endl;
+  };
+
+  // perspective ray direction
+  fused_sum = unfused_sum = 0.0;
+  fused_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 direction(w * -d + u * x + v * y);
+      return direction[0] + direction[1] + direction[2];
+    }, ITERATIONS, fused_sum);
+  unfused_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 a(w * -d), b(u * x), c(a + b), e(v * y), direction(c + e);
+      return direction[0] + direction[1] + direction[2];
+    }, ITERATIONS, unfused_sum);
+  report("perspective_direction");
+
+  // orthographic ray origin
+  fused_sum = unfused_sum = 0.0;
+  fused_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 origin(location + u * x + v * y);
+      return origin[0] + origin[1] + origin[2];
+    }, ITERATIONS, fused_sum);
+  unfused_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 a(u * x), b(location + a), c(v * y), origin(b + c);
+      return origin[0] + origin[1] + origin[2];
+    }, ITERATIONS, unfused_sum);
+  report("orthographic_origin");
+
+  // diffuse shading from one point light
+  fused_sum = unfused_sum = 0.0;
+  fused_s = time_iterations([&](int i) {
+      raytrace::Vector4 point(location + w * (i * 1e-7)), normal(point - center);
+      raytrace::Vector4 light_displacement(light_location - point);
+      double n_l((normal / normal.magnitude()) * (light_displacement / light_displacement.magnitude()));
+      raytrace::Color color(raytrace::color_multiply(raytrace::Color(diffuse * intensity * ((n_l > 0) ? n_l : 0)),
+                                                              light_color));
+      return color[0] + color[1] + color[2];
+    }, ITERATIONS, fused_sum);
+  unfused_s = time_iterations([&](int i) {
+      raytrace::Vector4 offset(w * (i * 1e-7)), point(location + offset), normal(point - center);
+      raytrace::Vector4 light_displacement(light_location - point);
+      raytrace::Vector4 unit_normal(normal / normal.magnitude()),
+        unit_light(light_displacement / light_displacement.magnitude());
+      double n_l(unit_normal * unit_light);
+      raytrace::Color scaled(diffuse * intensity), lit(scaled * ((n_l > 0) ? n_l : 0));
+      raytrace::Color color(raytrace::color_multiply(lit, light_color));
+      return color[0] + color[1] + color[2];
+    }, ITERATIONS, unfused_sum);
+  report("diffuse_shading");
+
+  // The fast kernels as Scene::render uses them, with
+  // --fast-math-kernels, against the exact expressions above.
+  std::cout << std::endl << "expression,fast_ns,exact_ns,fast_checksum,exact_checksum" << std::endl;
+  double fast_sum(0), exact_sum(0);
+  double fast_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 direction(multiply_add(v, y, multiply_add(u, x, w * -d)));
+      return direction[0] + direction[1] + direction[2];
+    }, ITERATIONS, fast_sum);
+  double exact_s = time_iterations([&](int i) {
+      double x(i * 1e-8), y(1.0 - x);
+      raytrace::Vector4 direction(w * -d + u * x + v * y);
+      return direction[0] + direction[1] + direction[2];
+    }, ITERATIONS, exact_sum);
+  auto report_fast = [&](const char* name) {
+    std::cout << name << ","
+              << fast_s * 1e9 / ITERATIONS << ","
+              << exact_s * 1e9 / ITERATIONS << ","
+              << fast_sum << ","
+              << exact_sum << std::endl;
+  };
+  report_fast("perspective_direction");
+
+  fast_sum = exact_sum = 0.0;
+  fast_s = time_iterations([&](int i) {
+      raytrace::Vector4 normal(location + w * (i * 1e-7) - center);
+      return normal.fast_normalized()[0];
+    }, ITERATIONS, fast_sum);
+  exact_s = time_iterations([&](int i) {
+      raytrace::Vector4 normal(location + w * (i * 1e-7) - center);
+      return raytrace::Vector4(normal / normal.magnitude())[0];
+    }, ITERATIONS, exact_sum);
+  report_fast("normalize");
+
+  fast_sum = exact_sum = 0.0;
+  fast_s = time_iterations([&](int i) {
+      raytrace::Vector4 point(location + w * (i * 1e-7)), normal(point - center);
+      raytrace::Vector4 light_displacement(light_location - point);
+      double n_l(normal.fast_normalized() * light_displacement.fast_normalized());
+      raytrace::Color color(multiply_add(raytrace::color_multiply(diffuse, light_color),
+                                         intensity * ((n_l > 0) ? n_l : 0), raytrace::Color(0.0)));
+      return color[0] + color[1] + color[2];
+    }, ITERATIONS, fast_sum);
+  exact_s = time_iterations([&](int i) {
+      raytrace::Vector4 point(location + w * (i * 1e-7)), normal(point - center);
+      raytrace::Vector4 light_displacement(light_location - point);
+      double n_l((normal / normal.magnitude()) * (light_displacement / light_displacement.magnitude()));
+      raytrace::Color color(raytrace::color_multiply(raytrace::Color(diffuse * intensity * ((n_l > 0) ? n_l : 0)),
+                                                              light_color));
+      return color[0] + color[1] + color[2];
+    }, ITERATIONS, exact_sum);
+  report_fast("diffuse_shading");
+
+  // One ray against SPHERES spheres, one sphere at a time, and all at
+  // once with gmath::VectorPack. Both report the closest t.
+  const int SPHERES(8), RAYS(ITERATIONS / SPHERES);
+  typedef gmath::VectorPack<double, 4, SPHERES> SpherePack;
+  typedef SpherePack::scalar_pack TPack;
+  raytrace::Vector4 centers[SPHERES];
+  double radius(1.5);
+  SpherePack center_pack;
+  for (int s = 0; s < SPHERES; ++s) {
+    centers[s] = location + (center - location) * (1 + 0.25 * s) + u * (2.0 * s - 7);
+    center_pack.set_lane(s, centers[s]);
+  }
+  const double NO_HIT(std::numeric_limits<double>::infinity());
+  auto direction_for = [&](int i) {
+    return raytrace::Vector4(center - location + u * ((i % 1000) * 0.02 - 10.0));
+  };
+
+  std::cout << std::endl << "kernel,packed_ns,scalar_ns,packed_checksum,scalar_checksum" << std::endl;
+  double packed_sum(0), scalar_sum(0);
+  double packed_s = time_iterations([&](int i) {
+      raytrace::Vector4 direction(direction_for(i));
+      SpherePack origins(location), directions(direction);
+      SpherePack center_to_origin(origins - center_pack);
+      TPack b(directions * center_to_origin),
+        dd(directions * directions),
+        c(center_to_origin * center_to_origin - TPack(radius * radius)),
+        discriminant(b * b - dd * c);
+      // lanes that miss take the square root of 0 rather than of a
+      // negative number, which would be slow, and are masked out below
+      TPack::mask_type real_roots(discriminant >= TPack(0));
+      TPack t((-b - sqrt(select(real_roots, discriminant, TPack(0)))) / dd);
+      TPack hit_t(select(real_roots & (t > TPack(0)), t, TPack(NO_HIT)));
+      double closest(NO_HIT);
+      for (int s = 0; s < SPHERES; ++s) {
+        closest = std::min(closest, hit_t[s]);
+      }
+      return (closest == NO_HIT) ? 0.0 : closest;
+    }, RAYS, packed_sum);
+  double scalar_s = time_iterations([&](int i) {
+      raytrace::Vector4 direction(direction_for(i));
+      double closest(NO_HIT);
+      for (int s = 0; s < SPHERES; ++s) {
+        raytrace::Vector4 center_to_origin(location - centers[s]);
+        double b(direction * center_to_origin),
+          dd(direction * direction),
+          c(center_to_origin * center_to_origin - radius * radius),
+          discriminant(b * b - dd * c);
+        if (discriminant >= 0) {
+          double t((-b - std::sqrt(discriminant)) / dd);
+          if ((t > 0) && (t < closest)) {
+            closest = t;
+          }
+        }
+      }
+      return (closest == NO_HIT) ? 0.0 : closest;
+    }, RAYS, scalar_sum);
+  std::cout << "ray_vs_" << SPHERES << "_spheres,"
+            << packed_s * 1e9 / RAYS << ","
+            << scalar_s * 1e9 / RAYS << ","
+            << packed_sum << ","
+            << scalar_sum << std::endl;
+
+  // One matrix applied to an array of points too big for the caches.
+  const int VECTORS(1 << 20), PASSES(50);
+  raytrace::Matrix4x4 m(*raytrace::rotation_y_matrix(0.5) * *raytrace::scale_matrix(1.5));
+  m[0][3] = 4;
+  m[2][3] = -2;
+  std::vector<raytrace::Vector4> input(VECTORS), batch_output(VECTORS), single_output(VECTORS);
+  for (int i = 0; i < VECTORS; ++i) {
+    input[i] = *raytrace::vector4_point(i * 1e-3, 1.0 - i * 1e-6, i % 7);
+  }
+  double batch_sum(0), single_sum(0);
+  double batch_s = time_iterations([&](int pass) {
+      gmath::transform_batch(m, input.data(), batch_output.data(), VECTORS);
+      return batch_output[pass][0];
+    }, PASSES, batch_sum);
+  double single_s = time_iterations([&](int pass) {
+      for (int i = 0; i < VECTORS; ++i) {
+        single_output[i] = m * input[i];
+      }
+      return single_output[pass][0];
+    }, PASSES, single_sum);
+  bool identical(std::equal(batch_output.begin(), batch_output.end(), single_output.begin(),
+                            [](const raytrace::Vector4& a, const raytrace::Vector4& b) {
+                              return std::equal(&a[0], &a[0] + 4, &b[0]);
+                            }));
+  double transforms(double(VECTORS) * PASSES);
+  std::cout << std::endl << "kernel,batch_ns,single_ns,batch_gb_per_s,identical" << std::endl
+            << "transform_" << VECTORS << "_points,"
+            << batch_s * 1e9 / transforms << ","
+            << single_s * 1e9 / transforms << ","
+            << transforms * 2 * sizeof(raytrace::Vector4) / batch_s / 1e9 << ","
+            << (identical ? "yes" : "no") << std::endl;
+}
+
 int main(int argc, char** argv) {
 
   auto config(parse_config(argc, argv));
@@ -190,21 +1131,23 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  // Colors to choose from, see
-  // http://www.w3schools.com/colors/colors_names.asp
-  // for more.
-  auto white(raytrace::web_color(0xFFFFFF)),
-    near_black(raytrace::web_color(0x202020)),
-    pure_red(raytrace::web_color(0xFF0000)),
-    pure_green(raytrace::web_color(0x00FF00)),
-    pure_blue(raytrace::web_color(0x0000FF)),
-    purple(raytrace::web_color(0x800080)),
-    orange(raytrace::web_color(0xFFA500)),
-    light_yellow(raytrace::web_color(0xFFFFE0)),
-    light_blue(raytrace::web_color(0xADD8E6)),
-    sky_blue(raytrace::web_color(0x87CEEB)),
-    plum(raytrace::web_color(0xDDA0DD)),
-    papaya_whip(raytrace::web_color(0xFFEFD5));
+  if (config->gmath_bench) {
+    benchmark_gmath();
+    return 0;
+  }
+
+  // Shared copies of the colors, for scene objects and lights.
+  auto white(std::make_shared<raytrace::Color>(WHITE)),
+    near_black(std::make_shared<raytrace::Color>(NEAR_BLACK)),
+    pure_red(std::make_shared<raytrace::Color>(PURE_RED)),
+    pure_green(std::make_shared<raytrace::Color>(PURE_GREEN)),
+    pure_blue(std::make_shared<raytrace::Color>(PURE_BLUE)),
+    purple(std::make_shared<raytrace::Color>(PURPLE)),
+    orange(std::make_shared<raytrace::Color>(ORANGE)),
+    light_yellow(std::make_shared<raytrace::Color>(LIGHT_YELLOW)),
+    sky_blue(std::make_shared<raytrace::Color>(SKY_BLUE)),
+    plum(std::make_shared<raytrace::Color>(PLUM)),
+    papaya_whip(std::make_shared<raytrace::Color>(PAPAYA_WHIP));
 
   // Reasonable ambient light.
   std::shared_ptr<raytrace::Light> default_ambient_light(new raytrace::Light(light_yellow, 0.25));
@@ -262,7 +1205,7 @@ int main(int argc, char** argv) {
       // We look down on a square playpen of small, brighly colored. spheres.
       
       std::shared_ptr<raytrace::Camera> camera(new raytrace::Camera(raytrace::vector4_point(5, 10, -10),
-                                                                    raytrace::vector4_translation(0, -1, 1)->normalized(),
+                                                                    std::make_shared<raytrace::Vector4>(raytrace::vector4_translation(0, -1, 1)->normalized()),
                                                                     raytrace::vector4_translation(0, 1, 0),
                                                                     -1, 1,
                                                                     1, -1,
@@ -280,7 +1223,7 @@ int main(int argc, char** argv) {
       ball_colors.push_back(pure_blue);
       ball_colors.push_back(purple);
       ball_colors.push_back(orange);
-      for (int i = 0; i < 8000; ++i) {
+      for (int i = 0; i < config->balls; ++i) {
         auto color(ball_colors[rand() % ball_colors.size()]);
         double x( (rand() % 1000) / 100.0),
           y( (rand() % 1000) / 1000.0),
@@ -308,6 +1251,68 @@ int main(int argc, char** argv) {
       scene->add_point_light(light);
     }
     break;
+
+  case SCENE_NAME_DELUXE:
+    {
+      // The ballpit's view of a 20x20 field of ball clusters. Each
+      // cluster is an instance of the same group, so memory use only
+      // grows with the size of one cluster.
+
+      std::shared_ptr<raytrace::Camera> camera(new raytrace::Camera(raytrace::vector4_point(5, 10, -10),
+                                                                    std::make_shared<raytrace::Vector4>(raytrace::vector4_translation(0, -1, 1)->normalized()),
+                                                                    raytrace::vector4_translation(0, 1, 0),
+                                                                    -1, 1,
+                                                                    1, -1,
+                                                                    2));
+      scene.reset(new raytrace::Scene(default_ambient_light,
+                                      sky_blue,
+                                      camera,
+                                      config->perspective));
+      srand(SEED);
+
+      // one cluster of balls, all coordinates between (-0.5, 0, -0.5)
+      // and (0.5, 0.5, 0.5)
+      std::vector<std::shared_ptr<raytrace::Color> > ball_colors;
+      ball_colors.push_back(pure_red);
+      ball_colors.push_back(orange);
+      ball_colors.push_back(purple);
+      std::shared_ptr<raytrace::SceneGroup> cluster(new raytrace::SceneGroup);
+      for (int i = 0; i < 64; ++i) {
+        auto color(ball_colors[rand() % ball_colors.size()]);
+        double x( (rand() % 1000) / 1000.0 - 0.5),
+          y( (rand() % 1000) / 2000.0),
+          z( (rand() % 1000) / 1000.0 - 0.5);
+        std::shared_ptr<raytrace::SceneObject> object(new raytrace::SceneSphere(color,
+                                                                                white,
+                                                                                raytrace::vector4_point(x, y, z),
+                                                                                0.08));
+        cluster->add_object(object);
+      }
+
+      // instances, each spun about its own vertical axis
+      for (int row = 0; row < 20; ++row) {
+        for (int column = 0; column < 20; ++column) {
+          double angle( (rand() % 360) * M_PI / 180.0);
+          auto transform(*raytrace::translation_matrix(column * 0.5 + 0.25, 0, row * 0.5 + 0.25) *
+                         *raytrace::rotation_y_matrix(angle) *
+                         *raytrace::scale_matrix(0.5));
+          std::shared_ptr<raytrace::SceneObject> instance(new raytrace::SceneInstance(cluster, transform));
+          scene->add_object(instance);
+        }
+      }
+
+      // lights
+      std::shared_ptr<raytrace::PointLight> light;
+      light.reset(new raytrace::PointLight(white,
+                                           1.0,
+                                           raytrace::vector4_point(-3, 3, 0)));
+      scene->add_point_light(light);
+      light.reset(new raytrace::PointLight(white,
+                                           0.8,
+                                           raytrace::vector4_point(1, 3, 0)));
+      scene->add_point_light(light);
+    }
+    break;
     
   default:
     std::cerr << "ERROR: sorry, that scene is not supported" << std::endl;
@@ -316,18 +1321,110 @@ int main(int argc, char** argv) {
 
   // Check that the scene pointer really did get initialized.
   assert(scene != nullptr);
+  scene->set_tile_size(config->tile_size);
+  scene->set_fast_math(config->fast_math);
+  scene->set_shadows(config->shadows);
 
-  // Raytrace!
-  auto image(scene->render(config->width, config->height));
-  if (!image) {
-    std::cerr << "ERROR: rendering error" << std::endl;
-    return 1;
+  if (config->accel_stats || config->layout_report) {
+    auto image(config->accel_stats ? compare_accelerators(*scene, *config)
+                                   : compare_layouts(*scene, *config));
+    if (!image) {
+      std::cerr << "ERROR: rendering error" << std::endl;
+      return 1;
+    }
+    if (!image->write_ppm(config->output_path)) {
+      std::cerr << "ERROR: could not write " << config->output_path << std::endl;
+      return 1;
+    }
+    return 0;
   }
 
-  // Write the image to disk.
-  if (!image->write_ppm(config->output_path)) {
-    std::cerr << "ERROR: could not write " << config->output_path << std::endl;
-    return 1;
+  auto accelerator(make_accelerator(config->accel_name, config->layout));
+  scene->set_accelerator(accelerator);
+  if (!config->accel_cache_path.empty()) {
+    scene->set_accelerator_cache(config->accel_cache_path);
+  }
+
+  if (config->precision_report) {
+    auto image(compare_precisions(*scene, *config));
+    if (!image) {
+      std::cerr << "ERROR: rendering error" << std::endl;
+      return 1;
+    }
+    if (!image->write_ppm(config->output_path)) {
+      std::cerr << "ERROR: could not write " << config->output_path << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (config->check_allocations) {
+    return check_allocations(*scene, *config) ? 0 : 1;
+  }
+
+  if (config->fast_math_report) {
+    auto image(compare_fast_math(*scene, *config));
+    if (!image) {
+      std::cerr << "ERROR: rendering error" << std::endl;
+      return 1;
+    }
+    if (!image->write_ppm(config->output_path)) {
+      std::cerr << "ERROR: could not write " << config->output_path << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  for (int frame = 0; frame < config->frames; ++frame) {
+    accelerator->reset_statistics();
+
+    // Build (or, after the first frame, update) the acceleration
+    // structure up front, so that it can be timed separately. Edits
+    // may update it as they happen, so they are timed with it.
+    auto start(std::chrono::steady_clock::now());
+    if ((frame > 0) && (config->edits > 0)) {
+      edit(*scene, config->edits);
+    } else if (frame > 0) {
+      animate(*scene, frame);
+    }
+    scene->build_accelerator();
+    auto built(std::chrono::steady_clock::now());
+    uint64_t allocations_before(heap_allocations);
+
+    // Raytrace!
+    std::shared_ptr<raytrace::Image> image;
+    std::shared_ptr<raytrace::BasicImage<float> > float_image;
+    if (config->float_precision) {
+      float_image = scene->render<float>(config->width, config->height);
+    } else {
+      image = scene->render(config->width, config->height);
+    }
+    auto traced(std::chrono::steady_clock::now());
+    uint64_t trace_allocations(heap_allocations - allocations_before);
+    if (!image && !float_image) {
+      std::cerr << "ERROR: rendering error" << std::endl;
+      return 1;
+    }
+
+    if (config->stats) {
+      if (config->frames > 1) {
+        std::cerr << "frame " << frame << ":" << std::endl;
+      }
+      std::chrono::duration<double> build_time(built - start), trace_time(traced - built);
+      print_statistics(*accelerator, scene->object_count(), build_time.count(), trace_time.count(),
+                       trace_allocations);
+      if (!config->accel_cache_path.empty() && (frame == 0)) {
+        std::cerr << "accelerator cache:         "
+                  << (scene->accelerator_cache_hit() ? "loaded" : "built") << std::endl;
+      }
+    }
+
+    // Write the image to disk.
+    std::string path(frame_path(config->output_path, frame, config->frames));
+    if (!(float_image ? float_image->write_ppm(path) : image->write_ppm(path))) {
+      std::cerr << "ERROR: could not write " << path << std::endl;
+      return 1;
+    }
   }
 
   // Success.
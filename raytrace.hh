@@ -39,14 +39,34 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <limits>
 #include <memory>
+#include <new>
+#include <queue>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <cmath>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "gmath.hh"
 
 namespace raytrace {
@@ -59,7 +79,16 @@ namespace raytrace {
   
   typedef gmath::Vector<double, 4> Vector4;
 
+  // Colors and vectors at other precisions, for ray generation and
+  // shading; see Scene::render().
+  template <typename SCALAR>
+  struct Precision {
+    typedef gmath::Vector<SCALAR, 3> Color;
+    typedef gmath::Vector<SCALAR, 4> Vector4;
+  };
+
   typedef gmath::Matrix<double, 4, 4> Matrix4x4;
+  typedef gmath::AffineTransform<double> AffineTransform;
 
   // Convenience functions to create vectors.
   
@@ -83,63 +112,317 @@ namespace raytrace {
   // Test whether a scalar represents an R, G, or B intensity in the
   // range [0, 1].
   
-  bool is_color_intensity(double x) {
+  constexpr bool is_color_intensity(double x) {
     //std::cout << "Color intensity found: " << x << std::endl;
     return ((x >= 0.0) && (x <= 1.0));
   }
 
   // Test whether a 3-vector represents a valid R, G, B color.
   
-  bool is_color(const Color& c) {
+  template <typename SCALAR>
+  constexpr bool is_color(const gmath::Vector<SCALAR, 3>& c) {
     return (is_color_intensity(c[0]) &&
       is_color_intensity(c[1]) &&
       is_color_intensity(c[2]));
   }
 
   // Convenience function to convert a 24-bit hexadecimal web color,
-  // as used in HTML, to one of our Color objects.
-  std::shared_ptr<Color> web_color(uint_fast32_t hex) {
+  // as used in HTML, to one of our Color objects. This is constexpr,
+  // so color constants cost nothing at run time.
+  constexpr Color web_color(uint_fast32_t hex) {
     assert(hex <= 0xFFFFFF);
-    std::shared_ptr<Color> color(new Color);
-    (*color)[0] = (hex >> 16) / 255.0;
-    (*color)[1] = ((hex >> 8) & 0xFF) / 255.0;
-    (*color)[2] = (hex & 0xFF) / 255.0;
-    assert(is_color(*color));
+    Color color((hex >> 16) / 255.0,
+                ((hex >> 8) & 0xFF) / 255.0,
+                (hex & 0xFF) / 255.0);
+    assert(is_color(color));
     return color;
   }
 
   // Multiply 2 colors together.  I.e. one color is a filter for the other.
   // This is a component-by-component multiply.
-  std::shared_ptr<Color> color_multiply(std::shared_ptr<Color> a, std::shared_ptr<Color> b) {
-    std::shared_ptr<Color> color(new Color);
-    (*color)[0] = (*a)[0] * (*b)[0];
-    (*color)[1] = (*a)[1] * (*b)[1];
-    (*color)[2] = (*a)[2] * (*b)[2];
+  template <typename SCALAR>
+  gmath::Vector<SCALAR, 3> color_multiply(const gmath::Vector<SCALAR, 3>& a,
+                                          const gmath::Vector<SCALAR, 3>& b) {
+    gmath::Vector<SCALAR, 3> color;
+    color[0] = a[0] * b[0];
+    color[1] = a[1] * b[1];
+    color[2] = a[2] * b[2];
     return color;
   }
 
+  class SceneObject;
+
+  // A ray's hit on an object, as found by SceneObject::intersect() and
+  // by the accelerators: just the time parameter t and the object hit,
+  // returned by value. Many hits are found and thrown away for every
+  // one that is shaded, so the point and normal are left to
+  // SceneObject::surface(), which is only called for the closest hit.
+  // For a hit on a SceneInstance, leaf is the object hit inside its
+  // group, so that surface() can go straight to it; otherwise it is
+  // nullptr.
+  struct Hit {
+    double t;
+    const SceneObject* object;
+    const SceneObject* leaf;
+
+    static constexpr Hit miss() {
+      return Hit{std::numeric_limits<double>::infinity(), nullptr, nullptr};
+    }
+
+    explicit operator bool() const { return object != nullptr; }
+  };
+
   // Class that represents an intersection between a viewing ray and a
   // scene object, complete with a point of intersection, surface
-  // normal vector, and time parameter t.
+  // normal vector, time parameter t, and the object whose surface
+  // was hit.
   class Intersection {
   private:
-    std::shared_ptr<Vector4> _point, _normal;
+    Vector4 _point, _normal;
     double _t;
+    const SceneObject* _object;
 
   public:
-    Intersection(std::shared_ptr<Vector4> point,
-        std::shared_ptr<Vector4> normal,
-        double t
-        ) : _point(point), _normal(normal), _t(t) {
-      assert(point->is_homogeneous_point());
-      assert(normal->is_homogeneous_translation());
+    Intersection(const Vector4& point,
+        const Vector4& normal,
+        double t,
+        const SceneObject* object
+        ) : _point(point), _normal(normal), _t(t), _object(object) {
+      assert(point.is_homogeneous_point());
+      assert(normal.is_homogeneous_translation());
       assert(t >= 0.0);
+      assert(object != nullptr);
     }
 
-    const Vector4& point() const { return *_point; }
-    const Vector4& normal() const { return *_normal; }
+    const Vector4& point() const { return _point; }
+    const Vector4& normal() const { return _normal; }
     double t() const { return _t; }
+    const SceneObject& object() const { return *_object; }
+  };
+
+  // A viewing ray prepared for repeated bounding box tests: the
+  // origin, plus the reciprocal of each direction component so that
+  // slab tests multiply instead of divide. Slab tests against it are
+  // computed in SCALAR; see BoundingBox::intersect().
+  template <typename SCALAR>
+  class BasicBoxRay {
+  private:
+    SCALAR _origin[3], _inverse_direction[3];
+
+  public:
+    BasicBoxRay(const gmath::Vector<SCALAR, 4>& ray_origin,
+                const gmath::Vector<SCALAR, 4>& ray_direction) {
+      for (int axis = 0; axis < 3; ++axis) {
+        _origin[axis] = ray_origin[axis];
+        _inverse_direction[axis] = SCALAR(1) / ray_direction[axis];
+      }
+    }
+
+    SCALAR origin(int axis) const { return _origin[axis]; }
+    SCALAR inverse_direction(int axis) const { return _inverse_direction[axis]; }
+  };
+
+  typedef BasicBoxRay<double> BoxRay;
+
+  // Bounds on the origins and inverse directions of a packet of
+  // rays, so that a box can be tested against the whole packet at once
+  // with interval arithmetic; see BoundingBox::intersect(). Along an
+  // axis where the rays' directions differ in sign, the inverse
+  // directions are unbounded and that axis is left out of the test.
+  // The bounds are kept in double whatever the rays' precision, which
+  // holds float rays exactly.
+  class RayInterval {
+  private:
+    double _origin_min[3], _origin_max[3], _inverse_min[3], _inverse_max[3];
+    bool _bounded[3];
+
+  public:
+    template <typename SCALAR>
+    RayInterval(const BasicBoxRay<SCALAR>* rays, size_t count) {
+      assert(count > 0);
+      for (int axis = 0; axis < 3; ++axis) {
+        _origin_min[axis] = _origin_max[axis] = rays[0].origin(axis);
+        _inverse_min[axis] = _inverse_max[axis] = rays[0].inverse_direction(axis);
+        for (size_t r = 1; r < count; ++r) {
+          _origin_min[axis] = std::min<double>(_origin_min[axis], rays[r].origin(axis));
+          _origin_max[axis] = std::max<double>(_origin_max[axis], rays[r].origin(axis));
+          _inverse_min[axis] = std::min<double>(_inverse_min[axis], rays[r].inverse_direction(axis));
+          _inverse_max[axis] = std::max<double>(_inverse_max[axis], rays[r].inverse_direction(axis));
+        }
+        _bounded[axis] = ((_inverse_min[axis] > 0.0) || (_inverse_max[axis] < 0.0)) &&
+          std::isfinite(_inverse_min[axis]) && std::isfinite(_inverse_max[axis]);
+      }
+    }
+
+    double origin_min(int axis) const { return _origin_min[axis]; }
+    double origin_max(int axis) const { return _origin_max[axis]; }
+    double inverse_min(int axis) const { return _inverse_min[axis]; }
+    double inverse_max(int axis) const { return _inverse_max[axis]; }
+    bool bounded(int axis) const { return _bounded[axis]; }
+  };
+
+  // Axis-aligned bounding box, stored as its minimum and maximum
+  // corners. The acceleration structures below use these to skip
+  // over objects that a viewing ray cannot possibly hit. Boxes are
+  // built in double; BVHAccelerator keeps a copy of its boxes in
+  // float for tracing rays in float.
+  template <typename SCALAR>
+  class BasicBoundingBox {
+  private:
+    SCALAR _min[3], _max[3];
+
+  public:
+    // Initialize an empty box, i.e. one that contains no points.
+    BasicBoundingBox() {
+      reset();
+    }
+
+    BasicBoundingBox(SCALAR min_x, SCALAR min_y, SCALAR min_z,
+                     SCALAR max_x, SCALAR max_y, SCALAR max_z) {
+      _min[0] = min_x; _min[1] = min_y; _min[2] = min_z;
+      _max[0] = max_x; _max[1] = max_y; _max[2] = max_z;
+      assert(!is_empty());
+    }
+
+    // Convert a box from another precision, rounding outwards so that
+    // the result still encloses everything the original did.
+    template <typename OTHER>
+    explicit BasicBoundingBox(const BasicBoundingBox<OTHER>& other) {
+      for (int axis = 0; axis < 3; ++axis) {
+        _min[axis] = SCALAR(other.min(axis));
+        _max[axis] = SCALAR(other.max(axis));
+        if (_min[axis] > other.min(axis)) {
+          _min[axis] = std::nextafter(_min[axis], -std::numeric_limits<SCALAR>::infinity());
+        }
+        if (_max[axis] < other.max(axis)) {
+          _max[axis] = std::nextafter(_max[axis], std::numeric_limits<SCALAR>::infinity());
+        }
+      }
+    }
+
+    SCALAR min(int axis) const { return _min[axis]; }
+    SCALAR max(int axis) const { return _max[axis]; }
+
+    // Make this box empty again.
+    void reset() {
+      for (int axis = 0; axis < 3; ++axis) {
+        _min[axis] = std::numeric_limits<SCALAR>::infinity();
+        _max[axis] = -std::numeric_limits<SCALAR>::infinity();
+      }
+    }
+
+    // Return true iff this box contains no points.
+    bool is_empty() const {
+      return (_min[0] > _max[0]) || (_min[1] > _max[1]) || (_min[2] > _max[2]);
+    }
+
+    // Grow this box to also enclose another box.
+    void expand(const BasicBoundingBox& other) {
+      for (int axis = 0; axis < 3; ++axis) {
+        _min[axis] = std::min(_min[axis], other._min[axis]);
+        _max[axis] = std::max(_max[axis], other._max[axis]);
+      }
+    }
+
+    // Grow this box to also enclose the point (x, y, z).
+    void expand(SCALAR x, SCALAR y, SCALAR z) {
+      expand(BasicBoundingBox(x, y, z, x, y, z));
+    }
+
+    // Length of the box along one axis; 0 for an empty box.
+    SCALAR extent(int axis) const {
+      return is_empty() ? SCALAR(0) : (_max[axis] - _min[axis]);
+    }
+
+    // Midpoint of the box along one axis.
+    SCALAR centroid(int axis) const {
+      return (_min[axis] + _max[axis]) * SCALAR(0.5);
+    }
+
+    // Return the index (0, 1, or 2) of the longest axis.
+    int largest_axis() const {
+      int axis = 0;
+      if (extent(1) > extent(axis)) axis = 1;
+      if (extent(2) > extent(axis)) axis = 2;
+      return axis;
+    }
+
+    // Surface area of the box, which is proportional to the
+    // probability that a random ray hits it; see the surface area
+    // heuristic in BVHAccelerator below.
+    SCALAR surface_area() const {
+      if (is_empty()) {
+        return 0;
+      }
+      SCALAR dx = extent(0), dy = extent(1), dz = extent(2);
+      return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    // Slab test. Return true iff the ray enters this box at some time
+    // in [0, t_max], and if so set t_near to the entry time (0 when
+    // the ray starts inside the box).
+    bool intersect(const BasicBoxRay<SCALAR>& ray, SCALAR t_max, SCALAR& t_near) const {
+      SCALAR t0 = 0, t1 = t_max;
+      for (int axis = 0; axis < 3; ++axis) {
+        SCALAR slab_near = (_min[axis] - ray.origin(axis)) * ray.inverse_direction(axis),
+          slab_far = (_max[axis] - ray.origin(axis)) * ray.inverse_direction(axis);
+        if (slab_near > slab_far) {
+          std::swap(slab_near, slab_far);
+        }
+        // written so that a NaN (0 * infinity) slab never shrinks the interval
+        t0 = (slab_near > t0) ? slab_near : t0;
+        t1 = (slab_far < t1) ? slab_far : t1;
+        if (t0 > t1) {
+          return false;
+        }
+      }
+      t_near = t0;
+      return true;
+    }
+
+    // Interval slab test: return false only if no ray in the packet
+    // enters this box during [0, t_max]. Otherwise set t_near to a
+    // lower bound on the packet's entry times. This is computed in
+    // double whatever SCALAR is.
+    bool intersect(const RayInterval& rays, double t_max, double& t_near) const {
+      double t0 = 0.0, t1 = t_max;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (!rays.bounded(axis)) {
+          continue;
+        }
+        // the range of (slab - origin) * inverse over the packet,
+        // for each slab plane
+        double lo_min, lo_max, hi_min, hi_max;
+        double min = _min[axis], max = _max[axis];
+        interval_product(min - rays.origin_max(axis), min - rays.origin_min(axis),
+                         rays.inverse_min(axis), rays.inverse_max(axis), lo_min, lo_max);
+        interval_product(max - rays.origin_max(axis), max - rays.origin_min(axis),
+                         rays.inverse_min(axis), rays.inverse_max(axis), hi_min, hi_max);
+        // every direction has the same sign along this axis, so the
+        // same plane is the near one for every ray
+        bool forward = rays.inverse_min(axis) > 0.0;
+        t0 = std::max(t0, forward ? lo_min : hi_min);
+        t1 = std::min(t1, forward ? hi_max : lo_max);
+        if (t0 > t1) {
+          return false;
+        }
+      }
+      t_near = t0;
+      return true;
+    }
+
+  private:
+    // Set [lo, hi] to the range of x * y for x in [x_lo, x_hi] and y
+    // in [y_lo, y_hi].
+    static void interval_product(double x_lo, double x_hi, double y_lo, double y_hi,
+                                 double& lo, double& hi) {
+      double a = x_lo * y_lo, b = x_lo * y_hi, c = x_hi * y_lo, d = x_hi * y_hi;
+      lo = std::min(std::min(a, b), std::min(c, d));
+      hi = std::max(std::max(a, b), std::max(c, d));
+    }
   };
+  typedef BasicBoundingBox<double> BoundingBox;
+
 
   // Abstract class for a scene object. In a production raytracer we'd
   // have many subclasses for spheres, planes, triangles, meshes,
@@ -158,22 +441,57 @@ namespace raytrace {
       assert(is_color(*specular_color));
     }
 
-    const Color& diffuse_color() const { return *_diffuse_color; }
-    const Color& specular_color() const { return *_specular_color; }
+    const Color& diffuse_color() const { assert(_diffuse_color); return *_diffuse_color; }
+    const Color& specular_color() const { assert(_specular_color); return *_specular_color; }
+
+  protected:
+    // For subclasses with no colors of their own, whose
+    // intersections report some other object instead.
+    SceneObject() { }
 
+  public:
     // Abstract virtual function for intersection testing. Given a
-    // viewing ray defined by an origin and direction, return a
-    // pointer to an Intersection object representing where the ray
-    // intersects with the object. If they never intersect, return
-    // nullptr.
-    virtual std::shared_ptr<Intersection> intersect(const Vector4& ray_origin,
+    // viewing ray defined by an origin and direction, return where
+    // the ray first hits the object. If they never intersect, return
+    // Hit::miss().
+    virtual Hit intersect(const Vector4& ray_origin,
                 const Vector4& ray_direction) const = 0;
+
+    // The same, for a ray in single precision, as traced by
+    // Scene::render<float>(). Subclasses should override this to
+    // compute in float; by default the ray is widened to double.
+    virtual Hit intersect(const gmath::Vector<float, 4>& ray_origin,
+                const gmath::Vector<float, 4>& ray_direction) const {
+      return intersect(Vector4(ray_origin), Vector4(ray_direction));
+    }
+
+    // Abstract virtual function returning the point and normal of a
+    // hit that intersect() returned for the same ray.
+    virtual Intersection surface(const Vector4& ray_origin,
+                const Vector4& ray_direction, const Hit& hit) const = 0;
+
+    // Return true iff the ray hits the object at some time in
+    // [0, t_max). Shadow rays only need to know whether anything is
+    // in the way, so subclasses should override this to give up as
+    // early as they can rather than find the closest hit.
+    virtual bool occludes(const Vector4& ray_origin,
+                const Vector4& ray_direction, double t_max) const {
+      return intersect(ray_origin, ray_direction).t < t_max;
+    }
+
+    // Abstract virtual function returning a box that encloses the
+    // entire object, for use by acceleration structures.
+    virtual BoundingBox bounds() const = 0;
+
+    // Abstract virtual function to move the object by a translation
+    // vector.
+    virtual void translate(const Vector4& displacement) = 0;
   };
 
   // Concrete subclass for a sphere.
   class SceneSphere : public SceneObject {
   private:
-    std::shared_ptr<Vector4> _center;
+    Vector4 _center;
     double _radius;
 
   public:
@@ -181,32 +499,53 @@ namespace raytrace {
     std::shared_ptr<Color> specular_color,
     std::shared_ptr<Vector4> center,
     double radius)
-      : SceneObject(diffuse_color, specular_color), _center(center), _radius(radius) {
+      : SceneObject(diffuse_color, specular_color), _center(*center), _radius(radius) {
       assert(center->is_homogeneous_point());
       assert(radius > 0.0);
     }
 
-    virtual std::shared_ptr<Intersection> intersect(const Vector4& ray_origin,
+    virtual Hit intersect(const Vector4& ray_origin,
                 const Vector4& ray_direction) const {
+      return intersect_in(ray_origin, ray_direction);
+    }
+
+    virtual Hit intersect(const gmath::Vector<float, 4>& ray_origin,
+                const gmath::Vector<float, 4>& ray_direction) const {
+      return intersect_in(ray_origin, ray_direction);
+    }
+
+  private:
+    // intersect(), computed in the ray's precision.
+    template <typename SCALAR>
+    Hit intersect_in(const gmath::Vector<SCALAR, 4>& ray_origin,
+                     const gmath::Vector<SCALAR, 4>& ray_direction) const {
       // See section 4.4.1 of Marschner et al.
       // reference: Book, page 76-77
-      double a = ray_direction * ray_direction;
-      double b = (ray_direction * (ray_origin - _center)) * 2;
-      double c = *(ray_origin - _center) * (ray_origin - _center) - (_radius*_radius);
+      gmath::Vector<SCALAR, 4> center_to_origin = ray_origin - gmath::Vector<SCALAR, 4>(_center);
+      SCALAR radius = _radius;
+      SCALAR a = ray_direction * ray_direction;
+      SCALAR b = (ray_direction * center_to_origin) * 2;
 
-      double discriminant = (b*b) - 4 * a * c;
+      // b^2 - 4ac loses most of its digits to cancellation when the
+      // sphere is small and far away, which float can't afford. It
+      // equals 4a(r^2 - |l|^2), where l runs from the center to the
+      // point of the ray nearest it; see Haines et al., "Precision
+      // Improvements for Ray/Sphere Intersection", Ray Tracing Gems
+      // (2019).
+      gmath::Vector<SCALAR, 4> nearest = center_to_origin - ray_direction * ((b / 2) / a);
+      SCALAR discriminant = 4 * a * ((radius*radius) - nearest * nearest);
 
       // no intersection if square root of discriminant is imaginary
       if(discriminant < 0) {
-        return std::shared_ptr<Intersection>(nullptr);
+        return Hit::miss();
       }
 
       // calculate roots of the quadratic formula
-      double t0 = (-b + sqrt(discriminant))/(2*a);
-      double t1 = (-b - sqrt(discriminant))/(2*a);
+      SCALAR t0 = (-b + std::sqrt(discriminant))/(2*a);
+      SCALAR t1 = (-b - std::sqrt(discriminant))/(2*a);
 
       // time variable (for below intersection checks)
-      double time = 0;
+      SCALAR time = 0;
 
       // intersection occurs in front of viewing ray (most common case)
       if(t0 >= 0 && t1 >= 0) {
@@ -215,7 +554,7 @@ namespace raytrace {
       }
       // if the intersection occurs behind the viewer, return no intersection
       else if(t0 < 0 && t1 < 0) {
-        return std::shared_ptr<Intersection>(nullptr);
+        return Hit::miss();
       }
       // if the camera is inside the sphere
       else if(t0 < 0 && t1 >= 0) {
@@ -226,8 +565,15 @@ namespace raytrace {
         time = t0;
       }
 
+      return Hit{time, this, nullptr};
+    }
+
+  public:
+    virtual Intersection surface(const Vector4& ray_origin,
+                const Vector4& ray_direction, const Hit& hit) const {
+      assert(hit.object == this);
       // hit point: using p + time * d
-      std::shared_ptr<Vector4> hit_point = ray_origin + (ray_direction * time);
+      Vector4 hit_point = ray_origin + (ray_direction * hit.t);
 
       /* 
         reference: Book, page 33 (gradient vector), 37 (surface normal vector) 
@@ -240,9 +586,50 @@ namespace raytrace {
         Normally, we would multiply by 2, but a normal is a normal regardless
         of its magnitude.
       */
-      std::shared_ptr<Vector4> hit_normal = ((*hit_point) - _center);
+      Vector4 hit_normal = hit_point - _center;
+
+      return Intersection(hit_point, hit_normal, hit.t, this);
+    }
+
+    virtual bool occludes(const Vector4& ray_origin,
+                const Vector4& ray_direction, double t_max) const {
+      // The same quadratic as intersect(), with b halved, which
+      // cancels the 2s and 4s. Most shadow rays miss, so reject them
+      // before taking the square root where possible.
+      Vector4 center_to_origin = ray_origin - _center;
+      double half_b = ray_direction * center_to_origin;
+      double c = center_to_origin * center_to_origin - (_radius*_radius);
 
-      return std::shared_ptr<Intersection>(new Intersection(hit_point, hit_normal, time));
+      // outside the sphere and heading away from it
+      if(c > 0 && half_b > 0) {
+        return false;
+      }
+      double a = ray_direction * ray_direction;
+      double discriminant = (half_b*half_b) - a * c;
+      if(discriminant < 0) {
+        return false;
+      }
+
+      // outside the sphere the near root is the first hit, and it is
+      // not negative since the ray heads towards the center; inside,
+      // the near root is behind the origin, so the far root is
+      double root = sqrt(discriminant);
+      double time = (c > 0) ? (-half_b - root)/a : (-half_b + root)/a;
+      return time < t_max;
+    }
+
+    const Vector4& center() const { return _center; }
+    double radius() const { return _radius; }
+
+    virtual void translate(const Vector4& displacement) {
+      assert(displacement.is_homogeneous_translation());
+      _center += displacement;
+    }
+
+    virtual BoundingBox bounds() const {
+      const Vector4& c(_center);
+      return BoundingBox(c[0] - _radius, c[1] - _radius, c[2] - _radius,
+                         c[0] + _radius, c[1] + _radius, c[2] + _radius);
     }
   };
 
@@ -287,6 +674,8 @@ namespace raytrace {
   private:
     std::shared_ptr<Vector4> _location, _gaze, _up;
     double _l, _t, _r, _b, _d;
+    // orthonormal basis; see Scene::compute_viewing_ray()
+    Vector4 _u, _v, _w;
 
   public:
     Camera(std::shared_ptr<Vector4> location, std::shared_ptr<Vector4> gaze,
@@ -298,11 +687,23 @@ namespace raytrace {
       assert((l < 0.0) && (0.0 < r));
       assert((b < 0.0) && (0.0 < t));
       assert(d > 0.0);
+
+      // Page 74 - 76 of book. The basis only depends on the gaze and
+      // up vectors, so it is computed once here instead of per ray.
+      // w = -gaze/magnitude(gaze)
+      _w = *_gaze / (_gaze->magnitude() * -1);
+      // u = t cross w / magnitude(t cross w)
+      _u = _up->cross(_w).normalized();
+      // v = w cross u
+      _v = _w.cross(_u);
     }
 
     const Vector4& location() const { return *_location; }
     const Vector4& gaze() const { return *_gaze; }
     const Vector4& up() const { return *_up; }
+    const Vector4& u() const { return _u; }
+    const Vector4& v() const { return _v; }
+    const Vector4& w() const { return _w; }
     double l() const { return _l; }
     double t() const { return _t; }
     double r() const { return _r; }
@@ -310,22 +711,29 @@ namespace raytrace {
     double d() const { return _d; }
   };
 
-  // A raster image, i.e. a rectangular grid of Color objects.
-  class Image {
+  // A raster image, i.e. a rectangular grid of colors, with SCALAR
+  // intensities.
+  template <typename SCALAR>
+  class BasicImage {
+  public:
+    typedef typename Precision<SCALAR>::Color Color;
+
   private:
-    std::vector<std::vector<Color> > _pixels;
+    // Row by row, in one allocation.
+    int _width;
+    std::vector<Color> _pixels;
 
   public:
     // Initialize the image with the given width and height, and every
     // pixel initialized to fill.
-    Image(int width, int height, const Color& fill) {
+    BasicImage(int width, int height, const Color& fill) : _width(width) {
       assert(width > 0);
       assert(height > 0);
-      _pixels.assign(height, std::vector<Color>(width, fill));
+      _pixels.assign(size_t(width) * height, fill);
     }
 
-    int width() const { return _pixels[0].size(); }
-    int height() const { return _pixels.size(); }
+    int width() const { return _width; }
+    int height() const { return _pixels.size() / _width; }
 
     // Determine whether a given int is a valid x/y coordinate.
     bool is_x_coordinate(int x) const {
@@ -343,12 +751,12 @@ namespace raytrace {
     // Get or set a single pixel.
     const Color& pixel(int x, int y) const {
       assert(is_coordinate(x, y));
-      return _pixels[y][x];
+      return _pixels[size_t(y) * _width + x];
     }
     void set_pixel(int x, int y, const Color& color) {
       assert(is_coordinate(x, y));
       assert(is_color(color));
-      _pixels[y][x] = color;
+      _pixels[size_t(y) * _width + x] = color;
     }
 
     // Write the image to a file in the PPM file format.
@@ -382,10 +790,9 @@ namespace raytrace {
       return success;
     }
 
-  private:
     // Convert a scalar color intensity in the range [0, 1] to a byte
-    // value in the range [0, 255].
-    int discretize(double intensity) const {
+    // value in the range [0, 255], as write_ppm() does.
+    static int discretize(double intensity) {
       assert(is_color_intensity(intensity));
       int x = static_cast<int>(round(intensity * 255.0));
       if (x < 0)
@@ -396,205 +803,4337 @@ namespace raytrace {
     }
   };
 
-  // Class for an entire scene, tying together all the other classes
-  // in this module.
-  class Scene {
+  typedef BasicImage<double> Image;
+
+  // A file mapped read-only into memory, and unmapped on
+  // destruction.
+  class MappedFile {
   private:
-    // Ambient light source, to prevent objects that are blocked from
-    // point light sources from being entirely black.
-    std::shared_ptr<Light> _ambient_light;
+    const unsigned char* _data;
+    size_t _size;
 
-    // Background color for pixels that do not correspond to any scene
-    // object.
-    std::shared_ptr<Color> _background_color;
+  public:
+    MappedFile() : _data(nullptr), _size(0) { }
 
-    // The camera.
-    std::shared_ptr<Camera> _camera;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    // When true, use the perspective projection; when false, use
-    // orthographic projection.
-    bool _perspective;
+    ~MappedFile() { close(); }
 
-    // Vector of all scene objects.
-    std::vector<std::shared_ptr<SceneObject>> _objects;
+    // Map the whole of the file at path, replacing any previous
+    // mapping. Return false if the file cannot be opened or is empty.
+    bool open(const std::string& path) {
+      close();
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat status;
+      if ((fstat(fd, &status) != 0) || (status.st_size <= 0)) {
+        ::close(fd);
+        return false;
+      }
+      void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (data == MAP_FAILED) {
+        return false;
+      }
+      _data = static_cast<const unsigned char*>(data);
+      _size = status.st_size;
+      return true;
+    }
 
-    // Vector of all point lights.
-    std::vector<std::shared_ptr<PointLight>> _point_lights;
+    void close() {
+      if (_data != nullptr) {
+        munmap(const_cast<unsigned char*>(_data), _size);
+      }
+      _data = nullptr;
+      _size = 0;
+    }
+
+    bool is_open() const { return _data != nullptr; }
+    const unsigned char* data() const { return _data; }
+    size_t size() const { return _size; }
+  };
+
+  // Return a 64-bit FNV-1a hash of the objects' bounding boxes, in
+  // order. An acceleration structure depends on nothing else about
+  // the objects, so this identifies the structure built over them.
+  uint64_t hash_bounds(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const std::shared_ptr<SceneObject>& object : objects) {
+      BoundingBox box = object->bounds();
+      double corners[6] = { box.min(0), box.min(1), box.min(2),
+                            box.max(0), box.max(1), box.max(2) };
+      const unsigned char* bytes = reinterpret_cast<const unsigned char*>(corners);
+      for (size_t i = 0; i < sizeof(corners); ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+      }
+    }
+    return hash;
+  }
 
+  // Abstract class for an acceleration structure, which finds the
+  // scene object that a viewing ray hits first without necessarily
+  // testing every object in the scene.
+  class Accelerator {
   public:
-    // Initialize a scene, initially with no objects and no point
-    // lights.
-    Scene(std::shared_ptr<Light> ambient_light,
-        std::shared_ptr<Color> background_color,
-        std::shared_ptr<Camera> camera,
-        bool perspective)
-      : _ambient_light(ambient_light), _background_color(background_color),
-      _camera(camera), _perspective(perspective) {
-      assert(is_color(*background_color));
+    // Counters describing the work done by closest_hit() and, kept
+    // apart so that they don't change the per-ray figures of the
+    // other, by occluded(), for benchmarking one structure against
+    // another.
+    struct Statistics {
+      uint64_t rays, nodes_visited, primitives_tested;
+      uint64_t occlusion_rays, occlusion_nodes_visited, occlusion_primitives_tested;
+    };
+
+  protected:
+    mutable Statistics _statistics;
+
+  public:
+    Accelerator() {
+      reset_statistics();
     }
 
-    // Add an object/light.
-    void add_object(std::shared_ptr<SceneObject> object) { _objects.push_back(object); }
-    void add_point_light(std::shared_ptr<PointLight> light) { _point_lights.push_back(light); }
+    virtual ~Accelerator() { }
 
-    // Render the scene into an image of the given width and height.
-    //
-    // This is the centerpiece of the module, and is responsible for
-    // executing the core raytracing algorithm.
-    std::shared_ptr<Image> render(int width, int height) const {
-      // Check out the book, page 84
-      assert(width > 0);
-      assert(height > 0);
-      std::shared_ptr<Image> image(new Image(width, height, *_background_color));
-      // pixel coordinate positions
-      int i, j;
-      // viewing ray pointers
-      std::shared_ptr<Vector4> ray_origin, ray_direction;
-      // for determining what pixel color to draw
-      std::shared_ptr<Intersection> closest_hit; // closest hit
-      std::shared_ptr<SceneObject> closest_obj;  // closest object
-
-      // for each pixel
-      for (j = 0; j < height; ++j) {
-        // debug (for ballpit)
-        //std::cout<< "Row " << j << std::endl;
-        for (i = 0; i < width; ++i) {
-          // compute viewing ray (initializes ray_origin and ray_direction)
-          compute_viewing_ray(ray_origin, ray_direction, width, height, i, j);
-          // see if the viewing ray hits any object
-          get_closest_hit(closest_hit, closest_obj, ray_origin, ray_direction);
-          // if an intersection exists between the viewing ray and scene object
-          if(closest_hit != nullptr) {
-            // *1 trick (out of laziness)
-            std::shared_ptr<Vector4> surface_normal(closest_hit->normal()*1);
-            // evaluate shading model and set pixel to that color; page 82
-            std::shared_ptr<Color> draw_color = evaluate_shading(closest_obj, closest_hit, surface_normal);
-            image->set_pixel(i, j, *draw_color);
-          }
-          else { // no intersection so just draw the background
-            // set pixel color to background color (no hit)
-            image->set_pixel(i, j, *_background_color);
-          }
-        }
-      }
-      return image;
+    const Statistics& statistics() const { return _statistics; }
+
+    void reset_statistics() {
+      _statistics.rays = _statistics.nodes_visited = _statistics.primitives_tested = 0;
+      _statistics.occlusion_rays = _statistics.occlusion_nodes_visited = 0;
+      _statistics.occlusion_primitives_tested = 0;
     }
 
-    void get_closest_hit(std::shared_ptr<Intersection> &closest_hit,
-                        std::shared_ptr<SceneObject> &closest_obj,
-                        std::shared_ptr<Vector4> ray_origin,
-                        std::shared_ptr<Vector4> ray_direction) const {
-      std::shared_ptr<Intersection> hit_point;   // current hit
+    // Build the structure over the given objects, discarding
+    // anything built previously.
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) = 0;
 
-      // reset pixel color determine-ators
-      hit_point = closest_hit = nullptr;
-      closest_obj = nullptr;
-      for (std::shared_ptr<SceneObject> obj : _objects) {
-        // compute intersection point
-        hit_point = obj->intersect(*ray_origin, *ray_direction);
-        // if an intersection was found
-        if(hit_point != nullptr) {
-          // if closest_hit not yet set, set it to the newly found hit_point
-          if(closest_hit == nullptr) {
-            closest_hit = hit_point;
-            closest_obj = obj;
-          }
-          // if there is another hit, check to see if it's closer than the previous
-          // (if so set closest hit to current hitpoint)
-          else if(hit_point->t() < closest_hit->t()) {
-            closest_hit = hit_point;
-            closest_obj = obj;
-          }
-        }
+    // Update the structure after the objects given to build() have
+    // moved. Return false if the structure cannot do that, or if it
+    // has degraded so much that build() should be called instead.
+    virtual bool refit() { return false; }
+
+    // Return the number of bytes the built structure occupies,
+    // including its references to the objects.
+    virtual size_t memory_bytes() const = 0;
+
+    // The size and shape of the built structure, for choosing between
+    // structures. sah_cost is the SAH estimate of the work done for a
+    // random ray that hits the structure's bounds, counting 1 per
+    // interior node or cell visited and 1 per object tested, and
+    // ignoring early termination; see BVHAccelerator::sah_cost().
+    struct Structure {
+      uint64_t nodes;
+      int depth;
+      double sah_cost;
+    };
+
+    virtual Structure structure() const = 0;
+
+    // Add one object to, or remove one object from, the built
+    // structure, as if build() had been called with the objects
+    // changed accordingly. Return false if the structure cannot do
+    // that, or does not hold the object to remove; build() should
+    // then be called instead.
+    virtual bool insert(const std::shared_ptr<SceneObject>&) { return false; }
+    virtual bool remove(const std::shared_ptr<SceneObject>&) { return false; }
+
+    // Write the built structure over objects to a file at path,
+    // tagged with key, so that a later run can load() it instead of
+    // building. Return false if the structure cannot be saved.
+    virtual bool save(const std::string&, uint64_t,
+                      const std::vector<std::shared_ptr<SceneObject>>&) const {
+      return false;
+    }
+
+    // Replace the structure with the one saved at path over objects,
+    // as if build(objects) had been called. Return false, leaving the
+    // structure empty, if the file is missing, was saved with a
+    // different key or for a different number of objects, or is
+    // otherwise unusable; the caller should then build().
+    virtual bool load(const std::string&, uint64_t,
+                      const std::vector<std::shared_ptr<SceneObject>>&) {
+      return false;
+    }
+
+    // Find the closest intersection between the viewing ray and any
+    // object given to build(), or Hit::miss() if the ray misses
+    // everything.
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const = 0;
+
+    // Find the closest intersection for each of count rays, as
+    // closest_hit() does. Callers pass rays that are close together,
+    // such as the viewing rays of one image tile, so that a structure
+    // can trace them together as a packet; by default they are traced
+    // one at a time.
+    virtual void closest_hits(size_t count,
+                              const Vector4* ray_origins,
+                              const Vector4* ray_directions,
+                              Hit* hits) const {
+      for (size_t r = 0; r < count; ++r) {
+        hits[r] = closest_hit(ray_origins[r], ray_directions[r]);
+      }
+    }
+
+    // The same, for rays in single precision, as traced by
+    // Scene::render<float>(). Structures that can should override
+    // this to traverse in float; by default each ray is widened and
+    // traced in double.
+    virtual void closest_hits(size_t count,
+                              const gmath::Vector<float, 4>* ray_origins,
+                              const gmath::Vector<float, 4>* ray_directions,
+                              Hit* hits) const {
+      for (size_t r = 0; r < count; ++r) {
+        hits[r] = closest_hit(Vector4(ray_origins[r]), Vector4(ray_directions[r]));
       }
     }
 
+    // Return true iff the ray hits any object given to build() at
+    // some time in [0, t_max). Any hit will do, so a structure stops
+    // at the first one it finds, and need not visit nodes in order.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const = 0;
+  };
+
+  // The simplest possible accelerator, which is really no
+  // accelerator at all: test every object against every ray.
+  class LinearAccelerator : public Accelerator {
   private:
-    // computes viewing ray
-    void compute_viewing_ray(std::shared_ptr<Vector4>& ray_origin, 
-                             std::shared_ptr<Vector4>& ray_direction,
-                             int width, int height, int i, int j) const{
-      // Page 74 - 76 of book
-      // Ray: A origin point and propagation direction; page 73
-      // what are these again? I think they're the positions in the image (translated); page 75
-      double u, v;
-      // Camera vectors
-      std::shared_ptr<Vector4> vec_u, vec_v, vec_w;
+    std::vector<std::shared_ptr<SceneObject>> _objects;
 
-      // compute u and v
-      u = _camera->l() + (_camera->r() - _camera->l()) * (i + 0.5) / width;
-      v = _camera->b() + (_camera->t() - _camera->b()) * (j + 0.5) / height;
+  public:
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _objects = objects;
+    }
 
-      // vec_w = gaze/magnitude(gaze)
-      // NOTE: parenthesis on -1 to avoid needing to dereference result of division
-      vec_w = _camera->gaze() / (_camera->gaze().magnitude() * -1);
+    virtual bool refit() { return true; }
 
-      // vec_u = t cross w / magnitude(t cross w) (two steps here)
-      vec_u = _camera->up().cross(*vec_w);
-      vec_u = *vec_u / vec_u->magnitude();
+    virtual size_t memory_bytes() const {
+      return _objects.size() * sizeof(_objects[0]);
+    }
 
-      // vec_v = w cross u
-      vec_v = vec_w->cross(*vec_u);
+    virtual Structure structure() const {
+      return Structure{0, 0, static_cast<double>(_objects.size())};
+    }
 
-      if(_perspective) {
-        // Perspective transform
-        // below * stuff with shared_ptr is an abstraction leak
-        ray_direction = *(*(*vec_w * -_camera->d()) + *(*vec_u * u)) + *(*vec_v * v);
-        // saying "vector4 * 1" is a lazy way to make a ptr_type of the vector4
-        ray_origin = _camera->location() * 1;
+    virtual bool insert(const std::shared_ptr<SceneObject>& object) {
+      _objects.push_back(object);
+      return true;
+    }
+
+    virtual bool remove(const std::shared_ptr<SceneObject>& object) {
+      auto found = std::find(_objects.begin(), _objects.end(), object);
+      if (found == _objects.end()) {
+        return false;
       }
-      else {
-        // Orthographic transform
-        ray_direction = -(*vec_w);
-        ray_origin = *(_camera->location() + *(*vec_u * u)) + *vec_v * v;
+      _objects.erase(found);
+      return true;
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      // reset pixel color determine-ators; a miss is infinitely far
+      // away, so any real hit is closer
+      Hit closest_hit(Hit::miss());
+      _statistics.rays++;
+      for (const std::shared_ptr<SceneObject>& obj : _objects) {
+        // compute intersection point
+        _statistics.primitives_tested++;
+        Hit hit_point = obj->intersect(ray_origin, ray_direction);
+        // if there is a hit, check to see if it's closer than the previous
+        // (if so set closest hit to current hitpoint)
+        if(hit_point.t < closest_hit.t) {
+          closest_hit = hit_point;
+        }
       }
+      return closest_hit;
     }
-    
-    // set pixel to correct color
-    std::shared_ptr<Color> evaluate_shading(std::shared_ptr<SceneObject> scene_obj,
-                                            std::shared_ptr<Intersection> intersection,
-                                            std::shared_ptr<Vector4> surface_normal) const{
-      /*
-        Page 84
-        L = k_a*I_a + sum(k_d * I_i * max(0, n * l))
 
-        Color L = pixel color
-        Color k_a = surface ambient coefficient/color
-        double I_a = ambient light intensity
-        Color k_d = surface color (or combination of surface color and light color)
-        double I_i = intensity of the ith light source
-        Vector4 n = unit surface normal vector
-        Vector4 l = unit light vector
-      */
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      for (const std::shared_ptr<SceneObject>& obj : _objects) {
+        _statistics.occlusion_primitives_tested++;
+        if (obj->occludes(ray_origin, ray_direction, t_max)) {
+          return true;
+        }
+      }
+      return false;
+    }
+  };
 
-      // I believe this is the proper way to have the initial value for the accumulator
-      std::shared_ptr<Color> accumulated_color(web_color(0)); // or create new color with default constructor
-      // Variables used to calculate and temporarily store the unit light vector
-      std::shared_ptr<Vector4> unit_light_vector;
-      std::shared_ptr<Vector4> light_displacement;
-      // Variable to store n * l (in max function)
-      double n_l;
-      // Variable for unit surface normal (of scene object)
-      std::shared_ptr<Vector4> unit_surface_normal = (*surface_normal)/surface_normal->magnitude();
+  // Bounding volume hierarchy: a binary tree of bounding boxes whose
+  // leaves hold a handful of objects each. The tree is built top-down
+  // with the surface area heuristic (SAH), which estimates the cost
+  // of a split as the number of objects on each side weighted by the
+  // surface area of that side's box. See Wald, "On fast Construction
+  // of SAH-based Bounding Volume Hierarchies" (2007) for the binned
+  // approximation used here.
+  //
+  // Nodes are stored flat in one vector, in depth-first order. The
+  // two children of an interior node are always adjacent, so one
+  // index locates both of them.
+  class BVHAccelerator : public Accelerator {
+  public:
+    // Estimated relative costs of visiting one node and of testing
+    // one object, for the SAH.
+    static constexpr double TRAVERSAL_COST = 1.0;
+    static constexpr double INTERSECTION_COST = 1.0;
 
-      // for each point light in scene, do the required arithmetic
-      for(std::shared_ptr<PointLight> point_light : _point_lights) {
-        // displacment from intersection location to point_light location
-        light_displacement = point_light->location() - intersection->point();
-        // find the intensity
-        unit_light_vector = (*light_displacement) / light_displacement->magnitude();
-        // do fancy arithmetic
-        n_l = (*unit_surface_normal) * unit_light_vector;
-        accumulated_color = *accumulated_color + 
-                            color_multiply(
-                                *(scene_obj->diffuse_color() * point_light->intensity()) * ((n_l > 0) ? n_l : 0),
-                                point_light->color() * 1
-                            );
-      }
-      accumulated_color = *(_ambient_light->color() * _ambient_light->intensity()) + accumulated_color;
+    // Number of candidate split planes considered per node.
+    static const int BIN_COUNT = 16;
+
+    // Leaves never hold more than this many objects, unless the tree
+    // gets too deep.
+    static const int MAX_LEAF_SIZE = 4;
+
+    // Depth limit, which bounds the size of the traversal stack.
+    static const int MAX_DEPTH = 60;
+
+    // refit() gives up, asking for a rebuild, once the SAH cost of
+    // the tree grows past this multiple of its cost when built.
+    static constexpr double REBUILD_THRESHOLD = 1.5;
+
+    // One node of the hierarchy. A node with count > 0 is a leaf
+    // holding the objects at indices [first, first + count) of
+    // _primitives; otherwise its children are at node indices first
+    // and first + 1. Nodes are built in double; see float_node_data()
+    // for the float ones.
+    template <typename SCALAR>
+    struct BasicNode {
+      BasicBoundingBox<SCALAR> bounds;
+      uint32_t first;
+      uint32_t count;
+
+      bool is_leaf() const { return count > 0; }
+    };
+
+    typedef BasicNode<double> Node;
+
+    // The algorithms that build() may use. Different builders make
+    // different trees over the same objects, so saved files record
+    // which one made them.
+    enum Builder { SAH_BUILDER, LBVH_BUILDER, LBVH_TREELET_BUILDER };
+
+    // Layout of a file written by save(): this header, then
+    // node_count Nodes, then object_count uint32_t indices giving the
+    // object at each position of _primitives. Nothing in it is a
+    // pointer, so load() can use the nodes where they are mapped.
+    struct CacheHeader {
+      char magic[8];
+      uint32_t version, node_size, builder, layout;
+      uint64_t key, object_count, node_count;
+      double built_cost;
+    };
+
+    static const uint32_t CACHE_VERSION = 3;
+
+    // Orders for the node array, which matter once it outgrows the
+    // caches; see reorder(). Siblings always stay adjacent, so each
+    // order is really an order of sibling pairs.
+    //
+    // AS_BUILT: whatever order the builder produced.
+    //
+    // DEPTH_FIRST: preorder, left child first.
+    //
+    // VAN_EMDE_BOAS: the cache-oblivious layout of van Emde Boas:
+    // split the tree at half its height, and lay out the top part and
+    // then each bottom part, each recursively in the same way. A path
+    // from the root then crosses O(log_B n) blocks of B nodes, for any
+    // B, instead of O(log n).
+    //
+    // TREELETS: pages of TREELET_PAIRS pairs, each filled breadth
+    // first from a subtree root, so that the first few levels below
+    // any node usually share its page.
+    //
+    // Which is best depends on the rays: the bounds above are for a
+    // single root-to-leaf path, while coherent rays reuse the paths of
+    // the rays before them, which favors DEPTH_FIRST. mrraytracer's
+    // --layout-report compares them.
+    enum Layout { AS_BUILT, DEPTH_FIRST, VAN_EMDE_BOAS, TREELETS };
+
+    // Sibling pairs per treelet: about one 4 KB page.
+    static const uint32_t TREELET_PAIRS = 4096 / (2 * sizeof(Node));
+
+  protected:
+    std::vector<Node> _nodes;
+
+    // The scene objects, reordered so that each leaf's objects are
+    // contiguous.
+    std::vector<std::shared_ptr<SceneObject>> _primitives;
+
+    // SAH cost of the tree as originally built, for refit().
+    double _built_cost;
+
+    // After load(), the nodes live in _cache instead of _nodes.
+    MappedFile _cache;
+    const Node* _cached_nodes;
+    uint32_t _cached_node_count;
+
+    // Applied after every build(), and required of loaded files.
+    Layout _layout;
+
+    // See set_node_trace().
+    std::vector<uint32_t>* _node_trace;
+
+    // Per-ray state for closest_hits(), kept between calls so that
+    // tracing a packet does not allocate.
+    mutable std::vector<BoxRay> _packet_rays;
+    mutable std::vector<double> _packet_closest_t;
+    mutable std::vector<BasicBoxRay<float>> _float_packet_rays;
+    mutable std::vector<float> _float_packet_closest_t;
+
+    // A copy of the nodes in float, made on the first float trace
+    // after the nodes change; see float_node_data().
+    mutable std::vector<BasicNode<float>> _float_nodes;
+
+  public:
+    BVHAccelerator()
+      : _built_cost(0.0), _cached_nodes(nullptr), _cached_node_count(0), _layout(AS_BUILT),
+        _node_trace(nullptr) { }
+
+    // Choose the order of the node array for future builds, and for
+    // future loads: a file saved in another layout is not loaded.
+    void set_layout(Layout layout) { _layout = layout; }
+
+    // While trace is not null, every traversal appends to it the
+    // index of each node it visits, in order, so that a layout's
+    // memory accesses can be replayed through a model of the caches.
+    void set_node_trace(std::vector<uint32_t>* trace) { _node_trace = trace; }
+
+    // The built hierarchy; node_data()[0] is the root.
+    const Node* node_data() const { return _cache.is_open() ? _cached_nodes : _nodes.data(); }
+    uint32_t node_count() const { return _cache.is_open() ? _cached_node_count : _nodes.size(); }
+
+    // The same nodes with float boxes, each rounded outwards, for
+    // tracing rays in float. They take 32 bytes each instead of 56.
+    // They are made when first asked for after the nodes change, so
+    // they cost nothing unless float rays are traced.
+    const BasicNode<float>* float_node_data() const {
+      if (_float_nodes.size() != node_count()) {
+        const Node* nodes = node_data();
+        _float_nodes.resize(node_count());
+        for (uint32_t i = 0; i < node_count(); ++i) {
+          _float_nodes[i].bounds = BasicBoundingBox<float>(nodes[i].bounds);
+          _float_nodes[i].first = nodes[i].first;
+          _float_nodes[i].count = nodes[i].count;
+        }
+      }
+      return _float_nodes.data();
+    }
+    const std::vector<std::shared_ptr<SceneObject>>& primitives() const { return _primitives; }
+
+    // The built hierarchy, unless it was loaded from a file; then
+    // this is empty until refit() copies it.
+    const std::vector<Node>& nodes() const { return _nodes; }
+
+    // Recompute every box bottom-up for the objects' current
+    // positions, keeping the tree's topology; O(n).
+    virtual bool refit() {
+      copy_from_cache();
+      _float_nodes.clear();
+      if (_nodes.empty()) {
+        return true;
+      }
+      refit_node(0);
+      return sah_cost() <= REBUILD_THRESHOLD * _built_cost;
+    }
+
+    virtual size_t memory_bytes() const {
+      return node_count() * sizeof(Node) + _float_nodes.size() * sizeof(_float_nodes[0]) +
+        _primitives.size() * sizeof(_primitives[0]);
+    }
+
+    virtual Structure structure() const {
+      return Structure{node_count(), depth(), sah_cost()};
+    }
+
+    // The builder used by build(), whose trees load() accepts.
+    virtual Builder builder() const { return SAH_BUILDER; }
+
+    // Return the expected cost of tracing a random ray that hits the
+    // root box, according to the SAH: the cost of visiting each node,
+    // or testing each leaf's objects, weighted by the probability of
+    // hitting that node's box.
+    double sah_cost() const {
+      const Node* nodes = node_data();
+      uint32_t count = node_count();
+      if (count == 0) {
+        return 0.0;
+      }
+      double root_area = nodes[0].bounds.surface_area(), cost = 0.0;
+      if (root_area <= 0.0) {
+        return 0.0;
+      }
+      for (const Node* node = nodes; node != nodes + count; ++node) {
+        cost += node->bounds.surface_area() / root_area *
+          (node->is_leaf() ? INTERSECTION_COST * node->count : TRAVERSAL_COST);
+      }
+      return cost;
+    }
+
+    // Return the number of nodes on the longest path from the root to
+    // a leaf, counting both ends; 0 when empty.
+    int depth() const {
+      if (node_count() == 0) {
+        return 0;
+      }
+      std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 1));
+      int deepest = 0;
+      while (!stack.empty()) {
+        std::pair<uint32_t, int> entry = stack.back();
+        stack.pop_back();
+        deepest = std::max(deepest, entry.second);
+        const Node& node = node_data()[entry.first];
+        if (!node.is_leaf()) {
+          stack.push_back(std::make_pair(node.first, entry.second + 1));
+          stack.push_back(std::make_pair(node.first + 1, entry.second + 1));
+        }
+      }
+      return deepest;
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      clear();
+      if (objects.empty()) {
+        return;
+      }
+
+      // Compute every object's box once up front; the builder looks
+      // at each of them many times.
+      std::vector<BoundingBox> boxes;
+      std::vector<uint32_t> indices;
+      boxes.reserve(objects.size());
+      indices.reserve(objects.size());
+      for (uint32_t i = 0; i < objects.size(); ++i) {
+        boxes.push_back(objects[i]->bounds());
+        indices.push_back(i);
+      }
+
+      _nodes.reserve(2 * objects.size());
+      _nodes.push_back(Node());
+      build_node(0, boxes, indices, 0, indices.size(), 0);
+
+      _primitives.reserve(objects.size());
+      for (uint32_t i : indices) {
+        _primitives.push_back(objects[i]);
+      }
+      _built_cost = sah_cost();
+      reorder(_layout);
+    }
+
+    // Rearrange the node array into the given layout; O(n). The tree
+    // itself does not change.
+    void reorder(Layout layout) {
+      copy_from_cache();
+      _float_nodes.clear();
+      if ((layout == AS_BUILT) || (_nodes.size() <= 1)) {
+        return;
+      }
+
+      // Decide the order of the sibling pairs, each named by the
+      // index of its first node; the root, alone, stays first.
+      std::vector<uint32_t> order;
+      order.reserve(_nodes.size() / 2 + 1);
+      switch (layout) {
+      case DEPTH_FIRST:
+        {
+          std::vector<uint32_t> stack(1, 0);
+          while (!stack.empty()) {
+            uint32_t pair = stack.back();
+            stack.pop_back();
+            order.push_back(pair);
+            uint32_t children[2];
+            int count = child_pairs(pair, children);
+            for (int k = count - 1; k >= 0; --k) {
+              stack.push_back(children[k]);
+            }
+          }
+        }
+        break;
+      case VAN_EMDE_BOAS:
+        {
+          std::vector<uint32_t> below;
+          van_emde_boas(0, depth(), order, below);
+        }
+        break;
+      case TREELETS:
+        {
+          std::deque<uint32_t> roots(1, 0);
+          while (!roots.empty()) {
+            std::deque<uint32_t> treelet(1, roots.front());
+            roots.pop_front();
+            for (uint32_t filled = 0; !treelet.empty() && (filled < TREELET_PAIRS); ++filled) {
+              uint32_t pair = treelet.front();
+              treelet.pop_front();
+              order.push_back(pair);
+              uint32_t children[2];
+              int count = child_pairs(pair, children);
+              treelet.insert(treelet.end(), children, children + count);
+            }
+            roots.insert(roots.end(), treelet.begin(), treelet.end());
+          }
+        }
+        break;
+      default:
+        break;
+      }
+
+      // Move every pair to its new place, and repoint its parent.
+      std::vector<uint32_t> new_index(_nodes.size());
+      uint32_t next = 1;
+      for (uint32_t pair : order) {
+        new_index[pair] = (pair == 0) ? 0 : next;
+        next += (pair == 0) ? 0 : 2;
+      }
+      std::vector<Node> nodes(_nodes.size());
+      for (uint32_t pair : order) {
+        for (uint32_t i = pair; i < ((pair == 0) ? 1u : pair + 2); ++i) {
+          Node& node = nodes[new_index[pair] + (i - pair)];
+          node = _nodes[i];
+          if (!node.is_leaf()) {
+            node.first = new_index[node.first];
+          }
+        }
+      }
+      _nodes.swap(nodes);
+    }
+
+    // The file is written under a temporary name and then renamed, so
+    // that a reader never sees a partial file.
+    virtual bool save(const std::string& path, uint64_t key,
+                      const std::vector<std::shared_ptr<SceneObject>>& objects) const {
+      if (objects.size() != _primitives.size()) {
+        return false;
+      }
+      std::unordered_map<const SceneObject*, uint32_t> positions;
+      for (uint32_t i = 0; i < objects.size(); ++i) {
+        positions[objects[i].get()] = i;
+      }
+      std::vector<uint32_t> indices;
+      indices.reserve(_primitives.size());
+      for (const std::shared_ptr<SceneObject>& primitive : _primitives) {
+        auto found = positions.find(primitive.get());
+        if (found == positions.end()) {
+          return false;
+        }
+        indices.push_back(found->second);
+      }
+
+      CacheHeader header;
+      std::memset(&header, 0, sizeof(header));
+      std::memcpy(header.magic, "MRRTBVH", 8);
+      header.version = CACHE_VERSION;
+      header.node_size = sizeof(Node);
+      header.builder = builder();
+      header.layout = _layout;
+      header.key = key;
+      header.object_count = objects.size();
+      header.node_count = node_count();
+      header.built_cost = _built_cost;
+
+      std::string temporary_path(path + ".tmp");
+      {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(node_data()), sizeof(Node) * header.node_count);
+        file.write(reinterpret_cast<const char*>(indices.data()), sizeof(uint32_t) * indices.size());
+        if (!file.good()) {
+          std::remove(temporary_path.c_str());
+          return false;
+        }
+      }
+      return std::rename(temporary_path.c_str(), path.c_str()) == 0;
+    }
+
+    // Only the header and the indices are checked and copied; the
+    // nodes are used in place, so loading costs one pass over the
+    // nodes to validate their indices rather than a build.
+    virtual bool load(const std::string& path, uint64_t key,
+                      const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      clear();
+      if (!_cache.open(path) || (_cache.size() < sizeof(CacheHeader))) {
+        clear();
+        return false;
+      }
+      CacheHeader header;
+      std::memcpy(&header, _cache.data(), sizeof(header));
+      uint64_t expected_size = sizeof(CacheHeader) + sizeof(Node) * header.node_count +
+        sizeof(uint32_t) * header.object_count;
+      if ((std::memcmp(header.magic, "MRRTBVH", 8) != 0) ||
+          (header.version != CACHE_VERSION) ||
+          (header.node_size != sizeof(Node)) ||
+          (header.builder != uint32_t(builder())) ||
+          (header.layout != uint32_t(_layout)) ||
+          (header.key != key) ||
+          (header.object_count != objects.size()) ||
+          (header.node_count > std::numeric_limits<uint32_t>::max()) ||
+          ((header.node_count == 0) != objects.empty()) ||
+          (_cache.size() != expected_size)) {
+        clear();
+        return false;
+      }
+
+      _cached_nodes = reinterpret_cast<const Node*>(_cache.data() + sizeof(CacheHeader));
+      _cached_node_count = header.node_count;
+      for (uint32_t i = 0; i < _cached_node_count; ++i) {
+        const Node& node = _cached_nodes[i];
+        if (node.is_leaf() ? (uint64_t(node.first) + node.count > header.object_count)
+                           : (uint64_t(node.first) + 1 >= header.node_count)) {
+          clear();
+          return false;
+        }
+      }
+
+      // The nodes must also form one tree no deeper than MAX_DEPTH,
+      // which the fixed-size traversal stacks rely on: walking it from
+      // the root must reach every node exactly once.
+      if (_cached_node_count > 0) {
+        std::vector<bool> reached(_cached_node_count, false);
+        std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 1));
+        uint32_t reached_count = 0;
+        while (!stack.empty()) {
+          std::pair<uint32_t, int> entry = stack.back();
+          stack.pop_back();
+          if (reached[entry.first] || (entry.second > MAX_DEPTH)) {
+            clear();
+            return false;
+          }
+          reached[entry.first] = true;
+          reached_count++;
+          const Node& node = _cached_nodes[entry.first];
+          if (!node.is_leaf()) {
+            stack.push_back(std::make_pair(node.first, entry.second + 1));
+            stack.push_back(std::make_pair(node.first + 1, entry.second + 1));
+          }
+        }
+        if (reached_count != _cached_node_count) {
+          clear();
+          return false;
+        }
+      }
+
+      const unsigned char* indices = _cache.data() + sizeof(CacheHeader) +
+        sizeof(Node) * header.node_count;
+      _primitives.reserve(objects.size());
+      for (uint32_t i = 0; i < objects.size(); ++i) {
+        uint32_t index;
+        std::memcpy(&index, indices + sizeof(uint32_t) * i, sizeof(index));
+        if (index >= objects.size()) {
+          clear();
+          return false;
+        }
+        _primitives.push_back(objects[index]);
+      }
+      _built_cost = header.built_cost;
+      return true;
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      return closest_hit_in(ray_origin, ray_direction);
+    }
+
+    // Any-hit traversal for shadow rays. The interval never shrinks,
+    // so there is no point visiting the nearer child first; instead
+    // the child with the larger box is visited first, as the one a
+    // ray is likelier to hit something in, and the traversal stops
+    // at the first object in the way.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      const Node* nodes = node_data();
+      if (node_count() == 0) {
+        return false;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      uint32_t stack[MAX_DEPTH + 4];
+      int stack_size = 0;
+
+      double t_near;
+      if (!nodes[0].bounds.intersect(ray, t_max, t_near)) {
+        return false;
+      }
+      stack[stack_size++] = 0;
+
+      while (stack_size > 0) {
+        uint32_t index = stack[--stack_size];
+        const Node& node = nodes[index];
+        _statistics.occlusion_nodes_visited++;
+        if (_node_trace) {
+          trace_visit(index);
+        }
+
+        if (node.is_leaf()) {
+          for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            _statistics.occlusion_primitives_tested++;
+            if (_primitives[i]->occludes(ray_origin, ray_direction, t_max)) {
+              return true;
+            }
+          }
+        } else {
+          const Node& left = nodes[node.first];
+          const Node& right = nodes[node.first + 1];
+          bool hit_left = left.bounds.intersect(ray, t_max, t_near),
+            hit_right = right.bounds.intersect(ray, t_max, t_near);
+          if (hit_left && hit_right) {
+            assert(stack_size + 2 <= MAX_DEPTH + 4);
+            bool left_first = left.bounds.surface_area() >= right.bounds.surface_area();
+            stack[stack_size++] = left_first ? node.first + 1 : node.first;
+            stack[stack_size++] = left_first ? node.first : node.first + 1;
+          } else if (hit_left) {
+            stack[stack_size++] = node.first;
+          } else if (hit_right) {
+            stack[stack_size++] = node.first + 1;
+          }
+        }
+      }
+      return false;
+    }
+
+    // Packet traversal: each node is tested once against the whole
+    // packet with interval arithmetic, and skipped if no ray can hit
+    // it, so a coherent packet visits far fewer nodes than its rays
+    // would one at a time. Each ray is only tested individually
+    // against the boxes and objects of the leaves that survive.
+    virtual void closest_hits(size_t count,
+                              const Vector4* ray_origins,
+                              const Vector4* ray_directions,
+                              Hit* hits) const {
+      closest_hits_in(count, ray_origins, ray_directions, hits, _packet_rays, _packet_closest_t);
+    }
+
+    // The same in float, which halves the size of the rays and of the
+    // arithmetic on them; see Scene::render<float>().
+    virtual void closest_hits(size_t count,
+                              const gmath::Vector<float, 4>* ray_origins,
+                              const gmath::Vector<float, 4>* ray_directions,
+                              Hit* hits) const {
+      closest_hits_in(count, ray_origins, ray_directions, hits,
+                      _float_packet_rays, _float_packet_closest_t);
+    }
+
+  protected:
+    // closest_hit(), traversing in the ray's precision.
+    template <typename SCALAR>
+    Hit closest_hit_in(const gmath::Vector<SCALAR, 4>& ray_origin,
+                       const gmath::Vector<SCALAR, 4>& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      const BasicNode<SCALAR>* nodes = node_data_in(SCALAR());
+      if (node_count() == 0) {
+        return closest;
+      }
+
+      BasicBoxRay<SCALAR> ray(ray_origin, ray_direction);
+      SCALAR closest_t = std::numeric_limits<SCALAR>::infinity();
+
+      // Stack of nodes still to visit, each with the time at which
+      // the ray enters its box.
+      struct StackEntry { uint32_t node; SCALAR t_near; };
+      StackEntry stack[MAX_DEPTH + 4];
+      int stack_size = 0;
+
+      SCALAR t_near;
+      if (!nodes[0].bounds.intersect(ray, closest_t, t_near)) {
+        return closest;
+      }
+      stack[stack_size++] = StackEntry{0, t_near};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        // skip nodes that start beyond the closest hit found so far
+        if (entry.t_near > closest_t) {
+          continue;
+        }
+        const BasicNode<SCALAR>& node = nodes[entry.node];
+        _statistics.nodes_visited++;
+        if (_node_trace) {
+          trace_visit(entry.node);
+        }
+
+        if (node.is_leaf()) {
+          _statistics.primitives_tested += node.count;
+          for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            Hit hit = _primitives[i]->intersect(ray_origin, ray_direction);
+            if (hit.t < closest_t) {
+              closest_t = hit.t;
+              closest = hit;
+            }
+          }
+        } else {
+          SCALAR t_left, t_right;
+          bool hit_left = nodes[node.first].bounds.intersect(ray, closest_t, t_left),
+            hit_right = nodes[node.first + 1].bounds.intersect(ray, closest_t, t_right);
+          // push the far child first, so that the near child is
+          // popped, and visited, next; and start fetching the far
+          // child's children, which visiting it will read
+          if (hit_left && hit_right) {
+            assert(stack_size + 2 <= MAX_DEPTH + 4);
+            uint32_t far = (t_left <= t_right) ? node.first + 1 : node.first;
+            if (!nodes[far].is_leaf()) {
+              prefetch(nodes + nodes[far].first);
+            }
+            if (t_left <= t_right) {
+              stack[stack_size++] = StackEntry{node.first + 1, t_right};
+              stack[stack_size++] = StackEntry{node.first, t_left};
+            } else {
+              stack[stack_size++] = StackEntry{node.first, t_left};
+              stack[stack_size++] = StackEntry{node.first + 1, t_right};
+            }
+          } else if (hit_left) {
+            stack[stack_size++] = StackEntry{node.first, t_left};
+          } else if (hit_right) {
+            stack[stack_size++] = StackEntry{node.first + 1, t_right};
+          }
+        }
+      }
+
+      return closest;
+    }
+
+    // closest_hits(), testing each ray against boxes and objects in
+    // its own precision, with rays and closest_t as scratch space.
+    template <typename SCALAR>
+    void closest_hits_in(size_t count,
+                         const gmath::Vector<SCALAR, 4>* ray_origins,
+                         const gmath::Vector<SCALAR, 4>* ray_directions,
+                         Hit* hits,
+                         std::vector<BasicBoxRay<SCALAR>>& rays,
+                         std::vector<SCALAR>& closest_t) const {
+      if ((count <= 1) || (node_count() == 0)) {
+        for (size_t r = 0; r < count; ++r) {
+          hits[r] = closest_hit_in(ray_origins[r], ray_directions[r]);
+        }
+        return;
+      }
+      _statistics.rays += count;
+      const BasicNode<SCALAR>* nodes = node_data_in(SCALAR());
+
+      rays.clear();
+      for (size_t r = 0; r < count; ++r) {
+        rays.push_back(BasicBoxRay<SCALAR>(ray_origins[r], ray_directions[r]));
+        hits[r] = Hit::miss();
+      }
+      RayInterval packet(rays.data(), count);
+      closest_t.assign(count, std::numeric_limits<SCALAR>::infinity());
+      // the farthest closest hit of any ray; nothing beyond it matters
+      double packet_t = std::numeric_limits<double>::infinity();
+
+      struct StackEntry { uint32_t node; double t_near; };
+      StackEntry stack[MAX_DEPTH + 4];
+      int stack_size = 0;
+
+      double t_near;
+      if (!nodes[0].bounds.intersect(packet, packet_t, t_near)) {
+        return;
+      }
+      stack[stack_size++] = StackEntry{0, t_near};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > packet_t) {
+          continue;
+        }
+        const BasicNode<SCALAR>& node = nodes[entry.node];
+        _statistics.nodes_visited++;
+        if (_node_trace) {
+          trace_visit(entry.node);
+        }
+
+        if (node.is_leaf()) {
+          packet_t = 0.0;
+          for (size_t r = 0; r < count; ++r) {
+            SCALAR t_ray;
+            if (node.bounds.intersect(rays[r], closest_t[r], t_ray)) {
+              _statistics.primitives_tested += node.count;
+              for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                Hit hit = _primitives[i]->intersect(ray_origins[r], ray_directions[r]);
+                if (hit.t < closest_t[r]) {
+                  closest_t[r] = hit.t;
+                  hits[r] = hit;
+                }
+              }
+            }
+            packet_t = std::max(packet_t, double(closest_t[r]));
+          }
+        } else {
+          double t_left, t_right;
+          bool hit_left = nodes[node.first].bounds.intersect(packet, packet_t, t_left),
+            hit_right = nodes[node.first + 1].bounds.intersect(packet, packet_t, t_right);
+          if (hit_left && hit_right) {
+            assert(stack_size + 2 <= MAX_DEPTH + 4);
+            if (t_left <= t_right) {
+              stack[stack_size++] = StackEntry{node.first + 1, t_right};
+              stack[stack_size++] = StackEntry{node.first, t_left};
+            } else {
+              stack[stack_size++] = StackEntry{node.first, t_left};
+              stack[stack_size++] = StackEntry{node.first + 1, t_right};
+            }
+          } else if (hit_left) {
+            stack[stack_size++] = StackEntry{node.first, t_left};
+          } else if (hit_right) {
+            stack[stack_size++] = StackEntry{node.first + 1, t_right};
+          }
+        }
+      }
+    }
+
+    // Move a tree that load() mapped into _nodes, so it can change.
+    void copy_from_cache() {
+      if (_cache.is_open()) {
+        _nodes.assign(_cached_nodes, _cached_nodes + _cached_node_count);
+        _cache.close();
+      }
+    }
+
+    // Discard the tree, whether built or loaded.
+    void clear() {
+      _nodes.clear();
+      _float_nodes.clear();
+      _primitives.clear();
+      _cache.close();
+      _cached_nodes = nullptr;
+      _cached_node_count = 0;
+    }
+
+  private:
+    // Set children to the sibling pairs below the given pair (or
+    // below the root, for pair 0), and return how many there are.
+    int child_pairs(uint32_t pair, uint32_t children[2]) const {
+      int count = 0;
+      for (uint32_t i = pair; i < ((pair == 0) ? 1u : pair + 2); ++i) {
+        if (!_nodes[i].is_leaf()) {
+          children[count++] = _nodes[i].first;
+        }
+      }
+      return count;
+    }
+
+    // Append the pairs in the top levels of the subtree rooted at pair
+    // to order in van Emde Boas order, and the pairs just below those
+    // levels to below.
+    void van_emde_boas(uint32_t pair, int levels,
+                       std::vector<uint32_t>& order, std::vector<uint32_t>& below) const {
+      if (levels <= 1) {
+        order.push_back(pair);
+        uint32_t children[2];
+        int count = child_pairs(pair, children);
+        below.insert(below.end(), children, children + count);
+        return;
+      }
+      int top = levels / 2;
+      std::vector<uint32_t> roots;
+      van_emde_boas(pair, top, order, roots);
+      for (uint32_t root : roots) {
+        van_emde_boas(root, levels - top, order, below);
+      }
+    }
+
+    // Recursively build the subtree rooted at _nodes[node_index] over
+    // indices[begin, end), reordering that range so that each leaf's
+    // objects end up contiguous.
+    void build_node(uint32_t node_index,
+                    const std::vector<BoundingBox>& boxes,
+                    std::vector<uint32_t>& indices,
+                    uint32_t begin, uint32_t end, int depth) {
+      assert(begin < end);
+      uint32_t count = end - begin;
+
+      BoundingBox bounds, centroid_bounds;
+      for (uint32_t i = begin; i < end; ++i) {
+        const BoundingBox& box = boxes[indices[i]];
+        bounds.expand(box);
+        centroid_bounds.expand(box.centroid(0), box.centroid(1), box.centroid(2));
+      }
+      _nodes[node_index].bounds = bounds;
+
+      int axis = centroid_bounds.largest_axis();
+      double axis_min = centroid_bounds.min(axis),
+        axis_extent = centroid_bounds.extent(axis);
+
+      if ((count <= 1) || (depth >= MAX_DEPTH) ||
+          ((axis_extent <= 0.0) && (count <= MAX_LEAF_SIZE))) {
+        make_leaf(node_index, begin, count);
+        return;
+      }
+
+      uint32_t middle;
+      if (axis_extent <= 0.0) {
+        // all centroids coincide, so no plane separates them; just
+        // split the range in half
+        middle = begin + count / 2;
+      } else {
+        // Sort the objects into bins by centroid, then sweep the
+        // BIN_COUNT - 1 planes between bins for the lowest SAH cost.
+        uint32_t bin_counts[BIN_COUNT] = { 0 };
+        BoundingBox bin_bounds[BIN_COUNT];
+        double bin_scale = BIN_COUNT / axis_extent;
+        for (uint32_t i = begin; i < end; ++i) {
+          const BoundingBox& box = boxes[indices[i]];
+          int bin = bin_index(box.centroid(axis), axis_min, bin_scale);
+          bin_counts[bin]++;
+          bin_bounds[bin].expand(box);
+        }
+
+        // right_areas[b] and right_counts[b] describe bins b and up
+        double right_areas[BIN_COUNT];
+        uint32_t right_counts[BIN_COUNT];
+        BoundingBox right;
+        uint32_t right_count = 0;
+        for (int b = BIN_COUNT - 1; b > 0; --b) {
+          right.expand(bin_bounds[b]);
+          right_count += bin_counts[b];
+          right_areas[b] = right.surface_area();
+          right_counts[b] = right_count;
+        }
+
+        BoundingBox left;
+        uint32_t left_count = 0;
+        double best_cost = std::numeric_limits<double>::infinity();
+        int best_split = 1;
+        for (int b = 1; b < BIN_COUNT; ++b) {
+          left.expand(bin_bounds[b - 1]);
+          left_count += bin_counts[b - 1];
+          if ((left_count == 0) || (right_counts[b] == 0)) {
+            continue;
+          }
+          double cost = left.surface_area() * left_count + right_areas[b] * right_counts[b];
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_split = b;
+          }
+        }
+
+        double split_cost = TRAVERSAL_COST +
+          INTERSECTION_COST * best_cost / bounds.surface_area(),
+          leaf_cost = INTERSECTION_COST * count;
+        if ((count <= MAX_LEAF_SIZE) && (leaf_cost <= split_cost)) {
+          make_leaf(node_index, begin, count);
+          return;
+        }
+
+        middle = std::partition(indices.begin() + begin, indices.begin() + end,
+                                [&](uint32_t i) {
+                                  return bin_index(boxes[i].centroid(axis), axis_min, bin_scale) < best_split;
+                                }) - indices.begin();
+        if ((middle == begin) || (middle == end)) {
+          middle = begin + count / 2;
+        }
+      }
+
+      uint32_t left_index = _nodes.size();
+      _nodes[node_index].first = left_index;
+      _nodes[node_index].count = 0;
+      _nodes.push_back(Node());
+      _nodes.push_back(Node());
+      build_node(left_index, boxes, indices, begin, middle, depth + 1);
+      build_node(left_index + 1, boxes, indices, middle, end, depth + 1);
+    }
+
+    // Recompute the box of _nodes[node_index] and its descendants.
+    const BoundingBox& refit_node(uint32_t node_index) {
+      Node& node = _nodes[node_index];
+      node.bounds.reset();
+      if (node.is_leaf()) {
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+          node.bounds.expand(_primitives[i]->bounds());
+        }
+      } else {
+        node.bounds.expand(refit_node(node.first));
+        node.bounds.expand(refit_node(node.first + 1));
+      }
+      return node.bounds;
+    }
+
+    // The nodes to trace rays in SCALAR precision through.
+    const Node* node_data_in(double) const { return node_data(); }
+    const BasicNode<float>* node_data_in(float) const { return float_node_data(); }
+
+    // Hint that a sibling pair will be read soon.
+    template <typename NODE>
+    static void prefetch(const NODE* pair) {
+#if defined(__GNUC__)
+      const char* bytes = reinterpret_cast<const char*>(pair);
+      for (size_t offset = 0; offset < 2 * sizeof(NODE); offset += 64) {
+        __builtin_prefetch(bytes + offset);
+      }
+#else
+      (void) pair;
+#endif
+    }
+
+    // Append a visited node to the trace given to set_node_trace().
+    // Kept out of line, where the compiler allows that, so that the
+    // traversal loops are as tight as they would be without tracing.
+#if defined(__GNUC__)
+    __attribute__((noinline))
+#endif
+    void trace_visit(uint32_t index) const {
+      _node_trace->push_back(index);
+    }
+
+    void make_leaf(uint32_t node_index, uint32_t begin, uint32_t count) {
+      _nodes[node_index].first = begin;
+      _nodes[node_index].count = count;
+    }
+
+    // Return which bin a centroid coordinate falls into.
+    static int bin_index(double centroid, double axis_min, double bin_scale) {
+      int bin = static_cast<int>((centroid - axis_min) * bin_scale);
+      return std::min(std::max(bin, 0), BIN_COUNT - 1);
+    }
+  };
+
+  // Run f(chunk_begin, chunk_end) over [begin, end), split into one
+  // contiguous chunk per thread. With thread_count <= 1 everything
+  // runs on the calling thread.
+  template <typename FUNCTION>
+  void parallel_for(unsigned thread_count, uint32_t begin, uint32_t end, FUNCTION f) {
+    if (end <= begin) {
+      return;
+    }
+    uint32_t chunk = (end - begin + thread_count - 1) / std::max(thread_count, 1u);
+    if ((thread_count <= 1) || (chunk == 0)) {
+      f(begin, end);
+      return;
+    }
+    std::vector<std::thread> threads;
+    for (uint32_t lo = begin; lo < end; lo += chunk) {
+      threads.push_back(std::thread(f, lo, std::min(end, lo + chunk)));
+    }
+    for (std::thread& t : threads) {
+      t.join();
+    }
+  }
+
+  // Linear bounding volume hierarchy: a BVHAccelerator built in
+  // parallel from Morton codes instead of top-down with the SAH, for
+  // scenes where build time dominates. The steps are:
+  //
+  // 1. Quantize each object's centroid to a 30-bit Morton code, which
+  //    interleaves the bits of the x, y and z coordinates so that
+  //    objects near each other in space tend to be near each other in
+  //    code order.
+  //
+  // 2. Sort the objects by code with a parallel least-significant-
+  //    digit radix sort.
+  //
+  // 3. Emit every interior node of the binary radix tree over the
+  //    sorted codes independently, as in Karras, "Maximizing
+  //    Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+  //    (2012). Interior node i splits at a unique position gamma, so
+  //    its children are placed in the pair of slots 1 + 2 * gamma and
+  //    2 + 2 * gamma, which keeps siblings adjacent the way
+  //    BVHAccelerator expects.
+  //
+  // 4. Compute bounds bottom-up in parallel: one thread climbs from
+  //    each leaf, and at every interior node only the second thread to
+  //    arrive continues.
+  //
+  // 5. Optionally, improve the tree with treelet restructuring, as in
+  //    Karras and Aila, "Fast Parallel Construction of High-Quality
+  //    Bounding Volume Hierarchies" (2013): climbing again, each
+  //    interior node gathers a treelet of up to TREELET_SIZE
+  //    descendants and rearranges it into the topology of lowest SAH
+  //    cost, found by dynamic programming over subsets.
+  //
+  // Leaves always hold one object each.
+  class LBVHAccelerator : public BVHAccelerator {
+  public:
+    // Maximum number of leaves in one treelet during step 5. The
+    // dynamic program costs O(3^TREELET_SIZE) per node.
+    static const int TREELET_SIZE = 7;
+
+  private:
+    unsigned _thread_count;
+    bool _optimize_treelets;
+
+  public:
+    // thread_count == 0 means one thread per hardware core.
+    LBVHAccelerator(unsigned thread_count = 0, bool optimize_treelets = true)
+      : _thread_count(thread_count), _optimize_treelets(optimize_treelets),
+        _boxes(nullptr), _indices(nullptr) {
+      if (_thread_count == 0) {
+        _thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+      }
+    }
+
+    virtual Builder builder() const {
+      return _optimize_treelets ? LBVH_TREELET_BUILDER : LBVH_BUILDER;
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      clear();
+      if (objects.empty()) {
+        return;
+      }
+      uint32_t n = objects.size();
+
+      // Step 1: boxes and Morton codes.
+      std::vector<BoundingBox> boxes(n);
+      std::vector<BoundingBox> thread_centroids(_thread_count + 1);
+      std::atomic<unsigned> next_slot(0);
+      parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+          BoundingBox centroids;
+          for (uint32_t i = lo; i < hi; ++i) {
+            boxes[i] = objects[i]->bounds();
+            centroids.expand(boxes[i].centroid(0), boxes[i].centroid(1), boxes[i].centroid(2));
+          }
+          thread_centroids[next_slot++] = centroids;
+        });
+      BoundingBox centroid_bounds;
+      for (const BoundingBox& box : thread_centroids) {
+        centroid_bounds.expand(box);
+      }
+
+      std::vector<uint32_t> codes(n), indices(n);
+      parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+          for (uint32_t i = lo; i < hi; ++i) {
+            codes[i] = morton_code(boxes[i], centroid_bounds);
+            indices[i] = i;
+          }
+        });
+
+      // Step 2: sort.
+      radix_sort(codes, indices);
+
+      // Step 3: topology.
+      _nodes.resize(2 * n - 1);
+      std::vector<uint32_t> parents(2 * n - 1, 0), leaf_positions(n, 0);
+      if (n == 1) {
+        _nodes[0].first = 0;
+        _nodes[0].count = 1;
+      }
+      parallel_for(_thread_count, 0, n - 1, [&](uint32_t lo, uint32_t hi) {
+          for (uint32_t i = lo; i < hi; ++i) {
+            emit_node(i, codes, parents, leaf_positions);
+          }
+        });
+
+      // Step 4: bounds. _costs[p] and _leaf_counts[p] describe the
+      // subtree at position p, for step 5.
+      _boxes = &boxes;
+      _indices = &indices;
+      _costs.assign(2 * n - 1, 0.0);
+      _leaf_counts.assign(2 * n - 1, 0);
+      climb(parents, leaf_positions, false);
+
+      // Step 5: treelets.
+      if (_optimize_treelets && (n >= 3)) {
+        climb(parents, leaf_positions, true);
+      }
+      _boxes = nullptr;
+      _indices = nullptr;
+      _costs.clear();
+      _leaf_counts.clear();
+
+      _primitives.resize(n);
+      parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+          for (uint32_t i = lo; i < hi; ++i) {
+            _primitives[i] = objects[indices[i]];
+          }
+        });
+
+      // The radix tree is as deep as the longest run of shared
+      // Morton code prefixes, so clustered or duplicate codes can
+      // make it too deep for the fixed traversal stack, with or
+      // without treelets. The SAH builder limits its depth, so fall
+      // back to it.
+      if (depth() > MAX_DEPTH) {
+        BVHAccelerator::build(objects);
+        return;
+      }
+      _built_cost = sah_cost();
+      reorder(_layout);
+    }
+
+  private:
+    // Scratch state shared by the build steps.
+    const std::vector<BoundingBox>* _boxes;
+    const std::vector<uint32_t>* _indices;
+    std::vector<double> _costs;
+    std::vector<uint32_t> _leaf_counts;
+
+    // Spread the low 10 bits of x out to every third bit.
+    static uint32_t expand_bits(uint32_t x) {
+      x = (x | (x << 16)) & 0x030000FF;
+      x = (x | (x << 8)) & 0x0300F00F;
+      x = (x | (x << 4)) & 0x030C30C3;
+      x = (x | (x << 2)) & 0x09249249;
+      return x;
+    }
+
+    static uint32_t morton_code(const BoundingBox& box, const BoundingBox& centroid_bounds) {
+      uint32_t code = 0;
+      for (int axis = 0; axis < 3; ++axis) {
+        double extent = centroid_bounds.extent(axis);
+        double x = (extent > 0.0) ? (box.centroid(axis) - centroid_bounds.min(axis)) / extent : 0.0;
+        uint32_t q = static_cast<uint32_t>(std::min(std::max(x * 1024.0, 0.0), 1023.0));
+        code |= expand_bits(q) << (2 - axis);
+      }
+      return code;
+    }
+
+    // Stable least-significant-digit radix sort of codes, carrying
+    // indices along, one byte per pass. Each thread histograms and
+    // then scatters its own chunk, so the passes are stable.
+    void radix_sort(std::vector<uint32_t>& codes, std::vector<uint32_t>& indices) const {
+      uint32_t n = codes.size();
+      uint32_t chunk = (n + _thread_count - 1) / _thread_count;
+      std::vector<uint32_t> codes_out(n), indices_out(n);
+      std::vector<uint32_t> counts(_thread_count * 256);
+
+      for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+        parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+            uint32_t* histogram = &counts[(lo / chunk) * 256];
+            for (uint32_t i = lo; i < hi; ++i) {
+              histogram[(codes[i] >> shift) & 0xFF]++;
+            }
+          });
+        // Exclusive prefix sum, digit-major then thread order.
+        uint32_t sum = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+          for (unsigned t = 0; t < _thread_count; ++t) {
+            uint32_t count = counts[t * 256 + digit];
+            counts[t * 256 + digit] = sum;
+            sum += count;
+          }
+        }
+        parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+            uint32_t* offsets = &counts[(lo / chunk) * 256];
+            for (uint32_t i = lo; i < hi; ++i) {
+              uint32_t dest = offsets[(codes[i] >> shift) & 0xFF]++;
+              codes_out[dest] = codes[i];
+              indices_out[dest] = indices[i];
+            }
+          });
+        codes.swap(codes_out);
+        indices.swap(indices_out);
+      }
+    }
+
+    // Length of the longest common prefix of sorted keys i and j,
+    // with ties between equal codes broken by index; -1 if j is out
+    // of range.
+    static int common_prefix(const std::vector<uint32_t>& codes, int i, int j) {
+      if ((j < 0) || (j >= static_cast<int>(codes.size()))) {
+        return -1;
+      }
+      if (codes[i] == codes[j]) {
+        return 32 + __builtin_clz(static_cast<uint32_t>(i ^ j));
+      }
+      return __builtin_clz(codes[i] ^ codes[j]);
+    }
+
+    // Emit interior node i of the radix tree, and any leaf children
+    // it has; see step 3 above.
+    void emit_node(uint32_t index,
+                   const std::vector<uint32_t>& codes,
+                   std::vector<uint32_t>& parents,
+                   std::vector<uint32_t>& leaf_positions) {
+      int i = index;
+      // Direction of the node's range from i, and a bound on its length.
+      int d = (common_prefix(codes, i, i + 1) - common_prefix(codes, i, i - 1)) >= 0 ? 1 : -1;
+      int delta_min = common_prefix(codes, i, i - d);
+      int l_max = 2;
+      while (common_prefix(codes, i, i + l_max * d) > delta_min) {
+        l_max *= 2;
+      }
+      // The other end j of the range, by binary search.
+      int l = 0;
+      for (int t = l_max / 2; t >= 1; t /= 2) {
+        if (common_prefix(codes, i, i + (l + t) * d) > delta_min) {
+          l += t;
+        }
+      }
+      int j = i + l * d;
+      // The split position gamma, by binary search.
+      int delta_node = common_prefix(codes, i, j);
+      int s = 0, t = l;
+      do {
+        t = (t + 1) / 2;
+        if (common_prefix(codes, i, i + (s + t) * d) > delta_node) {
+          s += t;
+        }
+      } while (t > 1);
+      int gamma = i + s * d + std::min(d, 0);
+
+      // Node i is a left child iff its range ends at i.
+      uint32_t position = (i == 0) ? 0 : ((d < 0) ? 1 + 2 * i : 2 * i);
+      uint32_t pair = 1 + 2 * gamma;
+      _nodes[position].first = pair;
+      _nodes[position].count = 0;
+      parents[pair] = parents[pair + 1] = position;
+      if (std::min(i, j) == gamma) {
+        _nodes[pair].first = gamma;
+        _nodes[pair].count = 1;
+        leaf_positions[gamma] = pair;
+      }
+      if (std::max(i, j) == gamma + 1) {
+        _nodes[pair + 1].first = gamma + 1;
+        _nodes[pair + 1].count = 1;
+        leaf_positions[gamma + 1] = pair + 1;
+      }
+    }
+
+    // Climb from every leaf to the root in parallel, finishing each
+    // interior node once both of its children are done: computing its
+    // bounds or, if treelets is true, restructuring its treelet.
+    void climb(const std::vector<uint32_t>& parents,
+               const std::vector<uint32_t>& leaf_positions,
+               bool treelets) {
+      uint32_t n = leaf_positions.size();
+      std::unique_ptr<std::atomic<uint32_t>[]> arrivals(new std::atomic<uint32_t>[_nodes.size()]);
+      for (uint32_t p = 0; p < _nodes.size(); ++p) {
+        arrivals[p] = 0;
+      }
+      parallel_for(_thread_count, 0, n, [&](uint32_t lo, uint32_t hi) {
+          for (uint32_t leaf = lo; leaf < hi; ++leaf) {
+            uint32_t position = leaf_positions[leaf];
+            if (!treelets) {
+              finish_leaf(position);
+            }
+            while (position != 0) {
+              position = parents[position];
+              // The first thread to arrive stops; the second one sees
+              // the other child's results thanks to acq_rel ordering.
+              if (arrivals[position].fetch_add(1, std::memory_order_acq_rel) == 0) {
+                break;
+              }
+              if (treelets) {
+                optimize_treelet(position);
+              } else {
+                finish_interior(position);
+              }
+            }
+          }
+        });
+    }
+
+    void finish_leaf(uint32_t position) {
+      Node& node = _nodes[position];
+      node.bounds = (*_boxes)[(*_indices)[node.first]];
+      _costs[position] = INTERSECTION_COST * node.bounds.surface_area() * node.count;
+      _leaf_counts[position] = 1;
+    }
+
+    void finish_interior(uint32_t position) {
+      Node& node = _nodes[position];
+      node.bounds = _nodes[node.first].bounds;
+      node.bounds.expand(_nodes[node.first + 1].bounds);
+      _costs[position] = TRAVERSAL_COST * node.bounds.surface_area() +
+        _costs[node.first] + _costs[node.first + 1];
+      _leaf_counts[position] = _leaf_counts[node.first] + _leaf_counts[node.first + 1];
+    }
+
+    // Restructure the treelet rooted at position; see step 5 above.
+    void optimize_treelet(uint32_t root) {
+      if (_leaf_counts[root] < 3) {
+        return;
+      }
+      // the children may have been restructured already
+      finish_interior(root);
+
+      // Grow the treelet by repeatedly expanding the leaf with the
+      // largest surface area. pairs collects the child slot pairs of
+      // the treelet's interior nodes, which will be reused.
+      std::vector<uint32_t> leaves, pairs;
+      leaves.push_back(_nodes[root].first);
+      leaves.push_back(_nodes[root].first + 1);
+      pairs.push_back(_nodes[root].first);
+      while (static_cast<int>(leaves.size()) < TREELET_SIZE) {
+        int largest = -1;
+        double largest_area = -1.0;
+        for (int k = 0; k < static_cast<int>(leaves.size()); ++k) {
+          const Node& node = _nodes[leaves[k]];
+          if (!node.is_leaf() && (node.bounds.surface_area() > largest_area)) {
+            largest = k;
+            largest_area = node.bounds.surface_area();
+          }
+        }
+        if (largest < 0) {
+          break;
+        }
+        uint32_t pair = _nodes[leaves[largest]].first;
+        pairs.push_back(pair);
+        leaves[largest] = pair;
+        leaves.push_back(pair + 1);
+      }
+
+      // Dynamic program over subsets of treelet leaves: best[s] is the
+      // lowest SAH cost of any subtree over the leaves in bitmask s,
+      // and split[s] the first half of the partition achieving it.
+      int count = leaves.size();
+      uint32_t full = (1u << count) - 1;
+      double area[1 << TREELET_SIZE], best[1 << TREELET_SIZE];
+      uint32_t split[1 << TREELET_SIZE];
+      for (uint32_t s = 1; s <= full; ++s) {
+        BoundingBox box;
+        for (int k = 0; k < count; ++k) {
+          if (s & (1u << k)) {
+            box.expand(_nodes[leaves[k]].bounds);
+          }
+        }
+        area[s] = box.surface_area();
+      }
+      for (int k = 0; k < count; ++k) {
+        best[1u << k] = _costs[leaves[k]];
+      }
+      for (int size = 2; size <= count; ++size) {
+        for (uint32_t s = 1; s <= full; ++s) {
+          if (__builtin_popcount(s) != size) {
+            continue;
+          }
+          // Only partitions where the first half holds the lowest
+          // bit of s, so that each partition is tried once.
+          uint32_t lowest = s & (~s + 1), rest = s & ~lowest;
+          best[s] = std::numeric_limits<double>::infinity();
+          for (uint32_t p = rest; ; p = (p - 1) & rest) {
+            uint32_t left = p | lowest, right = s & ~left;
+            if (right != 0) {
+              double cost = best[left] + best[right];
+              if (cost < best[s]) {
+                best[s] = cost;
+                split[s] = left;
+              }
+            }
+            if (p == 0) {
+              break;
+            }
+          }
+          best[s] += TRAVERSAL_COST * area[s];
+        }
+      }
+      if (best[full] >= _costs[root] * (1.0 - 1e-9)) {
+        return;
+      }
+
+      // Save the treelet leaves, then rebuild the interior nodes over
+      // the freed pair slots.
+      std::vector<Node> saved_nodes;
+      std::vector<double> saved_costs;
+      std::vector<uint32_t> saved_counts;
+      for (uint32_t leaf : leaves) {
+        saved_nodes.push_back(_nodes[leaf]);
+        saved_costs.push_back(_costs[leaf]);
+        saved_counts.push_back(_leaf_counts[leaf]);
+      }
+      size_t next_pair = 0;
+      emit_treelet(root, full, split, pairs, next_pair, saved_nodes, saved_costs, saved_counts);
+    }
+
+    void emit_treelet(uint32_t position, uint32_t subset,
+                      const uint32_t* split, const std::vector<uint32_t>& pairs, size_t& next_pair,
+                      const std::vector<Node>& saved_nodes,
+                      const std::vector<double>& saved_costs,
+                      const std::vector<uint32_t>& saved_counts) {
+      if ((subset & (subset - 1)) == 0) {
+        int k = __builtin_ctz(subset);
+        _nodes[position] = saved_nodes[k];
+        _costs[position] = saved_costs[k];
+        _leaf_counts[position] = saved_counts[k];
+        return;
+      }
+      uint32_t pair = pairs[next_pair++];
+      _nodes[position].first = pair;
+      _nodes[position].count = 0;
+      emit_treelet(pair, split[subset], split, pairs, next_pair, saved_nodes, saved_costs, saved_counts);
+      emit_treelet(pair + 1, subset & ~split[subset], split, pairs, next_pair, saved_nodes, saved_costs, saved_counts);
+      finish_interior(position);
+    }
+  };
+
+  // Bounding volume hierarchy that objects can be inserted into and
+  // removed from one at a time, for scenes edited between renders;
+  // each edit costs about O(log n) instead of a rebuild. Leaves hold
+  // one object each, and nodes live in one vector, linked by index,
+  // with a free list for reuse.
+  //
+  // build() imports a BVHAccelerator. insert() finds the sibling for
+  // the new leaf that adds the least total surface area to the tree
+  // with branch and bound, and both insert() and remove() then refit
+  // the new leaf's ancestors, applying tree rotations that reduce
+  // surface area on the way up; see Catto, "Dynamic Bounding Volume
+  // Hierarchies" (GDC 2019).
+  //
+  // closest_hit() keeps its traversal stack in a member, so it is
+  // unsafe to call from several threads at once.
+  class DynamicBVHAccelerator : public Accelerator {
+  public:
+    // Index of no node.
+    static const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    // One node of the hierarchy. A leaf has no children and holds
+    // object; an interior node has two children and no object.
+    struct Node {
+      BoundingBox bounds;
+      uint32_t parent, child[2];
+      std::shared_ptr<SceneObject> object;
+
+      bool is_leaf() const { return child[0] == NONE; }
+    };
+
+  private:
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _free_nodes;
+    uint32_t _root;
+
+    // The leaf holding each object.
+    std::unordered_multimap<const SceneObject*, uint32_t> _leaves;
+
+    // SAH cost as of the last build(), for refit().
+    double _built_cost;
+
+    struct StackEntry { uint32_t node; double t_near; };
+    mutable std::vector<StackEntry> _stack;
+
+  public:
+    DynamicBVHAccelerator() : _root(NONE), _built_cost(0.0) { }
+
+    // The root node's index, or NONE when empty.
+    uint32_t root() const { return _root; }
+    const std::vector<Node>& nodes() const { return _nodes; }
+
+    virtual size_t memory_bytes() const {
+      // the hash table's size is estimated as one bucket pointer plus
+      // one list node per entry
+      return _nodes.size() * sizeof(Node) + _free_nodes.size() * sizeof(uint32_t) +
+        _leaves.bucket_count() * sizeof(void*) +
+        _leaves.size() * (sizeof(void*) + sizeof(std::pair<const SceneObject*, uint32_t>));
+    }
+
+    virtual Structure structure() const {
+      int deepest = 0;
+      if (_root != NONE) {
+        std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(_root, 1));
+        while (!stack.empty()) {
+          std::pair<uint32_t, int> entry = stack.back();
+          stack.pop_back();
+          deepest = std::max(deepest, entry.second);
+          const Node& node = _nodes[entry.first];
+          if (!node.is_leaf()) {
+            stack.push_back(std::make_pair(node.child[0], entry.second + 1));
+            stack.push_back(std::make_pair(node.child[1], entry.second + 1));
+          }
+        }
+      }
+      return Structure{_nodes.size() - _free_nodes.size(), deepest, sah_cost()};
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _nodes.clear();
+      _free_nodes.clear();
+      _leaves.clear();
+      _root = NONE;
+      _built_cost = 0.0;
+      if (objects.empty()) {
+        return;
+      }
+      BVHAccelerator binary;
+      binary.build(objects);
+      _nodes.reserve(2 * objects.size());
+      _root = import(binary, 0, NONE);
+      _built_cost = sah_cost();
+    }
+
+    // Refit every box, as BVHAccelerator::refit() does.
+    virtual bool refit() {
+      if (_root == NONE) {
+        return true;
+      }
+      refit_node(_root);
+      return sah_cost() <= BVHAccelerator::REBUILD_THRESHOLD * _built_cost;
+    }
+
+    virtual bool insert(const std::shared_ptr<SceneObject>& object) {
+      uint32_t leaf = allocate_node();
+      _nodes[leaf].bounds = object->bounds();
+      _nodes[leaf].object = object;
+      _leaves.insert(std::make_pair(object.get(), leaf));
+      if (_root == NONE) {
+        _root = leaf;
+        return true;
+      }
+
+      uint32_t sibling = best_sibling(_nodes[leaf].bounds),
+        old_parent = _nodes[sibling].parent,
+        parent = allocate_node();
+      _nodes[parent].parent = old_parent;
+      _nodes[parent].child[0] = sibling;
+      _nodes[parent].child[1] = leaf;
+      _nodes[parent].bounds = _nodes[sibling].bounds;
+      _nodes[parent].bounds.expand(_nodes[leaf].bounds);
+      _nodes[sibling].parent = parent;
+      _nodes[leaf].parent = parent;
+      if (old_parent == NONE) {
+        _root = parent;
+      } else {
+        replace_child(old_parent, sibling, parent);
+        refit_ancestors(old_parent);
+      }
+      return true;
+    }
+
+    virtual bool remove(const std::shared_ptr<SceneObject>& object) {
+      auto found = _leaves.find(object.get());
+      if (found == _leaves.end()) {
+        return false;
+      }
+      uint32_t leaf = found->second,
+        parent = _nodes[leaf].parent;
+      _leaves.erase(found);
+      free_node(leaf);
+      if (parent == NONE) {
+        _root = NONE;
+        return true;
+      }
+
+      // The leaf's sibling takes its parent's place.
+      uint32_t sibling = _nodes[parent].child[_nodes[parent].child[0] == leaf ? 1 : 0],
+        grandparent = _nodes[parent].parent;
+      free_node(parent);
+      _nodes[sibling].parent = grandparent;
+      if (grandparent == NONE) {
+        _root = sibling;
+      } else {
+        replace_child(grandparent, parent, sibling);
+        refit_ancestors(grandparent);
+      }
+      return true;
+    }
+
+    // Return the SAH cost of the tree, as BVHAccelerator::sah_cost()
+    // does, with leaves costing one intersection each.
+    double sah_cost() const {
+      if (_root == NONE) {
+        return 0.0;
+      }
+      double root_area = _nodes[_root].bounds.surface_area(), cost = 0.0;
+      if (root_area <= 0.0) {
+        return 0.0;
+      }
+      std::vector<uint32_t> stack(1, _root);
+      while (!stack.empty()) {
+        const Node& node = _nodes[stack.back()];
+        stack.pop_back();
+        cost += node.bounds.surface_area() / root_area *
+          (node.is_leaf() ? BVHAccelerator::INTERSECTION_COST : BVHAccelerator::TRAVERSAL_COST);
+        if (!node.is_leaf()) {
+          stack.push_back(node.child[0]);
+          stack.push_back(node.child[1]);
+        }
+      }
+      return cost;
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_root == NONE) {
+        return closest;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double closest_t = std::numeric_limits<double>::infinity();
+
+      double t_near;
+      if (!_nodes[_root].bounds.intersect(ray, closest_t, t_near)) {
+        return closest;
+      }
+      _stack.clear();
+      _stack.push_back(StackEntry{_root, t_near});
+
+      while (!_stack.empty()) {
+        StackEntry entry = _stack.back();
+        _stack.pop_back();
+        if (entry.t_near > closest_t) {
+          continue;
+        }
+        const Node& node = _nodes[entry.node];
+        _statistics.nodes_visited++;
+
+        if (node.is_leaf()) {
+          _statistics.primitives_tested++;
+          Hit hit = node.object->intersect(ray_origin, ray_direction);
+          if (hit.t < closest_t) {
+            closest_t = hit.t;
+            closest = hit;
+          }
+        } else {
+          // push the far child first, as in BVHAccelerator
+          double t_left, t_right;
+          bool hit_left = _nodes[node.child[0]].bounds.intersect(ray, closest_t, t_left),
+            hit_right = _nodes[node.child[1]].bounds.intersect(ray, closest_t, t_right);
+          if (hit_left && hit_right) {
+            if (t_left <= t_right) {
+              _stack.push_back(StackEntry{node.child[1], t_right});
+              _stack.push_back(StackEntry{node.child[0], t_left});
+            } else {
+              _stack.push_back(StackEntry{node.child[0], t_left});
+              _stack.push_back(StackEntry{node.child[1], t_right});
+            }
+          } else if (hit_left) {
+            _stack.push_back(StackEntry{node.child[0], t_left});
+          } else if (hit_right) {
+            _stack.push_back(StackEntry{node.child[1], t_right});
+          }
+        }
+      }
+
+      return closest;
+    }
+
+    // Any-hit traversal, visiting the child with the larger box
+    // first, as in BVHAccelerator.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_root == NONE) {
+        return false;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double t_near;
+      if (!_nodes[_root].bounds.intersect(ray, t_max, t_near)) {
+        return false;
+      }
+      _stack.clear();
+      _stack.push_back(StackEntry{_root, t_near});
+
+      while (!_stack.empty()) {
+        const Node& node = _nodes[_stack.back().node];
+        _stack.pop_back();
+        _statistics.occlusion_nodes_visited++;
+
+        if (node.is_leaf()) {
+          _statistics.occlusion_primitives_tested++;
+          if (node.object->occludes(ray_origin, ray_direction, t_max)) {
+            return true;
+          }
+        } else {
+          const Node& left = _nodes[node.child[0]];
+          const Node& right = _nodes[node.child[1]];
+          double t_left, t_right;
+          bool hit_left = left.bounds.intersect(ray, t_max, t_left),
+            hit_right = right.bounds.intersect(ray, t_max, t_right);
+          if (hit_left && hit_right) {
+            bool left_first = left.bounds.surface_area() >= right.bounds.surface_area();
+            _stack.push_back(StackEntry{node.child[left_first ? 1 : 0], left_first ? t_right : t_left});
+            _stack.push_back(StackEntry{node.child[left_first ? 0 : 1], left_first ? t_left : t_right});
+          } else if (hit_left) {
+            _stack.push_back(StackEntry{node.child[0], t_left});
+          } else if (hit_right) {
+            _stack.push_back(StackEntry{node.child[1], t_right});
+          }
+        }
+      }
+      return false;
+    }
+
+  private:
+    uint32_t allocate_node() {
+      uint32_t index;
+      if (_free_nodes.empty()) {
+        index = _nodes.size();
+        _nodes.push_back(Node());
+      } else {
+        index = _free_nodes.back();
+        _free_nodes.pop_back();
+      }
+      _nodes[index].parent = _nodes[index].child[0] = _nodes[index].child[1] = NONE;
+      return index;
+    }
+
+    void free_node(uint32_t index) {
+      _nodes[index].object = nullptr;
+      _free_nodes.push_back(index);
+    }
+
+    // Copy the subtree of binary rooted at node_index, under parent,
+    // splitting each multi-object leaf into a balanced subtree of
+    // one-object leaves. Return the copy's index.
+    uint32_t import(const BVHAccelerator& binary, uint32_t node_index, uint32_t parent) {
+      const BVHAccelerator::Node& node = binary.nodes()[node_index];
+      if (node.is_leaf()) {
+        return import_leaves(binary.primitives(), node.first, node.count, parent);
+      }
+      uint32_t index = allocate_node();
+      _nodes[index].parent = parent;
+      uint32_t left = import(binary, node.first, index),
+        right = import(binary, node.first + 1, index);
+      set_children(index, left, right);
+      return index;
+    }
+
+    uint32_t import_leaves(const std::vector<std::shared_ptr<SceneObject>>& primitives,
+                           uint32_t first, uint32_t count, uint32_t parent) {
+      uint32_t index = allocate_node();
+      _nodes[index].parent = parent;
+      if (count == 1) {
+        _nodes[index].object = primitives[first];
+        _nodes[index].bounds = primitives[first]->bounds();
+        _leaves.insert(std::make_pair(primitives[first].get(), index));
+        return index;
+      }
+      uint32_t half = count / 2,
+        left = import_leaves(primitives, first, half, index),
+        right = import_leaves(primitives, first + half, count - half, index);
+      set_children(index, left, right);
+      return index;
+    }
+
+    void set_children(uint32_t index, uint32_t left, uint32_t right) {
+      Node& node = _nodes[index];
+      node.child[0] = left;
+      node.child[1] = right;
+      node.bounds = _nodes[left].bounds;
+      node.bounds.expand(_nodes[right].bounds);
+    }
+
+    void replace_child(uint32_t parent, uint32_t old_child, uint32_t new_child) {
+      Node& node = _nodes[parent];
+      node.child[node.child[0] == old_child ? 0 : 1] = new_child;
+    }
+
+    static double union_area(const BoundingBox& a, const BoundingBox& b) {
+      BoundingBox both(a);
+      both.expand(b);
+      return both.surface_area();
+    }
+
+    // Find the node that, made the sibling of a new leaf with the
+    // given box, adds the least surface area to the tree: the new
+    // parent's area plus the growth of every ancestor. A subtree is
+    // skipped once even the smallest conceivable cost under it, the
+    // new box's own area plus the growth inherited so far, is no
+    // better than the best found.
+    uint32_t best_sibling(const BoundingBox& box) const {
+      struct Candidate {
+        double lower_bound, inherited;
+        uint32_t node;
+        // reversed, so that std::priority_queue pops the lowest bound
+        bool operator<(const Candidate& other) const { return lower_bound > other.lower_bound; }
+      };
+      double box_area = box.surface_area(),
+        best_cost = union_area(_nodes[_root].bounds, box);
+      uint32_t best = _root;
+      std::priority_queue<Candidate> queue;
+      queue.push(Candidate{box_area, 0.0, _root});
+      while (!queue.empty()) {
+        Candidate candidate = queue.top();
+        queue.pop();
+        if (candidate.lower_bound >= best_cost) {
+          break;
+        }
+        const Node& node = _nodes[candidate.node];
+        double direct = union_area(node.bounds, box),
+          cost = direct + candidate.inherited;
+        if (cost < best_cost) {
+          best_cost = cost;
+          best = candidate.node;
+        }
+        double inherited = candidate.inherited + direct - node.bounds.surface_area();
+        if (!node.is_leaf() && (box_area + inherited < best_cost)) {
+          queue.push(Candidate{box_area + inherited, inherited, node.child[0]});
+          queue.push(Candidate{box_area + inherited, inherited, node.child[1]});
+        }
+      }
+      return best;
+    }
+
+    // Recompute the boxes of node_index and every ancestor, rotating
+    // each one's subtree if that helps.
+    void refit_ancestors(uint32_t node_index) {
+      while (node_index != NONE) {
+        set_children(node_index, _nodes[node_index].child[0], _nodes[node_index].child[1]);
+        rotate(node_index);
+        node_index = _nodes[node_index].parent;
+      }
+    }
+
+    // Consider swapping one child of node_index with a grandchild
+    // under the other child, which changes the box of that other child
+    // but of nothing else, and make the swap that shrinks that box's
+    // surface area the most, if any.
+    void rotate(uint32_t node_index) {
+      double best_gain = 0.0;
+      uint32_t best_child = NONE, best_grandchild = NONE;
+      for (int c = 0; c < 2; ++c) {
+        uint32_t child = _nodes[node_index].child[c],
+          other = _nodes[node_index].child[1 - c];
+        const Node& other_node = _nodes[other];
+        if (other_node.is_leaf()) {
+          continue;
+        }
+        for (int g = 0; g < 2; ++g) {
+          // child trades places with other's child g, leaving other
+          // holding child and other's child 1 - g
+          double gain = other_node.bounds.surface_area() -
+            union_area(_nodes[child].bounds, _nodes[other_node.child[1 - g]].bounds);
+          if (gain > best_gain) {
+            best_gain = gain;
+            best_child = child;
+            best_grandchild = other_node.child[g];
+          }
+        }
+      }
+      if (best_child == NONE) {
+        return;
+      }
+      uint32_t other = _nodes[best_grandchild].parent;
+      replace_child(node_index, best_child, best_grandchild);
+      replace_child(other, best_grandchild, best_child);
+      _nodes[best_grandchild].parent = node_index;
+      _nodes[best_child].parent = other;
+      set_children(other, _nodes[other].child[0], _nodes[other].child[1]);
+    }
+
+    const BoundingBox& refit_node(uint32_t node_index) {
+      if (_nodes[node_index].is_leaf()) {
+        _nodes[node_index].bounds = _nodes[node_index].object->bounds();
+      } else {
+        refit_node(_nodes[node_index].child[0]);
+        refit_node(_nodes[node_index].child[1]);
+        set_children(node_index, _nodes[node_index].child[0], _nodes[node_index].child[1]);
+      }
+      return _nodes[node_index].bounds;
+    }
+  };
+
+  // Wide bounding volume hierarchy, with WIDTH (4 or 8) children per
+  // node instead of 2. It is made by building a binary
+  // BVHAccelerator and then collapsing it, so each wide node adopts
+  // the WIDTH largest nodes from the top of a binary subtree.
+  //
+  // Each node stores its children's boxes as single-precision
+  // structure-of-arrays, one array per box coordinate, so that one
+  // SSE (WIDTH 4) or AVX (WIDTH 8) instruction sequence tests the ray
+  // against every child box at once. Hit children are visited
+  // nearest first. Without SSE the same test runs one child at a
+  // time.
+  template <int WIDTH>
+  class WideBVHAccelerator : public Accelerator {
+  public:
+    static_assert((WIDTH == 4) || (WIDTH == 8), "WIDTH must be 4 or 8");
+
+    // One node. Children occupy slots [0, child_count). For child k,
+    // count[k] > 0 means a leaf holding primitives [child[k],
+    // child[k] + count[k]); otherwise child[k] is the index of
+    // another node.
+    struct Node {
+      float min[3][WIDTH], max[3][WIDTH];
+      uint32_t child[WIDTH], count[WIDTH];
+      uint32_t child_count;
+    };
+
+    // The ray in single precision.
+    struct WideRay {
+      float origin[3], inverse_direction[3];
+    };
+
+  private:
+    std::vector<Node> _nodes;
+    std::vector<std::shared_ptr<SceneObject>> _primitives;
+
+    // The binary tree this one was collapsed from, kept for refit().
+    BVHAccelerator _binary;
+
+  public:
+    // The built hierarchy; _nodes[0] is the root.
+    const std::vector<Node>& nodes() const { return _nodes; }
+    const std::vector<std::shared_ptr<SceneObject>>& primitives() const { return _primitives; }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _nodes.clear();
+      _primitives.clear();
+      if (objects.empty()) {
+        return;
+      }
+
+      _binary.build(objects);
+      _primitives = _binary.primitives();
+      collapse();
+    }
+
+    // Refit the binary tree, then collapse it again; both are O(n).
+    virtual bool refit() {
+      if (_nodes.empty()) {
+        return true;
+      }
+      if (!_binary.refit()) {
+        return false;
+      }
+      collapse();
+      return true;
+    }
+
+    virtual size_t memory_bytes() const {
+      return _nodes.size() * sizeof(Node) + _primitives.size() * sizeof(_primitives[0]) +
+        _binary.memory_bytes();
+    }
+
+    virtual Structure structure() const {
+      return structure_of(_nodes.size(), [this](uint32_t i) -> const Node& { return _nodes[i]; });
+    }
+
+    // Return the Structure of a tree of node_count nodes, where
+    // node(i) returns node i.
+    template <typename NODE_FUNCTION>
+    static Structure structure_of(uint32_t node_count, NODE_FUNCTION node) {
+      Structure result{node_count, 0, 0.0};
+      if (node_count == 0) {
+        return result;
+      }
+      BoundingBox root_bounds = child_bounds(node(0), 0);
+      for (uint32_t k = 1; k < node(0).child_count; ++k) {
+        root_bounds.expand(child_bounds(node(0), k));
+      }
+      double root_area = root_bounds.surface_area();
+      if (root_area > 0.0) {
+        result.sah_cost = 1.0;
+      }
+      std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 1));
+      while (!stack.empty()) {
+        std::pair<uint32_t, int> entry = stack.back();
+        stack.pop_back();
+        result.depth = std::max(result.depth, entry.second);
+        const Node& wide = node(entry.first);
+        for (uint32_t k = 0; k < wide.child_count; ++k) {
+          if (root_area > 0.0) {
+            result.sah_cost += child_bounds(wide, k).surface_area() / root_area *
+              ((wide.count[k] > 0) ? wide.count[k] : 1.0);
+          }
+          if (wide.count[k] == 0) {
+            stack.push_back(std::make_pair(wide.child[k], entry.second + 1));
+          }
+        }
+      }
+      return result;
+    }
+
+    static BoundingBox child_bounds(const Node& node, uint32_t k) {
+      return BoundingBox(node.min[0][k], node.min[1][k], node.min[2][k],
+                         node.max[0][k], node.max[1][k], node.max[2][k]);
+    }
+
+    // Test the ray against every child box of node during [0, t_max].
+    // Return a bitmask with bit k set iff child k is hit, and store
+    // each child's entry time in t_near.
+    //
+    // The min/max operand order matters: SSE min and max return
+    // their second operand when either is NaN, which happens for a
+    // zero direction component on a slab boundary (0 * infinity), and
+    // the order below makes such a slab leave the interval alone.
+    static unsigned intersect_children(const Node& node, const WideRay& ray,
+                                       double t_max, float* t_near) {
+      float t_limit = std::nextafter(static_cast<float>(t_max),
+                                     std::numeric_limits<float>::infinity());
+      unsigned mask = 0;
+      int lane = 0;
+#if defined(__AVX__)
+      for (; lane + 8 <= WIDTH; lane += 8) {
+        __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(t_limit);
+        for (int axis = 0; axis < 3; ++axis) {
+          __m256 origin = _mm256_set1_ps(ray.origin[axis]),
+            inverse = _mm256_set1_ps(ray.inverse_direction[axis]),
+            lo = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min[axis] + lane), origin), inverse),
+            hi = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max[axis] + lane), origin), inverse);
+          t0 = _mm256_max_ps(_mm256_min_ps(hi, lo), t0);
+          t1 = _mm256_min_ps(_mm256_max_ps(lo, hi), t1);
+        }
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << lane;
+        _mm256_storeu_ps(t_near + lane, t0);
+      }
+#endif
+#if defined(__SSE2__)
+      for (; lane + 4 <= WIDTH; lane += 4) {
+        __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(t_limit);
+        for (int axis = 0; axis < 3; ++axis) {
+          __m128 origin = _mm_set1_ps(ray.origin[axis]),
+            inverse = _mm_set1_ps(ray.inverse_direction[axis]),
+            lo = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min[axis] + lane), origin), inverse),
+            hi = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max[axis] + lane), origin), inverse);
+          t0 = _mm_max_ps(_mm_min_ps(hi, lo), t0);
+          t1 = _mm_min_ps(_mm_max_ps(lo, hi), t1);
+        }
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << lane;
+        _mm_storeu_ps(t_near + lane, t0);
+      }
+#endif
+      for (; lane < WIDTH; ++lane) {
+        float t0 = 0.0f, t1 = t_limit;
+        for (int axis = 0; axis < 3; ++axis) {
+          float lo = (node.min[axis][lane] - ray.origin[axis]) * ray.inverse_direction[axis],
+            hi = (node.max[axis][lane] - ray.origin[axis]) * ray.inverse_direction[axis];
+          float slab_near = (hi < lo) ? hi : lo, slab_far = (lo > hi) ? lo : hi;
+          t0 = (slab_near > t0) ? slab_near : t0;
+          t1 = (slab_far < t1) ? slab_far : t1;
+        }
+        if (t0 <= t1) {
+          mask |= 1u << lane;
+        }
+        t_near[lane] = t0;
+      }
+      return mask & ((1u << node.child_count) - 1);
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_nodes.empty()) {
+        return closest;
+      }
+
+      WideRay ray;
+      for (int axis = 0; axis < 3; ++axis) {
+        ray.origin[axis] = static_cast<float>(ray_origin[axis]);
+        ray.inverse_direction[axis] = static_cast<float>(1.0 / ray_direction[axis]);
+      }
+
+      double closest_t = std::numeric_limits<double>::infinity();
+
+      // Stack of children still to visit: either a node (count == 0)
+      // or a leaf's primitive range.
+      struct StackEntry { uint32_t child, count; float t_near; };
+      StackEntry stack[(BVHAccelerator::MAX_DEPTH + 4) * WIDTH];
+      int stack_size = 0;
+      stack[stack_size++] = StackEntry{0, 0, 0.0f};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t) {
+          continue;
+        }
+
+        if (entry.count > 0) {
+          _statistics.primitives_tested += entry.count;
+          for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+            Hit hit = _primitives[i]->intersect(ray_origin, ray_direction);
+            if (hit.t < closest_t) {
+              closest_t = hit.t;
+              closest = hit;
+            }
+          }
+          continue;
+        }
+
+        const Node& node = _nodes[entry.child];
+        _statistics.nodes_visited++;
+        float t_near[WIDTH];
+        unsigned mask = intersect_children(node, ray, closest_t, t_near);
+
+        // Insertion sort the hit children far-to-near, then push them
+        // in that order so the nearest is popped first.
+        int first = stack_size;
+        for (int k = 0; k < WIDTH; ++k) {
+          if (!(mask & (1u << k))) {
+            continue;
+          }
+          StackEntry child{node.child[k], node.count[k], t_near[k]};
+          int j = stack_size++;
+          while ((j > first) && (stack[j - 1].t_near < child.t_near)) {
+            stack[j] = stack[j - 1];
+            --j;
+          }
+          stack[j] = child;
+        }
+      }
+
+      return closest;
+    }
+
+    // Any-hit traversal: children are pushed unsorted, since any hit
+    // ends the search.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_nodes.empty()) {
+        return false;
+      }
+      return occluded_in(ray_origin, ray_direction, t_max, _statistics,
+                         [this](uint32_t index) -> const Node& { return _nodes[index]; },
+                         _primitives);
+    }
+
+    // The any-hit traversal of a tree of nodes, where node(i) returns
+    // node i in this class's Node layout, counting the work in
+    // statistics; QuantizedBVHAccelerator shares it.
+    template <typename NODE_FUNCTION>
+    static bool occluded_in(const Vector4& ray_origin, const Vector4& ray_direction,
+                            double t_max, Statistics& statistics, NODE_FUNCTION node,
+                            const std::vector<std::shared_ptr<SceneObject>>& primitives) {
+      WideRay ray;
+      for (int axis = 0; axis < 3; ++axis) {
+        ray.origin[axis] = static_cast<float>(ray_origin[axis]);
+        ray.inverse_direction[axis] = static_cast<float>(1.0 / ray_direction[axis]);
+      }
+
+      struct StackEntry { uint32_t child, count; };
+      StackEntry stack[(BVHAccelerator::MAX_DEPTH + 4) * WIDTH];
+      int stack_size = 0;
+      stack[stack_size++] = StackEntry{0, 0};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.count > 0) {
+          for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+            statistics.occlusion_primitives_tested++;
+            if (primitives[i]->occludes(ray_origin, ray_direction, t_max)) {
+              return true;
+            }
+          }
+          continue;
+        }
+
+        const Node& wide = node(entry.child);
+        statistics.occlusion_nodes_visited++;
+        float t_near[WIDTH];
+        unsigned mask = intersect_children(wide, ray, t_max, t_near);
+        for (int k = 0; k < WIDTH; ++k) {
+          if (mask & (1u << k)) {
+            stack[stack_size++] = StackEntry{wide.child[k], wide.count[k]};
+          }
+        }
+      }
+      return false;
+    }
+
+  private:
+    // Rebuild _nodes from _binary.
+    void collapse() {
+      _nodes.clear();
+      _nodes.reserve(_binary.nodes().size() / 2 + 1);
+      _nodes.push_back(Node());
+      collapse(0, _binary.nodes(), 0);
+    }
+
+    // Fill in _nodes[wide_index] from the binary subtree rooted at
+    // binary[binary_index], recursing into any children that are
+    // themselves interior nodes.
+    void collapse(uint32_t wide_index,
+                  const std::vector<BVHAccelerator::Node>& binary,
+                  uint32_t binary_index) {
+      // Open up interior nodes, largest first, until there are WIDTH
+      // children or only leaves remain.
+      std::vector<uint32_t> children;
+      if (binary[binary_index].is_leaf()) {
+        children.push_back(binary_index);
+      } else {
+        children.push_back(binary[binary_index].first);
+        children.push_back(binary[binary_index].first + 1);
+      }
+      while (static_cast<int>(children.size()) < WIDTH) {
+        int largest = -1;
+        double largest_area = -1.0;
+        for (int k = 0; k < static_cast<int>(children.size()); ++k) {
+          const BVHAccelerator::Node& node = binary[children[k]];
+          if (!node.is_leaf() && (node.bounds.surface_area() > largest_area)) {
+            largest = k;
+            largest_area = node.bounds.surface_area();
+          }
+        }
+        if (largest < 0) {
+          break;
+        }
+        uint32_t opened = binary[children[largest]].first;
+        children[largest] = opened;
+        children.push_back(opened + 1);
+      }
+
+      Node wide;
+      wide.child_count = children.size();
+      for (int k = 0; k < WIDTH; ++k) {
+        for (int axis = 0; axis < 3; ++axis) {
+          wide.min[axis][k] = std::numeric_limits<float>::infinity();
+          wide.max[axis][k] = -std::numeric_limits<float>::infinity();
+        }
+        wide.child[k] = wide.count[k] = 0;
+      }
+
+      std::vector<std::pair<int, uint32_t>> interior;
+      for (int k = 0; k < static_cast<int>(children.size()); ++k) {
+        const BVHAccelerator::Node& node = binary[children[k]];
+        for (int axis = 0; axis < 3; ++axis) {
+          wide.min[axis][k] = round_down(node.bounds.min(axis));
+          wide.max[axis][k] = round_up(node.bounds.max(axis));
+        }
+        if (node.is_leaf()) {
+          wide.child[k] = node.first;
+          wide.count[k] = node.count;
+        } else {
+          wide.child[k] = _nodes.size();
+          _nodes.push_back(Node());
+          interior.push_back(std::make_pair(k, children[k]));
+        }
+      }
+      _nodes[wide_index] = wide;
+
+      for (const std::pair<int, uint32_t>& p : interior) {
+        collapse(_nodes[wide_index].child[p.first], binary, p.second);
+      }
+    }
+
+    // Convert a box coordinate to single precision, padded outward so
+    // that rounding in the float slab test below can only make boxes
+    // bigger, never smaller.
+    static float round_down(double x) {
+      return static_cast<float>(x - (fabs(x) + 1.0) * 1e-6);
+    }
+    static float round_up(double x) {
+      return static_cast<float>(x + (fabs(x) + 1.0) * 1e-6);
+    }
+  };
+
+  // Compressed 4-wide bounding volume hierarchy, for scenes whose
+  // hierarchy would not otherwise fit in cache, or in memory. It has
+  // the topology of WideBVHAccelerator<4>, but each node is one
+  // 64-byte cache line: the node's own box is stored as a
+  // single-precision corner plus a power-of-two grid spacing per axis,
+  // and each child's box as 8-bit grid coordinates on that grid, as
+  // in Ylitie et al., "Efficient Incoherent Ray Traversal on GPUs
+  // Through Compressed Wide BVHs" (2017). Quantized boxes are rounded
+  // outward, so they can only be bigger than the exact ones, and
+  // traversal decodes them back to floats before the usual slab test.
+  //
+  // Nothing but the compressed nodes is kept, so refit() is not
+  // supported.
+  class QuantizedBVHAccelerator : public Accelerator {
+  public:
+    static const int WIDTH = 4;
+
+    // Largest grid coordinate.
+    static const int QUANTA = 255;
+
+    // One node. Children occupy slots [0, child_count). Along each
+    // axis, child k's box spans grid coordinates lo[axis][k] to
+    // hi[axis][k], where coordinate q is at origin[axis] + q *
+    // 2^exponent[axis]. count[k] and child[k] mean the same as in
+    // WideBVHAccelerator.
+    struct alignas(64) Node {
+      float origin[3];
+      int8_t exponent[3];
+      uint8_t child_count;
+      uint8_t lo[3][WIDTH], hi[3][WIDTH];
+      uint32_t child[WIDTH];
+      uint16_t count[WIDTH];
+    };
+    static_assert(sizeof(Node) == 64, "a node must fill one cache line");
+
+  private:
+    typedef WideBVHAccelerator<WIDTH> Wide;
+
+    // Nodes come from posix_memalign, since std::allocator need not
+    // honor alignas before C++17.
+    struct FreeDeleter {
+      void operator()(Node* nodes) const { free(nodes); }
+    };
+
+    std::unique_ptr<Node[], FreeDeleter> _nodes;
+    uint32_t _node_count;
+    std::vector<std::shared_ptr<SceneObject>> _primitives;
+
+  public:
+    QuantizedBVHAccelerator() : _node_count(0) { }
+
+    uint32_t node_count() const { return _node_count; }
+
+    virtual size_t memory_bytes() const {
+      return _node_count * sizeof(Node) + _primitives.size() * sizeof(_primitives[0]);
+    }
+
+    // Measured on the decoded boxes, which are the ones traversal
+    // sees.
+    virtual Structure structure() const {
+      typename Wide::Node decoded;
+      return Wide::structure_of(_node_count, [this, &decoded](uint32_t i) -> const typename Wide::Node& {
+          return decode_node(i, decoded);
+        });
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _nodes.reset();
+      _node_count = 0;
+      _primitives.clear();
+      if (objects.empty()) {
+        return;
+      }
+
+      // Build the uncompressed tree, then quantize it node for node.
+      Wide wide;
+      wide.build(objects);
+      const std::vector<typename Wide::Node>& wide_nodes = wide.nodes();
+      void* memory = nullptr;
+      if (posix_memalign(&memory, alignof(Node), wide_nodes.size() * sizeof(Node)) != 0) {
+        throw std::bad_alloc();
+      }
+      _nodes.reset(static_cast<Node*>(memory));
+      _node_count = wide_nodes.size();
+      for (uint32_t i = 0; i < _node_count; ++i) {
+        quantize(wide_nodes[i], _nodes[i]);
+      }
+      _primitives = wide.primitives();
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_node_count == 0) {
+        return closest;
+      }
+
+      typename Wide::WideRay ray;
+      for (int axis = 0; axis < 3; ++axis) {
+        ray.origin[axis] = static_cast<float>(ray_origin[axis]);
+        ray.inverse_direction[axis] = static_cast<float>(1.0 / ray_direction[axis]);
+      }
+
+      double closest_t = std::numeric_limits<double>::infinity();
+
+      struct StackEntry { uint32_t child, count; float t_near; };
+      StackEntry stack[(BVHAccelerator::MAX_DEPTH + 4) * WIDTH];
+      int stack_size = 0;
+      stack[stack_size++] = StackEntry{0, 0, 0.0f};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t) {
+          continue;
+        }
+
+        if (entry.count > 0) {
+          _statistics.primitives_tested += entry.count;
+          for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+            Hit hit = _primitives[i]->intersect(ray_origin, ray_direction);
+            if (hit.t < closest_t) {
+              closest_t = hit.t;
+              closest = hit;
+            }
+          }
+          continue;
+        }
+
+        const Node& node = _nodes[entry.child];
+        _statistics.nodes_visited++;
+        typename Wide::Node decoded;
+        decode(node, decoded);
+        float t_near[WIDTH];
+        unsigned mask = Wide::intersect_children(decoded, ray, closest_t, t_near);
+
+        int first = stack_size;
+        for (int k = 0; k < WIDTH; ++k) {
+          if (!(mask & (1u << k))) {
+            continue;
+          }
+          StackEntry child{node.child[k], node.count[k], t_near[k]};
+          int j = stack_size++;
+          while ((j > first) && (stack[j - 1].t_near < child.t_near)) {
+            stack[j] = stack[j - 1];
+            --j;
+          }
+          stack[j] = child;
+        }
+      }
+
+      return closest;
+    }
+
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_node_count == 0) {
+        return false;
+      }
+      typename Wide::Node decoded;
+      return Wide::occluded_in(ray_origin, ray_direction, t_max, _statistics,
+                               [this, &decoded](uint32_t i) -> const typename Wide::Node& {
+                                 return decode_node(i, decoded);
+                               },
+                               _primitives);
+    }
+
+  private:
+    // Return the coordinate of grid point q, computed exactly as
+    // decode() does.
+    static float grid_point(float origin, int exponent, int q) {
+      return origin + static_cast<float>(q) * std::ldexp(1.0f, exponent);
+    }
+
+    // Compress one node. The grid spacing along each axis is the
+    // smallest power of two that fits the node's box into QUANTA
+    // steps, and each child's coordinates are then nudged outward
+    // until they decode to a box containing the original.
+    static void quantize(const typename Wide::Node& wide, Node& node) {
+      std::memset(&node, 0, sizeof(node));
+      node.child_count = wide.child_count;
+      for (int axis = 0; axis < 3; ++axis) {
+        float lowest = std::numeric_limits<float>::infinity(),
+          highest = -std::numeric_limits<float>::infinity();
+        for (uint32_t k = 0; k < wide.child_count; ++k) {
+          lowest = std::min(lowest, wide.min[axis][k]);
+          highest = std::max(highest, wide.max[axis][k]);
+        }
+        node.origin[axis] = lowest;
+
+        int exponent = std::numeric_limits<int8_t>::min();
+        double extent = static_cast<double>(highest) - lowest;
+        if (extent > 0.0) {
+          std::frexp(extent / QUANTA, &exponent);
+          exponent = std::max(exponent - 1, static_cast<int>(std::numeric_limits<int8_t>::min()));
+          while (grid_point(lowest, exponent, QUANTA) < highest) {
+            exponent++;
+          }
+          assert(exponent <= std::numeric_limits<int8_t>::max());
+        }
+        node.exponent[axis] = exponent;
+
+        double scale = std::ldexp(1.0, exponent);
+        for (uint32_t k = 0; k < wide.child_count; ++k) {
+          int lo = static_cast<int>(std::floor((wide.min[axis][k] - lowest) / scale)),
+            hi = static_cast<int>(std::ceil((wide.max[axis][k] - lowest) / scale));
+          lo = std::min(std::max(lo, 0), static_cast<int>(QUANTA));
+          hi = std::min(std::max(hi, 0), static_cast<int>(QUANTA));
+          while ((lo > 0) && (grid_point(lowest, exponent, lo) > wide.min[axis][k])) {
+            lo--;
+          }
+          while ((hi < QUANTA) && (grid_point(lowest, exponent, hi) < wide.max[axis][k])) {
+            hi++;
+          }
+          node.lo[axis][k] = lo;
+          node.hi[axis][k] = hi;
+        }
+      }
+      for (uint32_t k = 0; k < wide.child_count; ++k) {
+        assert(wide.count[k] <= std::numeric_limits<uint16_t>::max());
+        node.child[k] = wide.child[k];
+        node.count[k] = wide.count[k];
+      }
+    }
+
+    // Expand a node's boxes back to single precision, for
+    // Wide::intersect_children().
+    static void decode(const Node& node, typename Wide::Node& decoded) {
+      for (int axis = 0; axis < 3; ++axis) {
+        float origin = node.origin[axis],
+          scale = std::ldexp(1.0f, node.exponent[axis]);
+        for (int k = 0; k < WIDTH; ++k) {
+          decoded.min[axis][k] = origin + static_cast<float>(node.lo[axis][k]) * scale;
+          decoded.max[axis][k] = origin + static_cast<float>(node.hi[axis][k]) * scale;
+        }
+      }
+      decoded.child_count = node.child_count;
+    }
+
+    // Decode node i, children included, into decoded and return it.
+    const typename Wide::Node& decode_node(uint32_t i, typename Wide::Node& decoded) const {
+      decode(_nodes[i], decoded);
+      for (int k = 0; k < WIDTH; ++k) {
+        decoded.child[k] = _nodes[i].child[k];
+        decoded.count[k] = _nodes[i].count[k];
+      }
+      return decoded;
+    }
+  };
+
+  // Uniform grid: the scene's bounding box is cut into equal cells,
+  // and each cell lists every object whose box overlaps it. A ray
+  // walks through the cells it pierces, in order, with the 3D-DDA of
+  // Amanatides and Woo, "A Fast Voxel Traversal Algorithm for Ray
+  // Tracing" (1987), and stops as soon as a hit lies inside the
+  // current cell. This suits scenes of many similar-sized objects
+  // spread evenly, like the ballpit.
+  //
+  // An object overlapping several cells is only tested once per ray,
+  // thanks to mailboxing: each object remembers the last ray that
+  // tested it. The mailboxes make closest_hit() unsafe to call from
+  // several threads at once.
+  class GridAccelerator : public Accelerator {
+  public:
+    // Target average number of objects per cell, which sets the grid
+    // resolution.
+    static constexpr double OBJECTS_PER_CELL = 2.0;
+
+    // Upper limit on the number of cells along one axis.
+    static const int MAX_RESOLUTION = 256;
+
+  private:
+    std::vector<std::shared_ptr<SceneObject>> _objects;
+    BoundingBox _bounds;
+    int _resolution[3];
+    double _cell_size[3];
+
+    // Cell c holds objects _cell_objects[_cell_starts[c]] through
+    // _cell_objects[_cell_starts[c + 1] - 1].
+    std::vector<uint32_t> _cell_starts, _cell_objects;
+
+    // _mailboxes[i] is the id of the last ray tested against object
+    // i; ids start from 1 so that 0 means "never tested".
+    mutable std::vector<uint32_t> _mailboxes;
+    mutable uint32_t _ray_id;
+
+  public:
+    GridAccelerator() : _ray_id(0) {
+      _resolution[0] = _resolution[1] = _resolution[2] = 0;
+    }
+
+    virtual size_t memory_bytes() const {
+      return _objects.size() * sizeof(_objects[0]) +
+        (_cell_starts.size() + _cell_objects.size() + _mailboxes.size()) * sizeof(uint32_t);
+    }
+
+    // Every cell counts as a leaf under the grid's box.
+    virtual Structure structure() const {
+      Structure result{0, 0, 0.0};
+      if (_cell_starts.empty()) {
+        return result;
+      }
+      result.nodes = _cell_starts.size() - 1;
+      result.depth = 1;
+      double root_area = _bounds.surface_area();
+      if (root_area > 0.0) {
+        double cell_area = 2.0 * (_cell_size[0] * _cell_size[1] + _cell_size[1] * _cell_size[2] +
+                                  _cell_size[2] * _cell_size[0]);
+        result.sah_cost = 1.0 + cell_area / root_area * _cell_objects.size();
+      }
+      return result;
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _objects = objects;
+      _bounds.reset();
+      _cell_starts.clear();
+      _cell_objects.clear();
+      _mailboxes.assign(objects.size(), 0);
+      _ray_id = 0;
+      if (objects.empty()) {
+        return;
+      }
+
+      std::vector<BoundingBox> boxes;
+      boxes.reserve(objects.size());
+      for (const std::shared_ptr<SceneObject>& obj : objects) {
+        boxes.push_back(obj->bounds());
+        _bounds.expand(boxes.back());
+      }
+
+      // Choose cubical cells so that there are about
+      // objects.size() / OBJECTS_PER_CELL of them, treating flat
+      // axes as if they had the thickness of one cell.
+      double volume = 1.0, max_extent = 0.0;
+      for (int axis = 0; axis < 3; ++axis) {
+        max_extent = std::max(max_extent, _bounds.extent(axis));
+      }
+      double min_extent = (max_extent > 0.0) ? max_extent / MAX_RESOLUTION : 1.0;
+      for (int axis = 0; axis < 3; ++axis) {
+        volume *= std::max(_bounds.extent(axis), min_extent);
+      }
+      double cells_per_unit = cbrt(objects.size() / OBJECTS_PER_CELL / volume);
+      for (int axis = 0; axis < 3; ++axis) {
+        int resolution = static_cast<int>(ceil(_bounds.extent(axis) * cells_per_unit));
+        _resolution[axis] = std::min(std::max(resolution, 1), static_cast<int>(MAX_RESOLUTION));
+        _cell_size[axis] = std::max(_bounds.extent(axis), min_extent) / _resolution[axis];
+      }
+
+      // Two passes over the objects: count the entries of each cell,
+      // then fill them in.
+      uint32_t cell_count = _resolution[0] * _resolution[1] * _resolution[2];
+      _cell_starts.assign(cell_count + 1, 0);
+      for (int pass = 0; pass < 2; ++pass) {
+        std::vector<uint32_t> fill;
+        if (pass == 1) {
+          for (uint32_t c = 0; c < cell_count; ++c) {
+            _cell_starts[c + 1] += _cell_starts[c];
+          }
+          _cell_objects.resize(_cell_starts[cell_count]);
+          fill.assign(_cell_starts.begin(), _cell_starts.end() - 1);
+        }
+        for (uint32_t i = 0; i < boxes.size(); ++i) {
+          int lo[3], hi[3];
+          for (int axis = 0; axis < 3; ++axis) {
+            lo[axis] = cell_coordinate(boxes[i].min(axis), axis);
+            hi[axis] = cell_coordinate(boxes[i].max(axis), axis);
+          }
+          for (int z = lo[2]; z <= hi[2]; ++z) {
+            for (int y = lo[1]; y <= hi[1]; ++y) {
+              for (int x = lo[0]; x <= hi[0]; ++x) {
+                uint32_t c = cell_index(x, y, z);
+                if (pass == 0) {
+                  _cell_starts[c + 1]++;
+                } else {
+                  _cell_objects[fill[c]++] = i;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_objects.empty()) {
+        return closest;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double t_enter;
+      if (!_bounds.intersect(ray, std::numeric_limits<double>::infinity(), t_enter)) {
+        return closest;
+      }
+      next_ray_id();
+
+      Walk walk(start_walk(ray, ray_direction, t_enter));
+      double closest_t = std::numeric_limits<double>::infinity();
+      do {
+        uint32_t c = cell_index(walk.cell[0], walk.cell[1], walk.cell[2]);
+        _statistics.nodes_visited++;
+        for (uint32_t k = _cell_starts[c]; k < _cell_starts[c + 1]; ++k) {
+          uint32_t i = _cell_objects[k];
+          if (_mailboxes[i] == _ray_id) {
+            continue;
+          }
+          _mailboxes[i] = _ray_id;
+          _statistics.primitives_tested++;
+          Hit hit = _objects[i]->intersect(ray_origin, ray_direction);
+          if (hit.t < closest_t) {
+            closest_t = hit.t;
+            closest = hit;
+          }
+        }
+        // a hit before the next cell boundary cannot be beaten by
+        // anything in a later cell
+      } while (advance(walk, closest_t));
+
+      return closest;
+    }
+
+    // Any-hit traversal: the same walk, ending at t_max or at the
+    // first object in the way.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_objects.empty()) {
+        return false;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double t_enter;
+      if (!_bounds.intersect(ray, t_max, t_enter)) {
+        return false;
+      }
+      next_ray_id();
+
+      Walk walk(start_walk(ray, ray_direction, t_enter));
+      do {
+        uint32_t c = cell_index(walk.cell[0], walk.cell[1], walk.cell[2]);
+        _statistics.occlusion_nodes_visited++;
+        for (uint32_t k = _cell_starts[c]; k < _cell_starts[c + 1]; ++k) {
+          uint32_t i = _cell_objects[k];
+          if (_mailboxes[i] == _ray_id) {
+            continue;
+          }
+          _mailboxes[i] = _ray_id;
+          _statistics.occlusion_primitives_tested++;
+          if (_objects[i]->occludes(ray_origin, ray_direction, t_max)) {
+            return true;
+          }
+        }
+      } while (advance(walk, t_max));
+
+      return false;
+    }
+
+  private:
+    // The state of the 3D-DDA: the current cell; the step direction
+    // along each axis; the time at which the ray crosses the next
+    // cell boundary along each axis; and the time it takes to cross
+    // one whole cell along each axis.
+    struct Walk {
+      int cell[3], step[3];
+      double t_next[3], t_delta[3];
+    };
+
+    // Start a walk at the cell where the ray enters the grid, at
+    // t_enter.
+    Walk start_walk(const BoxRay& ray, const Vector4& ray_direction, double t_enter) const {
+      Walk walk;
+      for (int axis = 0; axis < 3; ++axis) {
+        double entry = ray.origin(axis) + t_enter * ray_direction[axis];
+        walk.cell[axis] = cell_coordinate(entry, axis);
+        double inverse = ray.inverse_direction(axis);
+        if (ray_direction[axis] > 0.0) {
+          walk.step[axis] = 1;
+          walk.t_next[axis] = (_bounds.min(axis) + (walk.cell[axis] + 1) * _cell_size[axis] - ray.origin(axis)) * inverse;
+          walk.t_delta[axis] = _cell_size[axis] * inverse;
+        } else if (ray_direction[axis] < 0.0) {
+          walk.step[axis] = -1;
+          walk.t_next[axis] = (_bounds.min(axis) + walk.cell[axis] * _cell_size[axis] - ray.origin(axis)) * inverse;
+          walk.t_delta[axis] = -_cell_size[axis] * inverse;
+        } else {
+          walk.step[axis] = 0;
+          walk.t_next[axis] = std::numeric_limits<double>::infinity();
+          walk.t_delta[axis] = std::numeric_limits<double>::infinity();
+        }
+      }
+      return walk;
+    }
+
+    // Advance along whichever axis reaches its next boundary first.
+    // Return false, leaving the walk where it is, if that boundary is
+    // at or beyond t_stop or is the edge of the grid.
+    bool advance(Walk& walk, double t_stop) const {
+      int axis = 0;
+      if (walk.t_next[1] < walk.t_next[axis]) axis = 1;
+      if (walk.t_next[2] < walk.t_next[axis]) axis = 2;
+      if (t_stop <= walk.t_next[axis]) {
+        return false;
+      }
+      walk.cell[axis] += walk.step[axis];
+      if ((walk.cell[axis] < 0) || (walk.cell[axis] >= _resolution[axis])) {
+        return false;
+      }
+      walk.t_next[axis] += walk.t_delta[axis];
+      return true;
+    }
+
+    // Start a new ray for mailboxing, wrapping around after 2^32 rays
+    // by clearing every mailbox.
+    void next_ray_id() const {
+      if (++_ray_id == 0) {
+        std::fill(_mailboxes.begin(), _mailboxes.end(), 0);
+        _ray_id = 1;
+      }
+    }
+
+    // Return the cell coordinate containing x along one axis, clamped
+    // to the grid.
+    int cell_coordinate(double x, int axis) const {
+      int c = static_cast<int>((x - _bounds.min(axis)) / _cell_size[axis]);
+      return std::min(std::max(c, 0), _resolution[axis] - 1);
+    }
+
+    uint32_t cell_index(int x, int y, int z) const {
+      return (static_cast<uint32_t>(z) * _resolution[1] + y) * _resolution[0] + x;
+    }
+  };
+
+  // Kd-tree: the scene's bounding box is cut recursively by
+  // axis-aligned planes chosen with the SAH, and each leaf lists every
+  // object whose box overlaps it. Unlike a BVH, the leaves partition
+  // space exactly, so a ray visits them strictly front to back and can
+  // stop at the first leaf containing a hit; this pays off when many
+  // objects overlap, as in the ballpit. Split planes are chosen from
+  // the faces of the objects' boxes, sorted per axis, as in Wald and
+  // Havran, "On building fast kd-Trees for Ray Tracing, and on doing
+  // that in O(N log N)" (2006), here with the simpler O(N log^2 N)
+  // sort at every node.
+  //
+  // Traversal is stackless, following Popov et al., "Stackless KD-Tree
+  // Traversal for High Performance GPU Ray Tracing" (2007): every leaf
+  // has a rope through each of its six faces to the smallest node that
+  // covers the whole face on the other side. A ray descends to the
+  // leaf containing its entry point, tests that leaf's objects, then
+  // follows the rope through its exit face and descends again from
+  // there.
+  //
+  // Objects in several leaves are tested once per ray with mailboxing,
+  // as in GridAccelerator, with the same caveat about threads.
+  class KDTreeAccelerator : public Accelerator {
+  public:
+    // Estimated relative costs of descending one node and of testing
+    // one object, for the SAH.
+    static constexpr double TRAVERSAL_COST = 1.0;
+    static constexpr double INTERSECTION_COST = 1.5;
+
+    // Factor applied to the cost of a split that leaves one side
+    // empty, so that empty space is cut off eagerly.
+    static constexpr double EMPTY_BONUS = 0.8;
+
+    // Rope through a face on the boundary of the whole tree.
+    static const uint32_t NO_ROPE = std::numeric_limits<uint32_t>::max();
+
+    // Marks a leaf in Node::axis.
+    static const uint32_t LEAF = 3;
+
+    // One node of the tree. An interior node splits its box at split
+    // along axis; its children, below and above the plane, are at
+    // node indices first and first + 1. A leaf holds the objects at
+    // _leaf_objects[first, first + count). ropes[2 * a] and
+    // ropes[2 * a + 1] lead through the faces of the box at its
+    // minimum and maximum along axis a; they are only used in leaves.
+    struct Node {
+      BoundingBox bounds;
+      double split;
+      uint32_t axis, first, count;
+      uint32_t ropes[6];
+
+      bool is_leaf() const { return axis == LEAF; }
+    };
+
+  private:
+    std::vector<std::shared_ptr<SceneObject>> _objects;
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _leaf_objects;
+
+    // Mailboxes, as in GridAccelerator.
+    mutable std::vector<uint32_t> _mailboxes;
+    mutable uint32_t _ray_id;
+
+  public:
+    KDTreeAccelerator() : _ray_id(0) { }
+
+    const std::vector<Node>& nodes() const { return _nodes; }
+
+    virtual size_t memory_bytes() const {
+      return _objects.size() * sizeof(_objects[0]) + _nodes.size() * sizeof(Node) +
+        (_leaf_objects.size() + _mailboxes.size()) * sizeof(uint32_t);
+    }
+
+    virtual Structure structure() const {
+      Structure result{_nodes.size(), 0, 0.0};
+      if (_nodes.empty()) {
+        return result;
+      }
+      double root_area = _nodes[0].bounds.surface_area();
+      std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 1));
+      while (!stack.empty()) {
+        std::pair<uint32_t, int> entry = stack.back();
+        stack.pop_back();
+        result.depth = std::max(result.depth, entry.second);
+        const Node& node = _nodes[entry.first];
+        if (root_area > 0.0) {
+          result.sah_cost += node.bounds.surface_area() / root_area *
+            (node.is_leaf() ? node.count : 1.0);
+        }
+        if (!node.is_leaf()) {
+          stack.push_back(std::make_pair(node.first, entry.second + 1));
+          stack.push_back(std::make_pair(node.first + 1, entry.second + 1));
+        }
+      }
+      return result;
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _objects = objects;
+      _nodes.clear();
+      _leaf_objects.clear();
+      _mailboxes.assign(objects.size(), 0);
+      _ray_id = 0;
+      if (objects.empty()) {
+        return;
+      }
+
+      std::vector<BoundingBox> boxes;
+      std::vector<uint32_t> indices;
+      BoundingBox bounds;
+      boxes.reserve(objects.size());
+      indices.reserve(objects.size());
+      for (uint32_t i = 0; i < objects.size(); ++i) {
+        boxes.push_back(objects[i]->bounds());
+        bounds.expand(boxes.back());
+        indices.push_back(i);
+      }
+
+      // The depth limit recommended by Pharr and Humphreys, "Physically
+      // Based Rendering" (2004).
+      int max_depth = static_cast<int>(8 + 1.3 * log2(static_cast<double>(objects.size())));
+
+      _nodes.push_back(Node());
+      build_node(0, bounds, boxes, indices, max_depth);
+
+      uint32_t ropes[6] = { NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE, NO_ROPE };
+      attach_ropes(0, ropes);
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_nodes.empty()) {
+        return closest;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double t_entry;
+      if (!_nodes[0].bounds.intersect(ray, std::numeric_limits<double>::infinity(), t_entry)) {
+        return closest;
+      }
+      next_ray_id();
+
+      double closest_t = std::numeric_limits<double>::infinity();
+      uint32_t node_index = 0;
+      while (node_index != NO_ROPE) {
+        const Node* node = descend(node_index, ray, ray_direction, t_entry, _statistics.nodes_visited);
+        _statistics.nodes_visited++;
+
+        for (uint32_t k = node->first; k < node->first + node->count; ++k) {
+          uint32_t i = _leaf_objects[k];
+          if (_mailboxes[i] == _ray_id) {
+            continue;
+          }
+          _mailboxes[i] = _ray_id;
+          _statistics.primitives_tested++;
+          Hit hit = _objects[i]->intersect(ray_origin, ray_direction);
+          if (hit.t < closest_t) {
+            closest_t = hit.t;
+            closest = hit;
+          }
+        }
+
+        // A hit before the ray leaves the leaf cannot be beaten by
+        // anything in a later leaf.
+        double t_exit;
+        int exit_face = find_exit(*node, ray, ray_direction, t_exit);
+        if ((closest_t <= t_exit) || (exit_face < 0)) {
+          break;
+        }
+        node_index = node->ropes[exit_face];
+        t_entry = std::max(t_entry, t_exit);
+      }
+
+      return closest;
+    }
+
+    // Any-hit traversal: the same walk from leaf to leaf, ending at
+    // t_max or at the first object in the way.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_nodes.empty()) {
+        return false;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double t_entry;
+      if (!_nodes[0].bounds.intersect(ray, t_max, t_entry)) {
+        return false;
+      }
+      next_ray_id();
+
+      uint32_t node_index = 0;
+      while (node_index != NO_ROPE) {
+        const Node* node = descend(node_index, ray, ray_direction, t_entry,
+                                   _statistics.occlusion_nodes_visited);
+        _statistics.occlusion_nodes_visited++;
+
+        for (uint32_t k = node->first; k < node->first + node->count; ++k) {
+          uint32_t i = _leaf_objects[k];
+          if (_mailboxes[i] == _ray_id) {
+            continue;
+          }
+          _mailboxes[i] = _ray_id;
+          _statistics.occlusion_primitives_tested++;
+          if (_objects[i]->occludes(ray_origin, ray_direction, t_max)) {
+            return true;
+          }
+        }
+
+        double t_exit;
+        int exit_face = find_exit(*node, ray, ray_direction, t_exit);
+        if ((t_max <= t_exit) || (exit_face < 0)) {
+          break;
+        }
+        node_index = node->ropes[exit_face];
+        t_entry = std::max(t_entry, t_exit);
+      }
+
+      return false;
+    }
+
+  private:
+    // Descend from _nodes[node_index] to the leaf containing the
+    // ray's point at t_entry, counting the interior nodes passed in
+    // nodes_visited. A point on a split plane goes to the side the
+    // ray is heading into.
+    const Node* descend(uint32_t node_index, const BoxRay& ray, const Vector4& ray_direction,
+                        double t_entry, uint64_t& nodes_visited) const {
+      double entry[3];
+      for (int axis = 0; axis < 3; ++axis) {
+        entry[axis] = ray.origin(axis) + t_entry * ray_direction[axis];
+      }
+      const Node* node = &_nodes[node_index];
+      while (!node->is_leaf()) {
+        nodes_visited++;
+        double x = entry[node->axis];
+        bool below = (x < node->split) ||
+          ((x == node->split) && (ray_direction[node->axis] <= 0.0));
+        node = &_nodes[below ? node->first : node->first + 1];
+      }
+      return node;
+    }
+
+    // Return the face the ray leaves leaf through, storing the time
+    // it does so in t_exit, or -1 for a ray with no direction at all.
+    static int find_exit(const Node& leaf, const BoxRay& ray, const Vector4& ray_direction,
+                         double& t_exit) {
+      t_exit = std::numeric_limits<double>::infinity();
+      int exit_face = -1;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (ray_direction[axis] > 0.0) {
+          double t = (leaf.bounds.max(axis) - ray.origin(axis)) * ray.inverse_direction(axis);
+          if (t < t_exit) {
+            t_exit = t;
+            exit_face = 2 * axis + 1;
+          }
+        } else if (ray_direction[axis] < 0.0) {
+          double t = (leaf.bounds.min(axis) - ray.origin(axis)) * ray.inverse_direction(axis);
+          if (t < t_exit) {
+            t_exit = t;
+            exit_face = 2 * axis;
+          }
+        }
+      }
+      return exit_face;
+    }
+
+    // Start a new ray for mailboxing, as in GridAccelerator.
+    void next_ray_id() const {
+      if (++_ray_id == 0) {
+        std::fill(_mailboxes.begin(), _mailboxes.end(), 0);
+        _ray_id = 1;
+      }
+    }
+
+    // Build the subtree rooted at _nodes[node_index], whose box is
+    // bounds, over the objects listed in indices.
+    void build_node(uint32_t node_index, const BoundingBox& bounds,
+                    const std::vector<BoundingBox>& boxes,
+                    const std::vector<uint32_t>& indices, int depth_left) {
+      _nodes[node_index].bounds = bounds;
+      uint32_t count = indices.size();
+
+      int best_axis = -1;
+      double best_split = 0.0,
+        best_cost = INTERSECTION_COST * count;
+      if ((count > 1) && (depth_left > 0)) {
+        find_split(bounds, boxes, indices, best_axis, best_split, best_cost);
+      }
+      if (best_axis < 0) {
+        _nodes[node_index].axis = LEAF;
+        _nodes[node_index].first = _leaf_objects.size();
+        _nodes[node_index].count = count;
+        _leaf_objects.insert(_leaf_objects.end(), indices.begin(), indices.end());
+        return;
+      }
+
+      // Objects straddling the plane go to both sides; an object flat
+      // against it goes below.
+      std::vector<uint32_t> below, above;
+      for (uint32_t i : indices) {
+        double lo = std::max(boxes[i].min(best_axis), bounds.min(best_axis)),
+          hi = std::min(boxes[i].max(best_axis), bounds.max(best_axis));
+        if ((lo < best_split) || ((lo == best_split) && (hi == best_split))) {
+          below.push_back(i);
+        }
+        if (hi > best_split) {
+          above.push_back(i);
+        }
+      }
+
+      BoundingBox below_bounds = clip(bounds, best_axis, bounds.min(best_axis), best_split),
+        above_bounds = clip(bounds, best_axis, best_split, bounds.max(best_axis));
+
+      uint32_t below_index = _nodes.size();
+      _nodes[node_index].axis = best_axis;
+      _nodes[node_index].split = best_split;
+      _nodes[node_index].first = below_index;
+      _nodes[node_index].count = 0;
+      _nodes.push_back(Node());
+      _nodes.push_back(Node());
+      build_node(below_index, below_bounds, boxes, below, depth_left - 1);
+      build_node(below_index + 1, above_bounds, boxes, above, depth_left - 1);
+    }
+
+    // Sweep the candidate planes at the faces of the objects' boxes,
+    // clipped to bounds, along each axis, and set best_axis,
+    // best_split and best_cost to any plane that costs less than
+    // best_cost.
+    void find_split(const BoundingBox& bounds,
+                    const std::vector<BoundingBox>& boxes,
+                    const std::vector<uint32_t>& indices,
+                    int& best_axis, double& best_split, double& best_cost) const {
+      // An event is a plane position plus what happens there: 0 for an
+      // object ending, 1 for a flat object, 2 for an object starting.
+      // Sorting puts ends before flats before starts at equal positions.
+      std::vector<std::pair<double, int>> events;
+      events.reserve(2 * indices.size());
+      double area = bounds.surface_area();
+      uint32_t count = indices.size();
+
+      for (int axis = 0; axis < 3; ++axis) {
+        if (bounds.extent(axis) <= 0.0) {
+          continue;
+        }
+        events.clear();
+        for (uint32_t i : indices) {
+          double lo = std::max(boxes[i].min(axis), bounds.min(axis)),
+            hi = std::min(boxes[i].max(axis), bounds.max(axis));
+          if (lo == hi) {
+            events.push_back(std::make_pair(lo, 1));
+          } else {
+            events.push_back(std::make_pair(lo, 2));
+            events.push_back(std::make_pair(hi, 0));
+          }
+        }
+        std::sort(events.begin(), events.end());
+
+        uint32_t below_count = 0, above_count = count;
+        for (size_t e = 0; e < events.size(); ) {
+          double split = events[e].first;
+          uint32_t ending = 0, flat = 0, starting = 0;
+          for (; (e < events.size()) && (events[e].first == split) && (events[e].second == 0); ++e) ending++;
+          for (; (e < events.size()) && (events[e].first == split) && (events[e].second == 1); ++e) flat++;
+          for (; (e < events.size()) && (events[e].first == split) && (events[e].second == 2); ++e) starting++;
+
+          above_count -= ending + flat;
+          if ((split > bounds.min(axis)) && (split < bounds.max(axis))) {
+            double below_area = clip(bounds, axis, bounds.min(axis), split).surface_area(),
+              above_area = clip(bounds, axis, split, bounds.max(axis)).surface_area();
+            uint32_t below_total = below_count + flat;
+            double cost = TRAVERSAL_COST + INTERSECTION_COST *
+              (below_area * below_total + above_area * above_count) / area;
+            if ((below_total == 0) || (above_count == 0)) {
+              cost *= EMPTY_BONUS;
+            }
+            if (cost < best_cost) {
+              best_cost = cost;
+              best_axis = axis;
+              best_split = split;
+            }
+          }
+          below_count += starting + flat;
+        }
+      }
+    }
+
+    // Give the leaves under _nodes[node_index] their ropes, given
+    // the ropes through the faces of that node's box.
+    void attach_ropes(uint32_t node_index, uint32_t ropes[6]) {
+      Node& node = _nodes[node_index];
+      for (int face = 0; face < 6; ++face) {
+        ropes[face] = tighten_rope(ropes[face], face, node.bounds);
+      }
+      if (node.is_leaf()) {
+        std::copy(ropes, ropes + 6, node.ropes);
+        return;
+      }
+      uint32_t below_ropes[6], above_ropes[6];
+      std::copy(ropes, ropes + 6, below_ropes);
+      std::copy(ropes, ropes + 6, above_ropes);
+      below_ropes[2 * node.axis + 1] = node.first + 1;
+      above_ropes[2 * node.axis] = node.first;
+      uint32_t first = node.first;
+      attach_ropes(first, below_ropes);
+      attach_ropes(first + 1, above_ropes);
+    }
+
+    // Move a rope through one face of box down from the node it
+    // leads to, for as long as a single child of that node covers the
+    // whole face.
+    uint32_t tighten_rope(uint32_t rope, int face, const BoundingBox& box) const {
+      int face_axis = face / 2;
+      while ((rope != NO_ROPE) && !_nodes[rope].is_leaf()) {
+        const Node& target = _nodes[rope];
+        if (static_cast<int>(target.axis) == face_axis) {
+          // the face lies against the target's far side
+          rope = (face % 2 == 1) ? target.first : target.first + 1;
+        } else if (target.split >= box.max(target.axis)) {
+          rope = target.first;
+        } else if (target.split <= box.min(target.axis)) {
+          rope = target.first + 1;
+        } else {
+          break;
+        }
+      }
+      return rope;
+    }
+
+    // Return bounds with its extent along axis replaced by [lo, hi].
+    static BoundingBox clip(const BoundingBox& bounds, int axis, double lo, double hi) {
+      double min[3] = { bounds.min(0), bounds.min(1), bounds.min(2) },
+        max[3] = { bounds.max(0), bounds.max(1), bounds.max(2) };
+      min[axis] = lo;
+      max[axis] = hi;
+      return BoundingBox(min[0], min[1], min[2], max[0], max[1], max[2]);
+    }
+  };
+
+  // Loose octree: a cube around the scene is divided recursively into
+  // eight octants, but only where objects are dense, so clusters of
+  // small objects get a deep tree while sparse regions stay shallow.
+  // Each node's cube is "loose", i.e. considered twice as wide as its
+  // octant, so every object can be stored in exactly one node: the
+  // deepest one whose octants are at least as wide as the object and
+  // whose octant contains the object's center. Large objects therefore
+  // stay near the root instead of being split across many cells. See
+  // Ulrich, "Loose Octrees", in Game Programming Gems (2000).
+  //
+  // Each node's box is shrunk to fit the objects under it, and a ray
+  // visits a node's children front to back, in the octant order its
+  // direction implies.
+  class OctreeAccelerator : public Accelerator {
+  public:
+    // A node holding more objects than this is subdivided...
+    static const int MAX_NODE_OBJECTS = 4;
+
+    // ...unless it is this deep.
+    static const int MAX_DEPTH = 16;
+
+    // One node. Its objects are _node_objects[first_object,
+    // first_object + object_count). Bit o of child_mask is set iff
+    // there is a child in octant o, where bits 0, 1 and 2 of o are
+    // set for the upper half along x, y and z; the children present
+    // are stored in octant order starting at first_child.
+    struct Node {
+      BoundingBox bounds;
+      uint32_t first_object, object_count, first_child;
+      uint32_t child_mask;
+    };
+
+  private:
+    std::vector<std::shared_ptr<SceneObject>> _objects;
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _node_objects;
+
+  public:
+    const std::vector<Node>& nodes() const { return _nodes; }
+
+    virtual size_t memory_bytes() const {
+      return _objects.size() * sizeof(_objects[0]) + _nodes.size() * sizeof(Node) +
+        _node_objects.size() * sizeof(uint32_t);
+    }
+
+    // A node counts both as an interior node and as a leaf holding
+    // its own objects.
+    virtual Structure structure() const {
+      Structure result{_nodes.size(), 0, 0.0};
+      if (_nodes.empty()) {
+        return result;
+      }
+      double root_area = _nodes[0].bounds.surface_area();
+      std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 1));
+      while (!stack.empty()) {
+        std::pair<uint32_t, int> entry = stack.back();
+        stack.pop_back();
+        result.depth = std::max(result.depth, entry.second);
+        const Node& node = _nodes[entry.first];
+        if (root_area > 0.0) {
+          result.sah_cost += node.bounds.surface_area() / root_area * (1.0 + node.object_count);
+        }
+        for (uint32_t k = 0; k < popcount(node.child_mask); ++k) {
+          stack.push_back(std::make_pair(node.first_child + k, entry.second + 1));
+        }
+      }
+      return result;
+    }
+
+    virtual void build(const std::vector<std::shared_ptr<SceneObject>>& objects) {
+      _objects = objects;
+      _nodes.clear();
+      _node_objects.clear();
+      if (objects.empty()) {
+        return;
+      }
+
+      std::vector<BoundingBox> boxes;
+      std::vector<uint32_t> indices;
+      BoundingBox bounds;
+      boxes.reserve(objects.size());
+      indices.reserve(objects.size());
+      for (uint32_t i = 0; i < objects.size(); ++i) {
+        boxes.push_back(objects[i]->bounds());
+        bounds.expand(boxes.back());
+        indices.push_back(i);
+      }
+      double center[3], half_size = 0.0;
+      for (int axis = 0; axis < 3; ++axis) {
+        center[axis] = bounds.centroid(axis);
+        half_size = std::max(half_size, bounds.extent(axis) * 0.5);
+      }
+
+      _nodes.reserve(objects.size());
+      _node_objects.reserve(objects.size());
+      _nodes.push_back(Node());
+      build_node(0, center, half_size, boxes, indices, 0);
+    }
+
+    virtual Hit closest_hit(const Vector4& ray_origin,
+                            const Vector4& ray_direction) const {
+      Hit closest(Hit::miss());
+      _statistics.rays++;
+      if (_nodes.empty()) {
+        return closest;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      double closest_t = std::numeric_limits<double>::infinity();
+
+      // Visiting octants in the order o ^ near_octant, for o = 0 to
+      // 7, goes from the corner the ray comes from to the corner it
+      // heads towards.
+      uint32_t near_octant = 0;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (ray_direction[axis] < 0.0) {
+          near_octant |= 1u << axis;
+        }
+      }
+
+      struct StackEntry { uint32_t node; double t_near; };
+      StackEntry stack[7 * MAX_DEPTH + 8];
+      int stack_size = 0;
+
+      double t_near;
+      if (!_nodes[0].bounds.intersect(ray, closest_t, t_near)) {
+        return closest;
+      }
+      stack[stack_size++] = StackEntry{0, t_near};
+
+      while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > closest_t) {
+          continue;
+        }
+        const Node& node = _nodes[entry.node];
+        _statistics.nodes_visited++;
+
+        _statistics.primitives_tested += node.object_count;
+        for (uint32_t k = node.first_object; k < node.first_object + node.object_count; ++k) {
+          uint32_t i = _node_objects[k];
+          Hit hit = _objects[i]->intersect(ray_origin, ray_direction);
+          if (hit.t < closest_t) {
+            closest_t = hit.t;
+            closest = hit;
+          }
+        }
+
+        // push the farthest octant first, so the nearest is popped
+        // first
+        for (int o = 7; o >= 0; --o) {
+          uint32_t octant = o ^ near_octant;
+          if (!(node.child_mask & (1u << octant))) {
+            continue;
+          }
+          uint32_t child = node.first_child + popcount(node.child_mask & ((1u << octant) - 1));
+          double t_child;
+          if (_nodes[child].bounds.intersect(ray, closest_t, t_child)) {
+            assert(stack_size < 7 * MAX_DEPTH + 8);
+            stack[stack_size++] = StackEntry{child, t_child};
+          }
+        }
+      }
+
+      return closest;
+    }
+
+    // Any-hit traversal: octants are still visited near to far, which
+    // costs nothing, but a hit anywhere before t_max ends the search.
+    virtual bool occluded(const Vector4& ray_origin,
+                          const Vector4& ray_direction,
+                          double t_max) const {
+      _statistics.occlusion_rays++;
+      if (_nodes.empty()) {
+        return false;
+      }
+
+      BoxRay ray(ray_origin, ray_direction);
+      uint32_t near_octant = 0;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (ray_direction[axis] < 0.0) {
+          near_octant |= 1u << axis;
+        }
+      }
+
+      uint32_t stack[7 * MAX_DEPTH + 8];
+      int stack_size = 0;
+
+      double t_near;
+      if (!_nodes[0].bounds.intersect(ray, t_max, t_near)) {
+        return false;
+      }
+      stack[stack_size++] = 0;
+
+      while (stack_size > 0) {
+        const Node& node = _nodes[stack[--stack_size]];
+        _statistics.occlusion_nodes_visited++;
+
+        for (uint32_t k = node.first_object; k < node.first_object + node.object_count; ++k) {
+          _statistics.occlusion_primitives_tested++;
+          if (_objects[_node_objects[k]]->occludes(ray_origin, ray_direction, t_max)) {
+            return true;
+          }
+        }
+
+        for (int o = 7; o >= 0; --o) {
+          uint32_t octant = o ^ near_octant;
+          if (!(node.child_mask & (1u << octant))) {
+            continue;
+          }
+          uint32_t child = node.first_child + popcount(node.child_mask & ((1u << octant) - 1));
+          if (_nodes[child].bounds.intersect(ray, t_max, t_near)) {
+            assert(stack_size < 7 * MAX_DEPTH + 8);
+            stack[stack_size++] = child;
+          }
+        }
+      }
+
+      return false;
+    }
+
+  private:
+    // Build the subtree rooted at _nodes[node_index], whose octants
+    // are cubes of half_size / 2 around center, over the objects
+    // listed in indices, and set its box.
+    void build_node(uint32_t node_index, const double center[3], double half_size,
+                    const std::vector<BoundingBox>& boxes,
+                    const std::vector<uint32_t>& indices, int depth) {
+      // An object moves down into an octant if it is no wider than
+      // the octant, so that it fits in the octant's loose cube.
+      double child_half_size = half_size * 0.5;
+      std::vector<uint32_t> kept, octants[8];
+      if ((indices.size() <= MAX_NODE_OBJECTS) || (depth >= MAX_DEPTH)) {
+        kept = indices;
+      } else {
+        for (uint32_t i : indices) {
+          const BoundingBox& box = boxes[i];
+          double size = std::max(box.extent(0), std::max(box.extent(1), box.extent(2)));
+          if (size > 2.0 * child_half_size) {
+            kept.push_back(i);
+            continue;
+          }
+          uint32_t octant = 0;
+          for (int axis = 0; axis < 3; ++axis) {
+            if (box.centroid(axis) >= center[axis]) {
+              octant |= 1u << axis;
+            }
+          }
+          octants[octant].push_back(i);
+        }
+      }
+
+      BoundingBox bounds;
+      _nodes[node_index].first_object = _node_objects.size();
+      _nodes[node_index].object_count = kept.size();
+      for (uint32_t i : kept) {
+        _node_objects.push_back(i);
+        bounds.expand(boxes[i]);
+      }
+
+      uint32_t child_mask = 0;
+      for (uint32_t octant = 0; octant < 8; ++octant) {
+        if (!octants[octant].empty()) {
+          child_mask |= 1u << octant;
+        }
+      }
+      uint32_t first_child = _nodes.size();
+      _nodes[node_index].first_child = first_child;
+      _nodes[node_index].child_mask = child_mask;
+      _nodes.resize(_nodes.size() + popcount(child_mask));
+
+      uint32_t child = first_child;
+      for (uint32_t octant = 0; octant < 8; ++octant) {
+        if (octants[octant].empty()) {
+          continue;
+        }
+        double child_center[3];
+        for (int axis = 0; axis < 3; ++axis) {
+          child_center[axis] = center[axis] +
+            ((octant & (1u << axis)) ? child_half_size : -child_half_size);
+        }
+        build_node(child, child_center, child_half_size, boxes, octants[octant], depth + 1);
+        bounds.expand(_nodes[child].bounds);
+        child++;
+      }
+      _nodes[node_index].bounds = bounds;
+    }
+
+    static uint32_t popcount(uint32_t x) {
+      uint32_t count = 0;
+      for (; x != 0; x &= x - 1) {
+        count++;
+      }
+      return count;
+    }
+  };
+
+  // A reusable group of scene objects with its own acceleration
+  // structure, which SceneInstance places into a scene any number of
+  // times. Add every object before creating the first instance; the
+  // group is built once and then shared by all of its instances.
+  class SceneGroup {
+  private:
+    std::vector<std::shared_ptr<SceneObject>> _objects;
+    std::shared_ptr<Accelerator> _accelerator;
+    BoundingBox _bounds;
+    bool _built;
+
+  public:
+    SceneGroup(std::shared_ptr<Accelerator> accelerator = std::make_shared<BVHAccelerator>())
+      : _accelerator(accelerator), _built(false) {
+      assert(accelerator != nullptr);
+    }
+
+    void add_object(std::shared_ptr<SceneObject> object) {
+      assert(!_built);
+      _objects.push_back(object);
+    }
+
+    size_t object_count() const { return _objects.size(); }
+
+    // Build the group's accelerator, unless it is already built.
+    void build() {
+      if (_built) {
+        return;
+      }
+      assert(!_objects.empty());
+      _accelerator->build(_objects);
+      _bounds.reset();
+      for (const std::shared_ptr<SceneObject>& obj : _objects) {
+        _bounds.expand(obj->bounds());
+      }
+      _built = true;
+    }
+
+    // Box around every object in the group, in the group's own
+    // coordinates. Only valid after build().
+    const BoundingBox& bounds() const {
+      assert(_built);
+      return _bounds;
+    }
+
+    Hit closest_hit(const Vector4& ray_origin,
+                    const Vector4& ray_direction) const {
+      assert(_built);
+      return _accelerator->closest_hit(ray_origin, ray_direction);
+    }
+
+    bool occluded(const Vector4& ray_origin,
+                  const Vector4& ray_direction, double t_max) const {
+      assert(_built);
+      return _accelerator->occluded(ray_origin, ray_direction, t_max);
+    }
+  };
+
+  // One placement of a SceneGroup into a scene, via an affine
+  // transform from group coordinates to world coordinates. This makes
+  // a two-level acceleration structure: the scene's accelerator finds
+  // instances, and each instance hands the ray, transformed into
+  // group coordinates, to the group's accelerator. The ray direction
+  // is not renormalized, so hit times t are the same in both spaces.
+  //
+  // An instance has no material of its own; intersections report the
+  // group object that was hit, whose colors are used for shading. A
+  // hit only records that one object, so groups hold plain objects
+  // rather than other instances.
+  class SceneInstance : public SceneObject {
+  private:
+    std::shared_ptr<SceneGroup> _group;
+    // Group-to-world transform, its inverse, and the inverse
+    // transpose for normals.
+    AffineTransform _transform, _inverse, _normal_transform;
+    BoundingBox _bounds;
+
+  public:
+    SceneInstance(std::shared_ptr<SceneGroup> group, const AffineTransform& transform)
+      : _group(group), _transform(transform) {
+      assert(group != nullptr);
+      _group->build();
+      update_transform();
+    }
+
+    // transform must be affine, i.e. have a bottom row of (0, 0, 0, 1).
+    SceneInstance(std::shared_ptr<SceneGroup> group, const Matrix4x4& transform)
+      : SceneInstance(group, AffineTransform(transform)) { }
+
+    const AffineTransform& transform() const { return _transform; }
+
+    // Groups are traced in double, so a float ray is widened.
+    using SceneObject::intersect;
+
+    virtual Hit intersect(const Vector4& ray_origin,
+                const Vector4& ray_direction) const {
+      Hit group_hit(_group->closest_hit(_inverse.transform_point(ray_origin),
+                                        _inverse.transform_direction(ray_direction)));
+      return group_hit ? Hit{group_hit.t, this, group_hit.object} : Hit::miss();
+    }
+
+    // The group object that was hit is kept in hit.leaf, with the same
+    // t, since the ray direction is not renormalized.
+    virtual Intersection surface(const Vector4& ray_origin,
+                const Vector4& ray_direction, const Hit& hit) const {
+      assert((hit.object == this) && (hit.leaf != nullptr));
+      Vector4 group_origin(_inverse.transform_point(ray_origin)),
+        group_direction(_inverse.transform_direction(ray_direction));
+      Hit group_hit{hit.t, hit.leaf, nullptr};
+      Intersection group_surface(hit.leaf->surface(group_origin, group_direction, group_hit));
+      return Intersection(_transform.transform_point(group_surface.point()),
+                          _normal_transform.transform_direction(group_surface.normal()),
+                          group_surface.t(),
+                          &group_surface.object());
+    }
+
+    virtual bool occludes(const Vector4& ray_origin,
+                const Vector4& ray_direction, double t_max) const {
+      return _group->occluded(_inverse.transform_point(ray_origin),
+                              _inverse.transform_direction(ray_direction), t_max);
+    }
+
+    virtual BoundingBox bounds() const {
+      return _bounds;
+    }
+
+    virtual void translate(const Vector4& displacement) {
+      assert(displacement.is_homogeneous_translation());
+      for (int i = 0; i < 3; ++i) {
+        _transform[i][3] += displacement[i];
+      }
+      update_transform();
+    }
+
+  private:
+    // Recompute everything derived from _transform.
+    void update_transform() {
+      _inverse = _transform.inverse();
+      _normal_transform = _transform.normal_transform();
+
+      // transform the 8 corners of the group's box
+      const BoundingBox& box(_group->bounds());
+      Vector4 corners[8];
+      for (int corner = 0; corner < 8; ++corner) {
+        corners[corner] = Vector4((corner & 1) ? box.max(0) : box.min(0),
+                                  (corner & 2) ? box.max(1) : box.min(1),
+                                  (corner & 4) ? box.max(2) : box.min(2),
+                                  1.0);
+      }
+      gmath::transform_batch(_transform, corners, corners, 8);
+      _bounds.reset();
+      for (const Vector4& p : corners) {
+        _bounds.expand(p[0], p[1], p[2]);
+      }
+    }
+  };
+
+  // Convenience functions to create affine transforms.
+
+  std::shared_ptr<Matrix4x4> identity_matrix() {
+    std::shared_ptr<Matrix4x4> m(new Matrix4x4(0.0));
+    for (int i = 0; i < 4; ++i) {
+      (*m)[i][i] = 1.0;
+    }
+    return m;
+  }
+
+  std::shared_ptr<Matrix4x4> translation_matrix(double x, double y, double z) {
+    std::shared_ptr<Matrix4x4> m(identity_matrix());
+    (*m)[0][3] = x;
+    (*m)[1][3] = y;
+    (*m)[2][3] = z;
+    return m;
+  }
+
+  std::shared_ptr<Matrix4x4> scale_matrix(double s) {
+    std::shared_ptr<Matrix4x4> m(identity_matrix());
+    (*m)[0][0] = (*m)[1][1] = (*m)[2][2] = s;
+    return m;
+  }
+
+  // Rotation by angle radians about the y (up) axis.
+  std::shared_ptr<Matrix4x4> rotation_y_matrix(gmath::angle_type angle) {
+    std::shared_ptr<Matrix4x4> m(identity_matrix());
+    (*m)[0][0] = (*m)[2][2] = cos(angle);
+    (*m)[0][2] = sin(angle);
+    (*m)[2][0] = -sin(angle);
+    return m;
+  }
+
+  // Class for an entire scene, tying together all the other classes
+  // in this module.
+  class Scene {
+  public:
+    // Default for set_tile_size().
+    static const int DEFAULT_TILE_SIZE = 8;
+
+  private:
+    // Ambient light source, to prevent objects that are blocked from
+    // point light sources from being entirely black.
+    std::shared_ptr<Light> _ambient_light;
+
+    // Background color for pixels that do not correspond to any scene
+    // object.
+    std::shared_ptr<Color> _background_color;
+
+    // The camera.
+    std::shared_ptr<Camera> _camera;
+
+    // When true, use the perspective projection; when false, use
+    // orthographic projection.
+    bool _perspective;
+
+    // Vector of all scene objects.
+    std::vector<std::shared_ptr<SceneObject>> _objects;
+
+    // Vector of all point lights.
+    std::vector<std::shared_ptr<PointLight>> _point_lights;
+
+    // Acceleration structure over _objects. It is built lazily, on
+    // the first render after objects change, and reused after that.
+    mutable std::shared_ptr<Accelerator> _accelerator;
+    mutable bool _accelerator_built;
+
+    // True when objects have moved since the accelerator was last
+    // built or refit.
+    mutable bool _accelerator_moved;
+
+    // File to load the accelerator from, or save it to after a
+    // build; empty to always build. True when the last build was
+    // skipped because the file was usable.
+    std::string _accelerator_cache_path;
+    mutable bool _accelerator_cache_hit;
+
+    // Width and height, in pixels, of the square tiles whose viewing
+    // rays are traced together.
+    int _tile_size;
+
+    // When true, generate viewing rays and shade with gmath's fast
+    // approximate kernels (fast_normalized() and multiply_add())
+    // rather than the exact ones.
+    bool _fast_math;
+
+    // When true, a point light only lights a point when no object is
+    // in the way, as found by a shadow ray from the point to the
+    // light; see occluded().
+    bool _shadows;
+
+  public:
+    // Initialize a scene, initially with no objects and no point
+    // lights.
+    Scene(std::shared_ptr<Light> ambient_light,
+        std::shared_ptr<Color> background_color,
+        std::shared_ptr<Camera> camera,
+        bool perspective)
+      : _ambient_light(ambient_light), _background_color(background_color),
+      _camera(camera), _perspective(perspective),
+      _accelerator(new BVHAccelerator), _accelerator_built(false),
+      _accelerator_moved(false), _accelerator_cache_hit(false),
+      _tile_size(DEFAULT_TILE_SIZE),
+      _fast_math(false), _shadows(false) {
+      assert(is_color(*background_color));
+    }
+
+    // Add an object/light. Once the accelerator is built, a new
+    // object is inserted into it, if it allows that, rather than
+    // causing a rebuild.
+    void add_object(std::shared_ptr<SceneObject> object) {
+      _objects.push_back(object);
+      if (_accelerator_built && !_accelerator->insert(object)) {
+        _accelerator_built = false;
+      }
+    }
+    void add_point_light(std::shared_ptr<PointLight> light) { _point_lights.push_back(light); }
+
+    // Access objects, in the order they were added.
+    size_t object_count() const { return _objects.size(); }
+    std::shared_ptr<SceneObject> object(size_t index) const {
+      assert(index < _objects.size());
+      return _objects[index];
+    }
+
+    // Remove the object at index; the objects after it move down one
+    // index. As with add_object(), the accelerator is updated in
+    // place when it allows that.
+    void remove_object(size_t index) {
+      assert(index < _objects.size());
+      std::shared_ptr<SceneObject> object = _objects[index];
+      _objects.erase(_objects.begin() + index);
+      if (_accelerator_built && !_accelerator->remove(object)) {
+        _accelerator_built = false;
+      }
+    }
+
+    // Move an object. Rather than rebuild the accelerator from
+    // scratch, the next render refits it to the new positions, which
+    // is much cheaper for small motions.
+    void translate_object(size_t index, const Vector4& displacement) {
+      assert(index < _objects.size());
+      _objects[index]->translate(displacement);
+      _accelerator_moved = true;
+    }
+
+    // Replace the acceleration structure; a BVHAccelerator by
+    // default.
+    void set_accelerator(std::shared_ptr<Accelerator> accelerator) {
+      assert(accelerator != nullptr);
+      _accelerator = accelerator;
+      _accelerator_built = false;
+    }
+
+    // Trace tiles of size by size pixels together; 1 traces every
+    // viewing ray on its own.
+    void set_tile_size(int size) {
+      assert(size > 0);
+      _tile_size = size;
+    }
+
+    void set_fast_math(bool fast_math) { _fast_math = fast_math; }
+    void set_shadows(bool shadows) { _shadows = shadows; }
+
+    // Cache the acceleration structure in the file at path: load it
+    // from there instead of building it when the file matches the
+    // scene's objects, and otherwise build it and save it there.
+    void set_accelerator_cache(const std::string& path) {
+      _accelerator_cache_path = path;
+      _accelerator_built = false;
+    }
+
+    bool accelerator_cache_hit() const { return _accelerator_cache_hit; }
+
+    // Build or refit the acceleration structure, unless it is
+    // already up to date.
+    void build_accelerator() const {
+      if (!_accelerator_built) {
+        _accelerator_cache_hit = false;
+        if (_accelerator_cache_path.empty()) {
+          _accelerator->build(_objects);
+        } else {
+          uint64_t key = hash_bounds(_objects);
+          _accelerator_cache_hit = _accelerator->load(_accelerator_cache_path, key, _objects);
+          if (!_accelerator_cache_hit) {
+            _accelerator->build(_objects);
+            _accelerator->save(_accelerator_cache_path, key, _objects);
+          }
+        }
+      } else if (_accelerator_moved && !_accelerator->refit()) {
+        _accelerator->build(_objects);
+      }
+      _accelerator_built = true;
+      _accelerator_moved = false;
+    }
+
+    // Render the scene into an image of the given width and height.
+    //
+    // This is the centerpiece of the module, and is responsible for
+    // executing the core raytracing algorithm.
+    //
+    // Viewing rays, shading and the image are computed with SCALAR
+    // precision, and so is tracing, as far as the accelerator and
+    // the objects allow; see Accelerator::closest_hits() and
+    // SceneObject::intersect(). BVHAccelerator, LBVHAccelerator and
+    // SceneSphere compute in float; the rest widen float rays to
+    // double. The scene itself, the node boxes, and the points and
+    // normals of the hits that are shaded are always double.
+    template <typename SCALAR = double>
+    std::shared_ptr<BasicImage<SCALAR> > render(int width, int height) const {
+      typedef typename Precision<SCALAR>::Color color_type;
+      typedef typename Precision<SCALAR>::Vector4 vector_type;
+      // Check out the book, page 84
+      assert(width > 0);
+      assert(height > 0);
+      color_type background_color(*_background_color);
+      std::shared_ptr<BasicImage<SCALAR> > image(new BasicImage<SCALAR>(width, height, background_color));
+      // pixel coordinate positions
+      int i, j;
+      // viewing ray
+      vector_type ray_origin, ray_direction;
+      // one tile's viewing rays, traced in SCALAR, and what each one hits
+      std::vector<vector_type> tile_origins, tile_directions;
+      std::vector<Hit> closest_hits;
+      size_t tile_pixels = size_t(_tile_size) * _tile_size;
+      tile_origins.reserve(tile_pixels);
+      tile_directions.reserve(tile_pixels);
+      closest_hits.reserve(tile_pixels);
+
+      build_accelerator();
+
+      // for each tile
+      for (int tile_j = 0; tile_j < height; tile_j += _tile_size) {
+        for (int tile_i = 0; tile_i < width; tile_i += _tile_size) {
+          int tile_right = std::min(tile_i + _tile_size, width),
+            tile_bottom = std::min(tile_j + _tile_size, height);
+          // compute every viewing ray in the tile
+          tile_origins.clear();
+          tile_directions.clear();
+          for (j = tile_j; j < tile_bottom; ++j) {
+            for (i = tile_i; i < tile_right; ++i) {
+              compute_viewing_ray(ray_origin, ray_direction, width, height, i, j);
+              tile_origins.push_back(ray_origin);
+              tile_directions.push_back(ray_direction);
+            }
+          }
+          // see which object each viewing ray hits
+          closest_hits.assign(tile_origins.size(), Hit::miss());
+          _accelerator->closest_hits(tile_origins.size(), tile_origins.data(), tile_directions.data(),
+                                     closest_hits.data());
+          // for each pixel
+          size_t k = 0;
+          for (j = tile_j; j < tile_bottom; ++j) {
+            for (i = tile_i; i < tile_right; ++i, ++k) {
+              const Hit& closest_hit = closest_hits[k];
+              // if an intersection exists between the viewing ray and scene object
+              if(closest_hit) {
+                // evaluate shading model and set pixel to that color; page 82
+                Intersection intersection(closest_hit.object->surface(Vector4(tile_origins[k]),
+                                                                      Vector4(tile_directions[k]),
+                                                                      closest_hit));
+                image->set_pixel(i, j, evaluate_shading<SCALAR>(intersection.object(), intersection));
+              }
+              else { // no intersection so just draw the background
+                // set pixel color to background color (no hit)
+                image->set_pixel(i, j, background_color);
+              }
+            }
+          }
+        }
+      }
+      return image;
+    }
+
+    Hit get_closest_hit(const Vector4& ray_origin,
+                        const Vector4& ray_direction) const {
+      build_accelerator();
+      return _accelerator->closest_hit(ray_origin, ray_direction);
+    }
+
+    // Return true iff the ray hits any object at some time in
+    // [0, t_max). This finds any hit rather than the closest one, so
+    // it is much cheaper than get_closest_hit() for shadow rays.
+    bool occluded(const Vector4& ray_origin,
+                  const Vector4& ray_direction, double t_max) const {
+      build_accelerator();
+      return _accelerator->occluded(ray_origin, ray_direction, t_max);
+    }
+
+  private:
+    // Offset, along the unit surface normal, from a point to the
+    // origin of its shadow rays, so that they do not hit the surface
+    // they start on due to rounding error.
+    static constexpr double SHADOW_EPSILON = 1e-4;
+
+    // computes viewing ray
+    template <typename SCALAR>
+    void compute_viewing_ray(gmath::Vector<SCALAR, 4>& ray_origin,
+                             gmath::Vector<SCALAR, 4>& ray_direction,
+                             int width, int height, int i, int j) const{
+      typedef gmath::Vector<SCALAR, 4> vector_type;
+      // Page 74 - 76 of book
+      // Ray: A origin point and propagation direction; page 73
+      // what are these again? I think they're the positions in the image (translated); page 75
+      SCALAR u, v;
+      // Camera vectors
+      vector_type vec_u(_camera->u()), vec_v(_camera->v()), vec_w(_camera->w());
+      vector_type location(_camera->location());
+
+      // compute u and v
+      u = _camera->l() + (_camera->r() - _camera->l()) * (i + 0.5) / width;
+      v = _camera->b() + (_camera->t() - _camera->b()) * (j + 0.5) / height;
+
+      if(_fast_math) {
+        if(_perspective) {
+          ray_direction = multiply_add(vec_v, v, multiply_add(vec_u, u, vec_w * -SCALAR(_camera->d())));
+          ray_origin = location;
+        }
+        else {
+          ray_direction = -vec_w;
+          ray_origin = multiply_add(vec_v, v, multiply_add(vec_u, u, location));
+        }
+      }
+      else if(_perspective) {
+        // Perspective transform
+        ray_direction = vec_w * -SCALAR(_camera->d()) + vec_u * u + vec_v * v;
+        ray_origin = location;
+      }
+      else {
+        // Orthographic transform
+        ray_direction = -vec_w;
+        ray_origin = location + vec_u * u + vec_v * v;
+      }
+    }
+    
+    // set pixel to correct color
+    template <typename SCALAR>
+    typename Precision<SCALAR>::Color evaluate_shading(const SceneObject& scene_obj,
+                                                       const Intersection& intersection) const{
+      typedef typename Precision<SCALAR>::Color color_type;
+      typedef typename Precision<SCALAR>::Vector4 vector_type;
+      /*
+        Page 84
+        L = k_a*I_a + sum(k_d * I_i * max(0, n * l))
+
+        Color L = pixel color
+        Color k_a = surface ambient coefficient/color
+        double I_a = ambient light intensity
+        Color k_d = surface color (or combination of surface color and light color)
+        double I_i = intensity of the ith light source
+        Vector4 n = unit surface normal vector
+        Vector4 l = unit light vector
+      */
+
+      // I believe this is the proper way to have the initial value for the accumulator
+      color_type accumulated_color(0.0);
+      // Variables used to calculate and temporarily store the unit light vector
+      vector_type unit_light_vector;
+      vector_type light_displacement;
+      // Variable to store n * l (in max function)
+      SCALAR n_l;
+      // Variable for unit surface normal (of scene object)
+      vector_type normal(intersection.normal()), point(intersection.point());
+      vector_type unit_surface_normal = _fast_math ? normal.fast_normalized() : vector_type(normal / normal.magnitude());
+      color_type diffuse_color(scene_obj.diffuse_color());
+      // Shadow rays are traced in double precision whatever SCALAR is,
+      // as that is what the accelerator works in.
+      Vector4 shadow_origin;
+      if(_shadows) {
+        const Vector4& hit_normal(intersection.normal());
+        shadow_origin = intersection.point() + hit_normal * (SHADOW_EPSILON / hit_normal.magnitude());
+      }
+
+      // for each point light in scene, do the required arithmetic
+      for(const std::shared_ptr<PointLight>& point_light : _point_lights) {
+        // displacment from intersection location to point_light location
+        light_displacement = vector_type(point_light->location()) - point;
+        // find the intensity
+        unit_light_vector = _fast_math ? light_displacement.fast_normalized()
+                                       : vector_type(light_displacement / light_displacement.magnitude());
+        // do fancy arithmetic
+        n_l = unit_surface_normal * unit_light_vector;
+        // a light behind the surface adds nothing, so only trace a
+        // shadow ray towards one in front of it; the ray's direction
+        // reaches the light at t = 1
+        if(_shadows && (n_l > 0) &&
+           occluded(shadow_origin, point_light->location() - shadow_origin, 1.0)) {
+          continue;
+        }
+        if(_fast_math) {
+          accumulated_color = multiply_add(color_multiply(diffuse_color, color_type(point_light->color())),
+                                           SCALAR(point_light->intensity()) * ((n_l > 0) ? n_l : 0),
+                                           accumulated_color);
+        }
+        else {
+          accumulated_color += color_multiply(
+                                   color_type(diffuse_color * SCALAR(point_light->intensity()) * ((n_l > 0) ? n_l : 0)),
+                                   color_type(point_light->color())
+                               );
+        }
+      }
+      accumulated_color = color_type(_ambient_light->color()) * SCALAR(_ambient_light->intensity()) + accumulated_color;
       // NOTE: Set to 1.0 as any "over-exposure" will crash the program
-      for(int i = 0; i < accumulated_color->dimension(); ++i) {
-        (*accumulated_color)[i] = ((*accumulated_color)[i] > 1.0) ? 1.0 : (*accumulated_color)[i];
+      for(int i = 0; i < accumulated_color.dimension(); ++i) {
+        accumulated_color[i] = (accumulated_color[i] > 1.0) ? 1.0 : accumulated_color[i];
       }
       return accumulated_color;
     }